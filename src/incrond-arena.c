@@ -0,0 +1,112 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-arena.c
+*
+* @brief Bump allocator for parsed tabs
+*
+* @par
+* Hooks of one tab load, their argv, compiled templates and resolved
+* commands are carved out of the same few chunks, so everything dispatch
+* reads for a hook is close together. Nothing is freed one by one: hooks
+* only hold a reference, the arena goes away with the last of them. Hooks
+* kept by reload pin the generation they were loaded with, hooks replaced
+* by it release theirs.
+*/
+#include "incrond-arena.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct incron_arena_chunk {
+    struct incron_arena_chunk* next;
+    size_t len;                 ///> used part of data
+    size_t size;                ///> allocated size of data
+    alignas(max_align_t) char data[];
+};
+
+struct incron_arena* arena_new()
+{
+    struct incron_arena* arena = calloc(1, sizeof(struct incron_arena));
+    if(arena == 0)
+        return 0;
+
+    arena->refs = 1;
+
+    return arena;
+}
+
+static void* arena_take(struct incron_arena* arena, size_t size, size_t align)
+{
+    struct incron_arena_chunk* chunk = arena->chunks;
+
+    if(chunk != 0) {
+        size_t off = (chunk->len + align - 1) & ~(align - 1);
+
+        if(off + size <= chunk->size) {
+            chunk->len = off + size;
+            return chunk->data + off;
+        }
+    }
+
+    size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+
+    chunk = malloc(sizeof(struct incron_arena_chunk) + chunk_size);
+    if(chunk == 0)
+        return 0;
+
+    chunk->len = size;
+    chunk->size = chunk_size;
+
+    /** oversized chunk is full anyway, current one keeps being filled */
+    if(size > ARENA_CHUNK_SIZE && arena->chunks != 0) {
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+    } else {
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    return chunk->data;
+}
+
+/** @return zeroed memory aligned for any type */
+void* arena_alloc(struct incron_arena* arena, size_t size)
+{
+    void* ptr = arena_take(arena, size, alignof(max_align_t));
+
+    if(ptr != 0)
+        memset(ptr, 0, size);
+
+    return ptr;
+}
+
+char* arena_strdup(struct incron_arena* arena, const char* str)
+{
+    size_t len = strlen(str) + 1;
+    char* dup = arena_take(arena, len, 1);
+
+    if(dup != 0)
+        memcpy(dup, str, len);
+
+    return dup;
+}
+
+void arena_get(struct incron_arena* arena)
+{
+    arena->refs++;
+}
+
+void arena_put(struct incron_arena* arena)
+{
+    if(arena == 0 || --arena->refs > 0)
+        return;
+
+    while(arena->chunks != 0) {
+        struct incron_arena_chunk* next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+
+    free(arena);
+}
@@ -0,0 +1,25 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_ARENA_H__
+#define __INCROND_ARENA_H__
+
+#include <stddef.h>
+
+/** default chunk size, larger allocations get a chunk of their own */
+#define ARENA_CHUNK_SIZE 4096
+
+struct incron_arena_chunk;
+
+/** memory of one tab generation, released at once with the last hook using it */
+struct incron_arena {
+    unsigned refs;              ///> creator and every hook allocated from it
+    struct incron_arena_chunk* chunks; ///> current chunk first
+};
+
+struct incron_arena* arena_new();
+void* arena_alloc(struct incron_arena* /*arena*/, size_t /*size*/);
+char* arena_strdup(struct incron_arena* /*arena*/, const char* /*str*/);
+void arena_get(struct incron_arena* /*arena*/);
+void arena_put(struct incron_arena* /*arena*/);
+
+#endif
@@ -0,0 +1,150 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-batch.c
+*
+* @brief Events collected for single hook launch
+*
+* @par
+* IN_BATCH hook isn't started per event. Full names of matching files are
+* collected, one per line escaped as IN_STREAM records are, until N events
+* or T ms after the first one, then hook is started once with the list in
+* memfd as its stdin.
+*/
+#include "incrond-batch.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/inotify.h>
+
+#include <linux/limits.h>
+
+#include "incrond-parse-tabs.h"
+#include "incrond-stream.h"
+
+static LIST_HEAD(batches);
+
+struct incron_batch* batch_new(struct incron_hook* hook, struct incron_path* path, incron_timer_func flush)
+{
+    struct incron_batch* batch = calloc(1, sizeof(struct incron_batch));
+    if(batch == 0)
+        return 0;
+
+    batch->hook = hook;
+    batch->path = path;
+    incron_timer_setup(&(batch->timer), flush);
+
+    list_add_tail(&(batch->list), &batches);
+
+    return batch;
+}
+
+int batch_add(struct incron_batch* batch, const struct incron_path* path, const struct inotify_event* event, uint32_t cross)
+{
+    /** escaped name is at most twice as long */
+    size_t need = 2 * (strlen(path->path) + 1 + (event->len > 0 ? strlen(event->name) : 0)) + 2;
+
+    if(batch->len + need > batch->size) {
+        size_t size = batch->size ? batch->size : PATH_MAX;
+
+        while(batch->len + need > size)
+            size *= 2;
+
+        char* buf = realloc(batch->buf, size);
+        if(buf == 0)
+            return -1;
+
+        batch->buf = buf;
+        batch->size = size;
+    }
+
+    char* pos = batch->buf + batch->len;
+    const char* end = batch->buf + batch->size;
+
+    pos = stream_escape(pos, end, path->path);
+
+    if(event->len > 0) {
+        *pos++ = '/';
+        pos = stream_escape(pos, end, event->name);
+    }
+
+    *pos++ = '\n';
+
+    batch->len = pos - batch->buf;
+    batch->count++;
+    batch->cross |= cross;
+
+    return 0;
+}
+
+/** @return memfd with collected list at offset 0, batch is empty afterwards */
+int batch_seal(struct incron_batch* batch)
+{
+    int errsv = 0;
+
+    incron_timer_cancel(&(batch->timer));
+
+    int fd = memfd_create("incron-batch", MFD_CLOEXEC);
+    if(fd == -1)
+        return -1;
+
+    for(size_t off = 0; off < batch->len;) {
+        ssize_t ret = write(fd, batch->buf + off, batch->len - off);
+
+        if(ret == -1) {
+            if(errno == EINTR)
+                continue;
+
+            errsv = errno;
+            goto fail_close;
+        }
+
+        off += ret;
+    }
+
+    if(lseek(fd, 0, SEEK_SET) == -1) {
+        errsv = errno;
+        goto fail_close;
+    }
+
+    batch->len = 0;
+    batch->count = 0;
+    batch->cross = 0;
+
+    return fd;
+
+    fail_close:
+    close(fd);
+
+    errno = errsv;
+    return -1;
+}
+
+void batch_for_each(void (*func)(struct incron_batch*))
+{
+    struct incron_batch *batch = 0, *tmp = 0;
+
+    list_for_each_entry_safe(batch, tmp, &batches, list)
+        func(batch);
+}
+
+void batch_free(struct incron_batch* batch)
+{
+    incron_timer_cancel(&(batch->timer));
+    batch->hook->batch = 0;
+
+    list_del(&(batch->list));
+    free(batch->buf);
+    free(batch);
+}
+
+void batch_free_all()
+{
+    struct incron_batch *batch = 0, *tmp = 0;
+
+    list_for_each_entry_safe(batch, tmp, &batches, list)
+        batch_free(batch);
+}
@@ -0,0 +1,38 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_BATCH_H__
+#define __INCROND_BATCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "list.h"
+#include "incrond-timer.h"
+
+struct incron_hook;
+struct incron_path;
+struct inotify_event;
+
+/** IN_BATCH hook events collected for single launch */
+struct incron_batch {
+    struct incron_hook* hook;   ///> hook batch belongs to
+    struct incron_path* path;   ///> tab path, expanded as $@
+    char* buf;                  ///> list of full file names, one per line
+    size_t len;                 ///> used part of buf
+    size_t size;                ///> allocated size of buf
+    uint32_t count;             ///> events in list
+    uint32_t cross;             ///> ORed event masks, expanded as $% and $&
+    struct timespec time;       ///> latest event time, expanded as $^
+    struct incron_timer timer;  ///> launches batch T ms after its first event
+    struct list_head list;      ///> all batches
+};
+
+struct incron_batch* batch_new(struct incron_hook* /*hook*/, struct incron_path* /*path*/, incron_timer_func /*flush*/);
+int batch_add(struct incron_batch* /*batch*/, const struct incron_path* /*path*/, const struct inotify_event* /*event*/, uint32_t /*cross*/);
+int batch_seal(struct incron_batch* /*batch*/);
+void batch_for_each(void (*/*func*/)(struct incron_batch*));
+void batch_free(struct incron_batch* /*batch*/);
+void batch_free_all();
+
+#endif
@@ -0,0 +1,200 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-cgroup.c
+*
+* @brief cgroup v2 placement of hooks
+*
+* @par
+* Every tab gets its own group <cgroup_root>/system-<tab name> or
+* <cgroup_root>/user-<tab name>, so user tabs give per user groups, every
+* system tab file gets one and neither shares limits with a system tab
+* named after a user. Group is created on
+* first spawn with cgroup_cpu_max, cgroup_memory_max and cgroup_io_weight
+* from incron.conf. Group which already exists keeps its limits, so admin
+* can prepare different limits for particular tab beforehand. Hooks are
+* started directly in the group with clone3(CLONE_INTO_CGROUP) or join it
+* before exec, see spawn_process().
+*/
+#include "incrond-cgroup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <linux/limits.h>
+
+#include "incrond-config.h"
+
+static int cgroup_root_fd = -1;
+static struct incron_cgroup* cgroups = 0;
+
+int cgroup_enabled()
+{
+    return cgroup_root_fd != -1;
+}
+
+static int cgroup_write(int dirfd, const char* file, const char* value)
+{
+    int fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+    if(fd == -1)
+        return -1;
+
+    ssize_t ret = write(fd, value, strlen(value));
+    int errsv = errno;
+
+    close(fd);
+
+    if(ret == -1) {
+        errno = errsv;
+        return -1;
+    }
+
+    return 0;
+}
+
+int cgroup_init()
+{
+    static const char* controllers[] = { "+cpu", "+memory", "+io" };
+    int errsv = 0;
+
+    if(cgroup_root[0] == '\0')
+        return 0;
+
+    if(mkdir(cgroup_root, 0755) == -1 && errno != EEXIST)
+        goto fail;
+
+    cgroup_root_fd = open(cgroup_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(cgroup_root_fd == -1)
+        goto fail;
+
+    /** one by one, missing controller only disables its limit */
+    for(size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        if(cgroup_write(cgroup_root_fd, "cgroup.subtree_control", controllers[i]) == -1)
+            syslog(LOG_WARNING, "enabling %s controller in %s failed with %d:%s",
+                   controllers[i] + 1, cgroup_root, errno, strerror(errno));
+    }
+
+    syslog(LOG_INFO, "starting hooks in cgroups under %s", cgroup_root);
+
+    return 0;
+
+    fail:
+    errsv = errno;
+    syslog(LOG_ERR, "setting up cgroup root %s failed with %d:%s, hooks stay in daemon cgroup",
+           cgroup_root, errsv, strerror(errsv));
+
+    errno = errsv;
+    return -1;
+}
+
+static void cgroup_limit(struct incron_cgroup* cg, const char* file, const char* value)
+{
+    if(value[0] == '\0')
+        return;
+
+    if(cgroup_write(cg->fd, file, value) == -1)
+        syslog(LOG_WARNING, "setting %s of cgroup %s to %s failed with %d:%s",
+               file, cg->name, value, errno, strerror(errno));
+}
+
+static void cgroup_setup(struct incron_cgroup* cg)
+{
+    char weight[32] = "";
+
+    if(mkdirat(cgroup_root_fd, cg->name, 0755) == -1) {
+        if(errno != EEXIST)
+            goto fail;
+
+        cg->fd = openat(cgroup_root_fd, cg->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(cg->fd == -1)
+            goto fail;
+
+        return;
+    }
+
+    cg->fd = openat(cgroup_root_fd, cg->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(cg->fd == -1)
+        goto fail;
+
+    cg->created = 1;
+
+    if(cgroup_io_weight != 0)
+        snprintf(weight, sizeof(weight), "default %u", cgroup_io_weight);
+
+    cgroup_limit(cg, "cpu.max", cgroup_cpu_max);
+    cgroup_limit(cg, "memory.max", cgroup_memory_max);
+    cgroup_limit(cg, "io.weight", weight);
+
+    syslog(LOG_INFO, "created cgroup %s/%s", cgroup_root, cg->name);
+    return;
+
+    fail:
+    syslog(LOG_ERR, "setting up cgroup %s/%s failed with %d:%s, its hooks stay in daemon cgroup",
+           cgroup_root, cg->name, errno, strerror(errno));
+}
+
+/** @return group directory fd for tab, -1 if hook stays in daemon cgroup */
+int cgroup_fd(enum incron_tab_type type, const char* tab)
+{
+    struct incron_cgroup* cg = 0;
+
+    if(cgroup_root_fd == -1 || tab == 0)
+        return -1;
+
+    char name[NAME_MAX + 1];
+    int len = snprintf(name, sizeof(name), "%s-%s", type == TAB_USER ? "user" : "system", tab);
+
+    if(len < 0 || (size_t)len >= sizeof(name))
+        return -1;
+
+    HASH_FIND_STR(cgroups, name, cg);
+
+    if(cg == 0) {
+        cg = calloc(1, sizeof(struct incron_cgroup));
+        if(cg == 0)
+            return -1;
+
+        cg->name = strdup(name);
+        if(cg->name == 0) {
+            free(cg);
+            return -1;
+        }
+
+        /** failed group isn't retried on every spawn */
+        cg->fd = -1;
+        cgroup_setup(cg);
+
+        HASH_ADD_KEYPTR(hh, cgroups, cg->name, strlen(cg->name), cg);
+    }
+
+    return cg->fd;
+}
+
+void cgroup_cleanup()
+{
+    struct incron_cgroup *cg = 0, *tmp = 0;
+
+    HASH_ITER(hh, cgroups, cg, tmp) {
+        if(cg->fd != -1)
+            close(cg->fd);
+
+        /** fails while hooks are still running, group is reused next start */
+        if(cg->created)
+            unlinkat(cgroup_root_fd, cg->name, AT_REMOVEDIR);
+
+        HASH_DEL(cgroups, cg);
+        free(cg->name);
+        free(cg);
+    }
+
+    if(cgroup_root_fd != -1)
+        close(cgroup_root_fd);
+
+    cgroup_root_fd = -1;
+}
@@ -0,0 +1,22 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_CGROUP_H__
+#define __INCROND_CGROUP_H__
+
+#include "uthash.h"
+#include "incrond-parse-tabs.h"
+
+/** cgroup v2 group hooks of one tab are started in */
+struct incron_cgroup {
+    char* name;                 ///> group directory name, system-<tab> or user-<tab>
+    int fd;                     ///> group directory, -1 if it couldn't be set up
+    int created;                ///> group was created by daemon and is removed on exit
+    UT_hash_handle hh;          ///> makes this structure hashable by name
+};
+
+int cgroup_enabled();
+int cgroup_init();
+int cgroup_fd(enum incron_tab_type /*type*/, const char* /*tab*/);
+void cgroup_cleanup();
+
+#endif
@@ -32,9 +32,11 @@
 
 /** */
 int system_table_dir_fd;
+char *system_table_dir;
 int set_system_table_dir(const char* value, bool clean)
 {
-    UNUSED(clean);
+    if(clean) free(system_table_dir);
+    system_table_dir = strndup(value, PATH_MAX);
     system_table_dir_fd = open(value, O_DIRECTORY);
     if(system_table_dir_fd != -1) return 0;
     return -1;
@@ -92,6 +94,296 @@ int set_editor(const char* value, bool clean)
     return 0;
 }
 
+/** strtoul wraps negative values around, number has to start with a digit and fit */
+static int parse_ulong(const char* value, char** end, unsigned long* out)
+{
+    errno = 0;
+    *out = strtoul(value, end, 10);
+
+    if(value[0] < '0' || value[0] > '9' || errno == ERANGE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/** upper bound for single read of inotify queue */
+size_t inotify_read_max;
+int set_inotify_read_max(const char* value, bool clean)
+{
+    UNUSED(clean);
+    char* end = 0;
+    unsigned long v = 0;
+
+    if(parse_ulong(value, &end, &v) == -1 || *end != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    inotify_read_max = v;
+    return 0;
+}
+
+/** keep directory snapshots to recover events lost on queue overflow */
+int overflow_rescan;
+int set_overflow_rescan(const char* value, bool clean)
+{
+    UNUSED(clean);
+    char* end = 0;
+    long v = strtol(value, &end, 10);
+
+    if(end == value || *end != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    overflow_rescan = v != 0;
+    return 0;
+}
+
+int crawl_threads;
+int set_crawl_threads(const char* value, bool clean)
+{
+    UNUSED(clean);
+    char* end = 0;
+    long v = strtol(value, &end, 10);
+
+    if(end == value || *end != '\0' || v < 0 || v > 256) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    crawl_threads = v;
+    return 0;
+}
+
+/** 0 means one per online CPU */
+int load_threads;
+int set_load_threads(const char* value, bool clean)
+{
+    UNUSED(clean);
+    char* end = 0;
+    long v = strtol(value, &end, 10);
+
+    if(end == value || *end != '\0' || v < 0 || v > 256) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    load_threads = v;
+    return 0;
+}
+
+unsigned inotify_instances;
+int set_inotify_instances(const char* value, bool clean)
+{
+    UNUSED(clean);
+    char* end = 0;
+    long v = strtol(value, &end, 10);
+
+    if(end == value || *end != '\0' || v < 1 || v > 64) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    inotify_instances = v;
+    return 0;
+}
+
+enum event_backend event_backend;
+int set_event_backend(const char* value, bool clean)
+{
+    UNUSED(clean);
+
+    if(strcmp(value, "inotify") == 0)
+        event_backend = EVENT_BACKEND_INOTIFY;
+    else if(strcmp(value, "fanotify") == 0)
+        event_backend = EVENT_BACKEND_FANOTIFY;
+    else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+enum spawn_method spawn_method;
+int set_spawn_method(const char* value, bool clean)
+{
+    UNUSED(clean);
+
+    if(strcmp(value, "fork") == 0)
+        spawn_method = SPAWN_FORK;
+    else if(strcmp(value, "clone") == 0)
+        spawn_method = SPAWN_CLONE;
+    else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int spawn_helper;
+int set_spawn_helper(const char* value, bool clean)
+{
+    UNUSED(clean);
+    char* end = 0;
+    long v = strtol(value, &end, 10);
+
+    if(end == value || *end != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    spawn_helper = v != 0;
+    return 0;
+}
+
+static int parse_rate(const char* value, uint32_t* out)
+{
+    char* end = 0;
+    long v = strtol(value, &end, 10);
+
+    if(end == value || *end != '\0' || v < 0 || v > 1000000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *out = v;
+    return 0;
+}
+
+uint32_t spawn_rate;
+int set_spawn_rate(const char* value, bool clean)
+{
+    UNUSED(clean);
+    return parse_rate(value, &spawn_rate);
+}
+
+uint32_t spawn_burst;
+int set_spawn_burst(const char* value, bool clean)
+{
+    UNUSED(clean);
+    return parse_rate(value, &spawn_burst);
+}
+
+uint32_t user_spawn_rate;
+int set_user_spawn_rate(const char* value, bool clean)
+{
+    UNUSED(clean);
+    return parse_rate(value, &user_spawn_rate);
+}
+
+uint32_t user_spawn_burst;
+int set_user_spawn_burst(const char* value, bool clean)
+{
+    UNUSED(clean);
+    return parse_rate(value, &user_spawn_burst);
+}
+
+/** empty disables cgroup placement */
+char cgroup_root[PATH_MAX];
+int set_cgroup_root(const char* value, bool clean)
+{
+    UNUSED(clean);
+
+    if(value[0] != '\0' && value[0] != '/') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    strncpy(cgroup_root, value, PATH_MAX - 1);
+    return 0;
+}
+
+/** <quota>/<period> or max, stored as cpu.max expects it */
+char cgroup_cpu_max[64];
+int set_cgroup_cpu_max(const char* value, bool clean)
+{
+    UNUSED(clean);
+    char* end = 0;
+
+    if(value[0] == '\0' || strcmp(value, "max") == 0) {
+        strcpy(cgroup_cpu_max, value);
+        return 0;
+    }
+
+    unsigned long quota = 0;
+    unsigned long period = 100000;
+
+    if(parse_ulong(value, &end, &quota) == -1 || (*end != '\0' && *end != '/'))
+        goto fail;
+
+    if(*end == '/') {
+        const char* p = end + 1;
+
+        if(parse_ulong(p, &end, &period) == -1 || *end != '\0')
+            goto fail;
+    }
+
+    snprintf(cgroup_cpu_max, sizeof(cgroup_cpu_max), "%lu %lu", quota, period);
+    return 0;
+
+    fail:
+    errno = EINVAL;
+    return -1;
+}
+
+/** bytes with optional K, M, G suffix or max, passed to memory.max as is */
+char cgroup_memory_max[32];
+int set_cgroup_memory_max(const char* value, bool clean)
+{
+    UNUSED(clean);
+    char* end = 0;
+
+    if(value[0] != '\0' && strcmp(value, "max") != 0) {
+        unsigned long bytes = 0;
+
+        if(parse_ulong(value, &end, &bytes) == -1 ||
+           (*end != '\0' && (strchr("KMG", *end) == 0 || end[1] != '\0'))) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    strncpy(cgroup_memory_max, value, sizeof(cgroup_memory_max) - 1);
+    return 0;
+}
+
+unsigned cgroup_io_weight;
+int set_cgroup_io_weight(const char* value, bool clean)
+{
+    UNUSED(clean);
+    char* end = 0;
+    long v = strtol(value, &end, 10);
+
+    /** 0 keeps kernel default */
+    if(end == value || *end != '\0' || v < 0 || v > 10000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cgroup_io_weight = v;
+    return 0;
+}
+
+/** empty disables compiled tab snapshot */
+char tab_cache[PATH_MAX];
+int set_tab_cache(const char* value, bool clean)
+{
+    UNUSED(clean);
+
+    if(value[0] != '\0' && value[0] != '/') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    strncpy(tab_cache, value, PATH_MAX - 1);
+    return 0;
+}
+
 struct incron_config_opt opts[] = {
     {"system_table_dir", "/etc/incron.d", set_system_table_dir, LOG_WARNING},
     {"user_table_dir", "/var/spool/incron", set_user_table_dir, LOG_WARNING},
@@ -100,6 +392,23 @@ struct incron_config_opt opts[] = {
     {"lockfile_dir", "/var/run", set_lockfile_dir, LOG_CRIT},
     {"lockfile_name", "incrond", set_lockfile_name, LOG_CRIT},
     {"editor", "", set_editor, LOG_INFO},
+    {"inotify_read_max", "262144", set_inotify_read_max, LOG_WARNING},
+    {"overflow_rescan", "1", set_overflow_rescan, LOG_WARNING},
+    {"crawl_threads", "0", set_crawl_threads, LOG_WARNING},
+    {"load_threads", "0", set_load_threads, LOG_WARNING},
+    {"event_backend", "inotify", set_event_backend, LOG_WARNING},
+    {"inotify_instances", "1", set_inotify_instances, LOG_WARNING},
+    {"spawn_method", "clone", set_spawn_method, LOG_WARNING},
+    {"spawn_helper", "1", set_spawn_helper, LOG_WARNING},
+    {"spawn_rate", "0", set_spawn_rate, LOG_WARNING},
+    {"spawn_burst", "0", set_spawn_burst, LOG_WARNING},
+    {"user_spawn_rate", "0", set_user_spawn_rate, LOG_WARNING},
+    {"user_spawn_burst", "0", set_user_spawn_burst, LOG_WARNING},
+    {"cgroup_root", "", set_cgroup_root, LOG_WARNING},
+    {"cgroup_cpu_max", "", set_cgroup_cpu_max, LOG_WARNING},
+    {"cgroup_memory_max", "", set_cgroup_memory_max, LOG_WARNING},
+    {"cgroup_io_weight", "0", set_cgroup_io_weight, LOG_WARNING},
+    {"tab_cache", "", set_tab_cache, LOG_WARNING},
     {0, 0, 0}
 };
 
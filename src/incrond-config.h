@@ -5,10 +5,14 @@
 
 #include <linux/limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "list.h"
+#include "incrond-spawn.h"
 
 extern int system_table_dir_fd;
+extern char *system_table_dir;
 extern int user_table_dir_fd;
 extern char *user_table_dir;
 extern char *allowed_users_file;
@@ -16,6 +20,29 @@ extern char *denied_users_file;
 extern int lockfile_dir_fd;
 extern char lockfile_name[NAME_MAX];
 extern char editor_name[NAME_MAX];
+extern size_t inotify_read_max;
+extern int overflow_rescan;
+extern int crawl_threads;
+extern int load_threads;
+extern unsigned inotify_instances;
+
+enum event_backend {
+    EVENT_BACKEND_INOTIFY,      ///< per directory inotify watches
+    EVENT_BACKEND_FANOTIFY,     ///< fanotify filesystem marks
+};
+
+extern enum event_backend event_backend;
+extern enum spawn_method spawn_method;
+extern int spawn_helper;
+extern uint32_t spawn_rate;
+extern uint32_t spawn_burst;
+extern uint32_t user_spawn_rate;
+extern uint32_t user_spawn_burst;
+extern char cgroup_root[PATH_MAX];
+extern char cgroup_cpu_max[64];
+extern char cgroup_memory_max[32];
+extern unsigned cgroup_io_weight;
+extern char tab_cache[PATH_MAX];
 
 typedef int (*set_value_func)(const char*, bool);
 
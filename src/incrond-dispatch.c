@@ -12,14 +12,27 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <pwd.h>
 
 #include <syslog.h>
 
 #include "incrond.h"
+#include "incrond-loop.h"
 
 #include "incrond-parse-tabs.h"
+#include "incrond-config.h"
 #include "incrond-exec.h"
+#include "incrond-spawn.h"
+#include "incrond-spawner.h"
+#include "incrond-stream.h"
+#include "incrond-timer.h"
+#include "incrond-recursive.h"
+#include "incrond-ratelimit.h"
+#include "incrond-cgroup.h"
+#include "incrond-batch.h"
 
 #include "uthash.h"
 
@@ -28,11 +41,63 @@
 struct pid_list_t {
     pid_t pid;
     struct incron_hook *hook;
+    struct epoll_wrapper w;     ///> pidfd registered in main loop, fd is -1 if child isn't tracked by pidfd
+    int remote;                 ///> spawned and reaped by spawn helper
+    struct list_head pending;   ///> waiting for pid from spawn helper
     UT_hash_handle hh;
 };
 
 struct pid_list_t* pid_list = 0;
 
+/** requests sent to spawn helper, replies come in the same order */
+static LIST_HEAD(spawner_pending);
+
+/** main loop epoll children pidfds are added to, -1 if there is none */
+static int dispatch_epollfd = -1;
+struct timespec dispatch_time;
+static int pidfd_supported = 1;
+static unsigned untracked_children = 0;
+
+void dispatch_set_epoll(int epollfd)
+{
+    dispatch_epollfd = epollfd;
+}
+
+/** register pidfd so exit of this exact child wakes the loop */
+static void track_child(struct pid_list_t* child)
+{
+    child->w.type = PID_FD;
+    child->w.fd = -1;
+
+    if(dispatch_epollfd == -1 || !pidfd_supported)
+        goto untracked;
+
+    int fd = syscall(SYS_pidfd_open, child->pid, 0);
+
+    if(fd == -1) {
+        if(errno == ENOSYS) {
+            syslog(LOG_WARNING, "pidfd_open isn't supported, reaping children on SIGCHLD");
+            pidfd_supported = 0;
+        }
+
+        goto untracked;
+    }
+
+    child->w.event.events = EPOLLIN;
+    child->w.event.data.ptr = &child->w;
+
+    if(epoll_ctl(dispatch_epollfd, EPOLL_CTL_ADD, fd, &child->w.event) == -1) {
+        close(fd);
+        goto untracked;
+    }
+
+    child->w.fd = fd;
+    return;
+
+    untracked:
+    untracked_children++;
+}
+
 static char text_argument_list[MAX_TEXT_ARGS_STRLEN];
 
 char* print_text_events(uint32_t events)
@@ -63,210 +128,907 @@ static char* print_num_events(uint32_t events)
 }
 
 static char two_dollars[3] = "$$";
-/** @todo calculate size of arg string on loadTabs */
 char* bash_arg = "/bin/bash";
 char* bash_arg1 = "-c";
 char shell_arg[ARG_MAX];
 
-char **build_shell_argv(const struct incron_path* path, const struct incron_hook *hook, const struct inotify_event* event, uint32_t cross)
+/** expanded $ arguments of one event */
+struct hook_arg_values {
+    const char* str[TAB_ARG_MAX];
+    size_t len[TAB_ARG_MAX];
+};
+
+static void hook_arg_values(struct hook_arg_values* v, const struct incron_hook_template* tpl,
+                            const struct incron_path* path, const struct inotify_event* event,
+                            uint32_t cross)
 {
-    /** form  args list */
-    char** argv = (char**)malloc(4*sizeof(char*));
+    static char time_argument[32];
 
-    argv[0] = bash_arg;
-    argv[1] = bash_arg1;
-    argv[2] = shell_arg;
-    argv[3] = 0;
+    memset(v, 0, sizeof(struct hook_arg_values));
 
-    struct incron_hook_arg* arg = 0;
+    /** $$ is passed to shell as is */
+    v->str[TAB_ARG_DOLLAR] = two_dollars;
+    v->str[TAB_ARG_PATH] = path->path;
+    v->str[TAB_ARG_EVENT_FILENAME] = event->len > 0 ? event->name : "";
 
-    arg = list_first_entry(&(hook->arg_list), struct incron_hook_arg, list);
+    /** formatting only what command uses */
+    if(tpl->arg_cnt[TAB_ARG_EVENT_TEXT])
+        v->str[TAB_ARG_EVENT_TEXT] = print_text_events(cross);
 
+    if(tpl->arg_cnt[TAB_ARG_EVENT_NUM])
+        v->str[TAB_ARG_EVENT_NUM] = print_num_events(cross);
+
+    if(tpl->arg_cnt[TAB_ARG_EVENT_TIME]) {
+        snprintf(time_argument, sizeof(time_argument), "%ld.%09ld",
+                 (long)dispatch_time.tv_sec, dispatch_time.tv_nsec);
+        v->str[TAB_ARG_EVENT_TIME] = time_argument;
+    }
+
+    for(int i = 0; i < TAB_ARG_MAX; i++)
+        if(tpl->arg_cnt[i] && v->str[i])
+            v->len[i] = strlen(v->str[i]);
+}
+
+/**
+ * @brief expand compiled command into shell_arg
+ *
+ * Arguments are separated by space for bash -c or by zero for direct exec,
+ * in the latter case tpl->argv points to every argument.
+ *
+ * @return 0 on success, -1 if expanded command doesn't fit
+ */
+static int expand_hook(const struct incron_hook* hook, const struct incron_path* path,
+                       const struct inotify_event* event, uint32_t cross)
+{
+    const struct incron_hook_template* tpl = &(hook->tpl);
+    struct hook_arg_values v;
+    size_t size = tpl->literal_len + hook->argc + 1;
+
+    if(tpl->argv == 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    hook_arg_values(&v, tpl, path, event, cross);
+
+    for(int i = 0; i < TAB_ARG_MAX; i++)
+        size += tpl->arg_cnt[i] * v.len[i];
+
+    if(size > sizeof(shell_arg)) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    char sep = hook->direct ? '\0' : ' ';
+    char* pos = shell_arg;
     int j = 0;
-    int offset = 0;
-    int len = 0;
-    while(hook->argv[j] != 0) {
-        debug_printf_n("hook->argv[%d] = %s", j, hook->argv[j]);
-
-        if(arg && arg->index == j) {
-            debug_printf_n("found incron arg[%u] at %u", arg->index, arg->pos);
-
-            while(arg && arg->index == j) {
-                memcpy(shell_arg + offset, hook->argv[j], arg->pos);
-                offset += arg->pos;
-
-                char* r_arg = 0; /** replace string */
-
-                switch(arg->arg) {
-                    case TAB_ARG_DOLLAR:
-                        /** do nothing, why should do anything in this case ?*/
-                        /** i don't get why original incron considered this as a special case*/
-                        r_arg = two_dollars;
-                        break;
-                    case TAB_ARG_PATH:
-                        r_arg = path->path;
-                        break;
-                    case TAB_ARG_EVENT_FILENAME:
-                        if(event->len > 0)
-                            r_arg = (char*)event->name;
-                        else {
-                            debug_printf_n("event->name is empty replacing with nothing");
-                        }
-                        break;
-                    case TAB_ARG_EVENT_TEXT:
-                        r_arg = print_text_events(cross);
-                        break;
-                    case TAB_ARG_EVENT_NUM:
-                        r_arg = print_num_events(cross);
-                        break;
-                    default:
-                        break;
-                }
 
-                if(r_arg) {
-                    len = strlen(r_arg) + 1;
-                    memcpy(shell_arg + offset, r_arg, len);
-                    offset += len;
-                    shell_arg[offset - 1] = ' ';
-                }
+    if(hook->direct)
+        tpl->argv[j++] = hook->command;
 
-                if(!list_is_last(&(arg->list), &(hook->arg_list)))
-                    arg = list_next_entry(arg, list);
-                else
-                    arg = 0;
-            }
-        } else {
-            len = strlen(hook->argv[j]) + 1;
-            strncpy(shell_arg + offset, hook->argv[j], len);
-            offset += len;
-            shell_arg[offset - 1] = ' ';
+    for(uint32_t i = 0; i < tpl->seg_cnt; i++) {
+        const struct incron_hook_seg* seg = &(tpl->segs[i]);
+
+        memcpy(pos, tpl->text + seg->offset, seg->len);
+        pos += seg->len;
+
+        if(seg->arg != TAB_ARG_MAX) {
+            memcpy(pos, v.str[seg->arg], v.len[seg->arg]);
+            pos += v.len[seg->arg];
         }
 
-        j++;
-    };
+        if(seg->last) {
+            *pos++ = sep;
+
+            /** first argument is replaced by executable resolved at load */
+            if(hook->direct && j < hook->argc)
+                tpl->argv[j++] = pos;
+        }
+    }
+
+    if(hook->direct) {
+        tpl->argv[hook->argc] = 0;
+        return 0;
+    }
 
-    shell_arg[offset - 1] = '\0';
+    /** last separator */
+    if(pos > shell_arg)
+        pos--;
+    *pos = '\0';
 
-    // shell_arg
     debug_printf_n("shell_arg = %s", shell_arg);
 
-    return argv;
+    tpl->argv[0] = bash_arg;
+    tpl->argv[1] = bash_arg1;
+    tpl->argv[2] = shell_arg;
+    tpl->argv[3] = 0;
+
+    return 0;
 }
 
-#ifdef GCOV
-void __gcov_flush(void);
-#endif
+static void hook_spawn_attr(const struct incron_hook* hook, struct spawn_attr* attr)
+{
+    attr->uid = hook->pw_uid;
+    attr->gid = hook->pw_gid;
+    attr->dir = 0;
+    attr->set_user = 0;
+    attr->stdin_fd = -1;
+    attr->cgroup_fd = cgroup_fd(hook->tab_type, hook->tab);
+
+    /** change dirs, uid, gid */
+    if(hook->pw_uid != getuid()) {
+        debug_printf_n("hook->pw_uid != getuid() : %d != %d", hook->pw_uid, getuid());
+        attr->set_user = 1;
+        attr->dir = hook->pw_dir;
+    }
+}
 
-static void prepare_and_exec(struct incron_path* path,
-                             const struct inotify_event* event,
-                             const struct incron_hook *hook,
-                             uint32_t cross) __attribute__ ((noreturn));
+static struct pid_list_t* add_child(struct incron_hook* hook, pid_t pid)
+{
+    struct pid_list_t* child = (struct pid_list_t*)malloc(sizeof(struct pid_list_t));
+    if(child == 0)
+        return 0;
 
-static void prepare_and_exec(struct incron_path* path,
-                            const struct inotify_event* event,
-                            const struct incron_hook *hook,
-                            uint32_t cross)
+    child->hook = hook;
+    child->pid = pid;
+    child->remote = 0;
+    HASH_ADD(hh, pid_list, pid, sizeof(pid_t), child);
+
+    track_child(child);
+
+    return child;
+}
+
+static int spawn_hook_stdin(struct incron_path* path, const struct inotify_event* event, struct incron_hook* hook,
+                            uint32_t cross, int stdin_fd)
 {
-    /** @todo check if no loop and hook already in progress */
     /** @todo check if oneshot already fired */
-    /** @todo check if fire delay is set */
-    /** @todo alter look for ps command */
 
-    /** setsid */
-    pid_t pid = setsid();
+    struct spawn_attr attr;
+    hook_spawn_attr(hook, &attr);
+    attr.stdin_fd = stdin_fd;
 
-    if(pid == (pid_t)-1)
-    {
-        syslog(LOG_WARNING, "failed setsid with %d : %s", errno, strerror(errno));
+    const char* path_env = getenv("PATH");
+    char pathenv[(path_env ? strlen(path_env) : 0) + sizeof("PATH=")];
+    sprintf(pathenv, "PATH=%s", path_env ? path_env : "");
+    char *envp[] = {pathenv, 0};
+
+    /** argv is prepared here, so child only switches user and execs */
+    if(expand_hook(hook, path, event, cross) == -1)
+        return -1;
+
+    char **argv = hook->tpl.argv;
+
+    /** helper replies with pid later, daemon spawns itself if helper is gone or busy */
+    if(spawner_fd() != -1) {
+        struct pid_list_t* pending = (struct pid_list_t*)malloc(sizeof(struct pid_list_t));
+
+        if(pending != 0 && spawner_request(hook->command, argv, envp, &attr) == 0) {
+            hook->fired = 1;
+            hook->running++;
+
+            pending->hook = hook;
+            pending->pid = -1;
+            pending->remote = 1;
+            list_add_tail(&pending->pending, &spawner_pending);
+
+            return 0;
+        }
+
+        free(pending);
     }
 
-    if(hook->pw_uid != getuid()) {
-        debug_printf_n("hook->pw_uid != getuid() : %d != %d", hook->pw_uid, getuid());
+    pid_t pid = spawn_process(spawn_method, hook->command, argv, envp, &attr);
+
+    if(pid == -1)
+        return -1;
+
+    hook->fired = 1;
+
+    /** child is running anyway, it just won't be accounted, nothing would release its slot */
+    if(add_child(hook, pid) == 0)
+        syslog(LOG_ERR, "tracking child [%d] failed with %d:%s", pid, errno, strerror(errno));
+    else
+        hook->running++;
+
+    syslog(LOG_NOTICE, "spawned child %s [%d]", hook->command, pid);
+
+    return 0;
+}
+
+static int spawn_hook(struct incron_path* path, const struct inotify_event* event, struct incron_hook* hook, uint32_t cross)
+{
+    return spawn_hook_stdin(path, event, hook, cross, -1);
+}
+
+static int start_stream(struct incron_hook* hook)
+{
+    struct spawn_attr attr;
+    hook_spawn_attr(hook, &attr);
+
+    pid_t pid = stream_start(hook->stream, &attr);
+    if(pid == -1)
+        return -1;
+
+    hook->fired = 1;
+
+    if(add_child(hook, pid) == 0)
+        syslog(LOG_ERR, "tracking stream [%d] failed with %d:%s", pid, errno, strerror(errno));
+
+    return 0;
+}
+
+static void restart_stream(struct incron_timer* timer)
+{
+    struct incron_stream* stream = container_of(timer, struct incron_stream, restart);
+
+    if(stream->pid != -1)
+        return;
+
+    if(start_stream(stream->hook) == -1) {
+        syslog(LOG_ERR, "restarting stream %s failed with %d:%s", stream->command, errno, strerror(errno));
+        incron_timer_arm(timer, STREAM_RESTART_MS);
+    }
+}
+
+static void stream_finished(struct incron_stream* stream)
+{
+    uint64_t lived = incron_timer_now() - stream->started;
+    uint64_t wait = lived < STREAM_RESTART_MS ? STREAM_RESTART_MS - lived : 0;
+
+    stream_exited(stream);
+
+    syslog(LOG_NOTICE, "stream %s exited, restarting in %lu ms", stream->command, (unsigned long)wait);
+    incron_timer_arm(&(stream->restart), wait);
+}
+
+/** process is started by first event and restarted whenever it exits */
+static int stream_hook(struct incron_path* path, const struct inotify_event* event, struct incron_hook* hook)
+{
+    if(hook->stream == 0) {
+        hook->stream = stream_new(hook, restart_stream);
+
+        if(hook->stream == 0)
+            return -1;
+    }
+
+    /** record is counted as dropped while waiting for restart */
+    if(hook->stream->pid == -1 && !incron_timer_pending(&(hook->stream->restart)) &&
+       start_stream(hook) == -1)
+        return -1;
+
+    return stream_write(hook->stream, path, event);
+}
+
+/** event rebuilt from stored path, mask and name */
+static struct inotify_event* make_event(char* buffer, const struct incron_path* path, uint32_t cross,
+                                        const char* name, size_t name_len)
+{
+    struct inotify_event* event = (struct inotify_event*)buffer;
+
+    event->wd = path->wfd;
+    event->mask = cross;
+    event->cookie = 0;
+    event->len = name_len ? name_len + 1 : 0;
+    memcpy(event->name, name, name_len);
+    event->name[name_len] = '\0';
+
+    return event;
+}
+
+static void hook_dropped(struct incron_hook* hook)
+{
+    hook->dropped++;
+
+    /** 1, 2, 4, 8... so storm doesn't flood log */
+    if((hook->dropped & (hook->dropped - 1)) == 0)
+        syslog(LOG_WARNING, "hook %s queue is full, %lu events dropped so far", hook->argv[0], hook->dropped);
+}
 
-        /** change dirs, uid, gid */
-        size_t bufsize = sysconf(_SC_GETPW_R_SIZE_MAX);
-        char buffer[bufsize];
-        struct passwd pwd;
-        struct passwd *result;
-
-        /** change to user directory */
-        int ret = getpwuid_r(hook->pw_uid, &pwd, buffer, bufsize, &result);
-        if(ret != 0) {
-            syslog(LOG_CRIT, "failed getting user (uid=%d) creditals after fork with [%d] : %s", hook->pw_uid, ret , strerror(ret));
-            exit(EXIT_FAILURE);
+/** hook is running max_spawn instances, event waits for one of them to finish */
+static int queue_hook(struct incron_path* path, const struct inotify_event* event, struct incron_hook* hook, uint32_t cross)
+{
+    const char* name = event->len > 0 ? event->name : "";
+    size_t name_len = strlen(name);
+    struct incron_queued_event* q = 0;
+
+    if(hook->overflow == OVERFLOW_COALESCE) {
+        list_for_each_entry(q, &(hook->queue), list) {
+            if(q->path == path && q->name_len == name_len && memcmp(q->name, name, name_len) == 0) {
+                q->cross |= cross;
+                q->time = dispatch_time;
+                hook->coalesced++;
+                return 0;
+            }
         }
+    }
 
-        ret = chdir(pwd.pw_dir);
-        if(ret == -1) {
-            syslog(LOG_CRIT, "failed changing user (uid=%d) dir to %s with [%d] : %s", hook->pw_uid, pwd.pw_dir, errno, strerror(errno));
-            exit(EXIT_FAILURE);
+    if(hook->queue_len >= hook->queue_max) {
+        if(hook->overflow != OVERFLOW_DROP_OLDEST || hook->queue_len == 0) {
+            hook_dropped(hook);
+            return 0;
         }
 
-        /** set git first since once we set uid, we've lost root privledges, set uid*/
-        if (setgid(hook->pw_gid) == -1 || setuid(hook->pw_uid) == -1) {
-            syslog(LOG_CRIT, "failed setting user gid/uid after fork with [%d] : %s", errno , strerror(errno));
-            exit(EXIT_FAILURE);
+        q = list_first_entry(&(hook->queue), struct incron_queued_event, list);
+        list_del(&(q->list));
+        free(q);
+        hook->queue_len--;
+        hook_dropped(hook);
+    }
+
+    q = malloc(sizeof(struct incron_queued_event) + name_len + 1);
+    if(q == 0)
+        return -1;
+
+    q->path = path;
+    q->cross = cross;
+    q->time = dispatch_time;
+    q->name_len = name_len;
+    memcpy(q->name, name, name_len + 1);
+
+    list_add_tail(&(q->list), &(hook->queue));
+    hook->queue_len++;
+    hook->queued++;
+
+    return 0;
+}
+
+/** events caused by hook itself are expected while it runs and shortly after */
+static int hook_looping(const struct incron_hook* hook)
+{
+    if(hook->running > 0)
+        return 1;
+
+    return hook->loop_grace != 0 && incron_timer_now() < hook->loop_until;
+}
+
+/** events waiting for spawn rate limit tokens */
+struct throttled_hook_t {
+    struct incron_path* path;
+    struct incron_hook* hook;
+    struct throttle_user_t* user;
+    uint32_t cross;             ///> ORed event masks
+    struct timespec time;       ///> latest event time
+    struct list_head list;      ///> user throttle FIFO
+    struct list_head hook_list; ///> hook throttle FIFO
+
+    UT_hash_handle hh;
+
+    size_t key_len;
+    char key[];                 ///> hook | path | event name
+};
+
+/** throttled events of one user, freed once they are all released */
+struct throttle_user_t {
+    uid_t uid;
+    struct list_head events;    ///> struct throttled_hook_t FIFO
+    struct list_head list;      ///> users in order they got throttled
+
+    UT_hash_handle hh;          ///> makes this structure hashable by uid
+};
+
+static LIST_HEAD(throttle_users);
+static struct throttle_user_t* throttle_users_hash = 0;
+static struct throttled_hook_t* throttled_hooks = 0;
+static struct incron_timer throttle_timer;
+static unsigned long throttle_coalesced = 0;
+
+static void hook_instance_done(struct incron_hook* /*hook*/);
+static int launch_batch(struct incron_batch* /*batch*/, int /*force*/);
+static int batch_due(const struct incron_batch* /*batch*/);
+
+static void throttle_arm(uint64_t expires)
+{
+    if(!incron_timer_pending(&throttle_timer) || expires < throttle_timer.expires)
+        incron_timer_arm_at(&throttle_timer, expires);
+}
+
+static struct throttle_user_t* throttle_user(uid_t uid)
+{
+    struct throttle_user_t* u = 0;
+
+    HASH_FIND(hh, throttle_users_hash, &uid, sizeof(uid_t), u);
+
+    return u;
+}
+
+static void throttle_user_free(struct throttle_user_t* u)
+{
+    list_del(&(u->list));
+    HASH_DEL(throttle_users_hash, u);
+    free(u);
+}
+
+/** user is kept while its events are walked, caller frees it once they are gone */
+static void throttle_remove(struct throttled_hook_t* t, uint64_t now)
+{
+    list_del(&(t->list));
+    list_del(&(t->hook_list));
+    HASH_DEL(throttled_hooks, t);
+    t->hook->throttled_len--;
+    ratelimit_released(t->hook->pw_uid, now);
+}
+
+/** drops event, freeing user if it was the last one */
+static void throttle_drop(struct throttled_hook_t* t, uint64_t now)
+{
+    struct throttle_user_t* u = t->user;
+
+    throttle_remove(t, now);
+    free(t);
+
+    if(list_empty(&(u->events)))
+        throttle_user_free(u);
+}
+
+/** releases waiting events of every user in order as long as tokens are there */
+static void fire_throttled(struct incron_timer* timer)
+{
+    struct throttle_user_t *u = 0, *utmp = 0;
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    uint64_t now = incron_timer_now();
+    uint64_t wait = UINT64_MAX;
+
+    (void)timer;
+
+    list_for_each_entry_safe(u, utmp, &throttle_users, list) {
+        /** users with tokens left may overtake, nobody does once daemon wide bucket is empty */
+        while(!list_empty(&(u->events)) && ratelimit_admit(u->uid, now)) {
+            struct throttled_hook_t* t = list_first_entry(&(u->events), struct throttled_hook_t, list);
+            struct incron_hook* hook = t->hook;
+
+            throttle_remove(t, now);
+
+            size_t name_len = t->key_len - sizeof(t->hook) - sizeof(t->path);
+            struct inotify_event* event = make_event(buffer, t->path, t->cross,
+                                                     t->key + sizeof(t->hook) + sizeof(t->path), name_len);
+
+            /** slot reserved by throttle_hook is taken over by spawned instance */
+            hook->running--;
+            dispatch_time = t->time;
+
+            if(spawn_hook(t->path, event, hook, t->cross) == -1) {
+                syslog(LOG_ERR, "failed spawning throttled hook with %d : %s", errno, strerror(errno));
+                hook->running++;
+                hook_instance_done(hook);
+            }
+
+            free(t);
+        }
+
+        if(list_empty(&(u->events))) {
+            throttle_user_free(u);
+            continue;
         }
+
+        uint64_t w = ratelimit_wait(u->uid, now);
+
+        if(w < wait)
+            wait = w;
+
+        if(!ratelimit_global_ready(now))
+            break;
     }
 
-    char pathenv[strlen(getenv("PATH")) + sizeof("PATH=")];
-    sprintf(pathenv, "PATH=%s", getenv("PATH"));
-    char *envp[] = {pathenv, 0};
+    if(!list_empty(&throttle_users)) {
+        throttle_arm(now + (wait != UINT64_MAX && wait > 0 ? wait : 1));
+        return;
+    }
+
+    syslog(LOG_INFO, "spawn rate limit released");
+}
+
+/** event waits for token, holding instance slot of the hook meanwhile */
+static int throttle_hook(struct incron_path* path, const struct inotify_event* event, struct incron_hook* hook,
+                         uint32_t cross, uint64_t now)
+{
+    const char* name = event->len > 0 ? event->name : "";
+
+    /** hook without max_spawn would otherwise pile up events for as long as limit lasts,
+     * past queue_max they all go to one event for tab path itself */
+    if(hook->throttled_len >= hook->queue_max) {
+        path = hook->path;
+        name = "";
+    }
+
+    size_t name_len = strlen(name);
+    size_t key_len = sizeof(hook) + sizeof(path) + name_len;
+    char key[key_len];
+
+    memcpy(key, &hook, sizeof(hook));
+    memcpy(key + sizeof(hook), &path, sizeof(path));
+    memcpy(key + sizeof(hook) + sizeof(path), name, name_len);
+
+    struct throttled_hook_t* t = 0;
+    HASH_FIND(hh, throttled_hooks, key, key_len, t);
+
+    /** same file is fired once with all event flags ORed */
+    if(t != 0) {
+        t->cross |= cross;
+        t->time = dispatch_time;
+        throttle_coalesced++;
+        return 0;
+    }
+
+    struct throttle_user_t* u = throttle_user(hook->pw_uid);
+
+    if(u == 0) {
+        u = malloc(sizeof(struct throttle_user_t));
+        if(u == 0)
+            return -1;
+
+        u->uid = hook->pw_uid;
+        INIT_LIST_HEAD(&(u->events));
+        HASH_ADD(hh, throttle_users_hash, uid, sizeof(uid_t), u);
+
+        if(list_empty(&throttle_users)) {
+            syslog(LOG_WARNING, "spawn rate limit reached, queueing hooks");
+
+            if(throttle_timer.func == 0)
+                incron_timer_setup(&throttle_timer, fire_throttled);
+        }
+
+        list_add_tail(&(u->list), &throttle_users);
+    }
+
+    t = malloc(sizeof(struct throttled_hook_t) + key_len + 1);
+    if(t == 0) {
+        throttle_arm(now + 1);
+        return -1;
+    }
+
+    t->path = path;
+    t->hook = hook;
+    t->user = u;
+    t->cross = cross;
+    t->time = dispatch_time;
+    t->key_len = key_len;
+    memcpy(t->key, key, key_len);
+    t->key[key_len] = '\0';
+
+    list_add_tail(&(t->list), &(u->events));
+    list_add_tail(&(t->hook_list), &(hook->throttled));
+    HASH_ADD(hh, throttled_hooks, key, key_len, t);
+
+    hook->throttled_len++;
+    hook->running++;
+    ratelimit_throttled(hook->pw_uid, now);
+    uint64_t wait = ratelimit_wait(hook->pw_uid, now);
+    throttle_arm(now + (wait > 0 ? wait : 1));
+
+    return 0;
+}
+
+/** spawn hook if rate limit allows, otherwise event waits for token */
+static int admit_hook(struct incron_path* path, const struct inotify_event* event, struct incron_hook* hook, uint32_t cross)
+{
+    if(!ratelimit_enabled())
+        return spawn_hook(path, event, hook, cross);
+
+    uint64_t now = incron_timer_now();
+
+    /** waiting events of the same user go first */
+    if(throttle_user(hook->pw_uid) == 0 && ratelimit_admit(hook->pw_uid, now))
+        return spawn_hook(path, event, hook, cross);
+
+    return throttle_hook(path, event, hook, cross, now);
+}
+
+/** spawn hook or queue event if hook is at its instance limit */
+static int run_hook(struct incron_path* path, const struct inotify_event* event, struct incron_hook* hook, uint32_t cross)
+{
+    if(hook->max_spawn != 0 && hook->running >= hook->max_spawn)
+        return queue_hook(path, event, hook, cross);
+
+    return admit_hook(path, event, hook, cross);
+}
+
+/** instance of hook is gone, queued events take its place */
+static void hook_instance_done(struct incron_hook* hook)
+{
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    /** hook was removed by reload meanwhile */
+    if(hook == 0)
+        return;
+
+    if(hook->running > 0)
+        hook->running--;
+
+    if(hook->running == 0 && (hook->iflags & IN_NO_LOOP))
+        hook->loop_until = incron_timer_now() + hook->loop_grace;
+
+    if(hook->batch != 0 && batch_due(hook->batch))
+        launch_batch(hook->batch, 0);
+
+    while(!list_empty(&(hook->queue)) && hook->running < hook->max_spawn) {
+        struct incron_queued_event* q = list_first_entry(&(hook->queue), struct incron_queued_event, list);
+
+        list_del(&(q->list));
+        hook->queue_len--;
+
+        struct inotify_event* event = make_event(buffer, q->path, q->cross, q->name, q->name_len);
+        dispatch_time = q->time;
+
+        if(admit_hook(q->path, event, hook, q->cross) == -1)
+            syslog(LOG_ERR, "failed spawning queued hook with %d : %s", errno, strerror(errno));
+
+        free(q);
+    }
+}
+
+/** batch list is passed as stdin, $# names it */
+#define BATCH_LIST_NAME "/dev/stdin"
+
+/** @return 0 if batch was launched or has to wait for instance slot or token,
+ * forced batch is launched regardless of limits */
+static int launch_batch(struct incron_batch* batch, int force)
+{
+    struct incron_hook* hook = batch->hook;
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    if(batch->count == 0)
+        return 0;
+
+    /** launched once instance exits */
+    if(!force && hook->max_spawn != 0 && hook->running >= hook->max_spawn)
+        return 0;
+
+    if(!force && ratelimit_enabled()) {
+        uint64_t now = incron_timer_now();
+
+        if(!ratelimit_admit(hook->pw_uid, now)) {
+            uint64_t wait = ratelimit_wait(hook->pw_uid, now);
+            incron_timer_arm(&(batch->timer), wait > 0 ? wait : 1);
+            return 0;
+        }
+    }
+
+    uint32_t cross = batch->cross;
+    uint32_t count = batch->count;
+
+    dispatch_time = batch->time;
+
+    int fd = batch_seal(batch);
+    if(fd == -1)
+        return -1;
+
+    struct inotify_event* event = make_event(buffer, batch->path, cross, BATCH_LIST_NAME, strlen(BATCH_LIST_NAME));
+
+    debug_printf_n("launching batch of %u events for %s", count, hook->argv[0]);
 
-    char **argv = build_shell_argv(path, hook, event, cross);
+    int ret = spawn_hook_stdin(batch->path, event, hook, cross, fd);
+    int errsv = errno;
 
-#ifdef GCOV
-    __gcov_flush();
-#endif
-    exec_start("/bin/bash", argv, envp);
+    /** child or helper holds its own copy */
+    close(fd);
 
-    syslog(LOG_CRIT, "failed exec with %d : %s", errno, strerror(errno));
+    if(ret == -1)
+        syslog(LOG_ERR, "launching batch of %u events for %s failed with %d:%s", count, hook->argv[0], errsv, strerror(errsv));
+
+    errno = errsv;
+    return ret;
+}
+
+static void fire_batch(struct incron_timer* timer)
+{
+    launch_batch(container_of(timer, struct incron_batch, timer), 0);
+}
+
+/** batch is launched at once when full, otherwise batch_ms after its first event */
+static int batch_hook(struct incron_path* path, const struct inotify_event* event, struct incron_hook* hook, uint32_t cross)
+{
+    if(hook->batch == 0) {
+        hook->batch = batch_new(hook, path->root ? path->root : path, fire_batch);
 
-    exit(EXIT_FAILURE);
+        if(hook->batch == 0)
+            return -1;
+    }
+
+    struct incron_batch* batch = hook->batch;
+
+    if(batch_add(batch, path, event, cross) == -1)
+        return -1;
+
+    batch->time = dispatch_time;
+
+    if(batch->count == 1)
+        incron_timer_arm(&(batch->timer), hook->batch_ms);
+
+    if(batch->count >= hook->batch_max)
+        return launch_batch(batch, 0);
+
+    return 0;
+}
+
+/** waiting past its time or size, only instance slot was missing */
+static int batch_due(const struct incron_batch* batch)
+{
+    return batch->count > 0 &&
+           (batch->count >= batch->hook->batch_max || !incron_timer_pending((struct incron_timer*)&(batch->timer)));
+}
+
+static void flush_batch(struct incron_batch* batch)
+{
+    launch_batch(batch, 1);
+}
+
+/** collected events aren't lost on shutdown, nothing else comes anymore */
+void dispatch_flush_batches()
+{
+    batch_for_each(flush_batch);
+    batch_free_all();
+}
+
+/** events waiting for quiet window of the hook to expire */
+struct delayed_hook_t {
+    struct incron_path* path;
+    struct incron_hook* hook;
+    uint32_t cross;             ///> ORed event masks
+    struct timespec time;       ///> latest event time
+    struct incron_timer timer;  ///> rearmed by every event
+
+    UT_hash_handle hh;
+
+    size_t key_len;
+    char key[];                 ///> hook | path | event name
 };
 
+static struct delayed_hook_t* delayed_hooks = 0;
+
+static void fire_delayed_hook(struct incron_timer* timer)
+{
+    struct delayed_hook_t* d = container_of(timer, struct delayed_hook_t, timer);
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    size_t name_len = d->key_len - sizeof(d->hook) - sizeof(d->path);
+    struct inotify_event* event = make_event(buffer, d->path, d->cross,
+                                             d->key + sizeof(d->hook) + sizeof(d->path), name_len);
+
+    debug_printf_n("firing delayed %s for %s/%s", d->hook->command, d->path->path, event->name);
+
+    dispatch_time = d->time;
+
+    if(run_hook(d->path, event, d->hook, d->cross) == -1)
+        syslog(LOG_ERR, "failed spawning delayed hook with %d : %s", errno, strerror(errno));
+
+    HASH_DEL(delayed_hooks, d);
+    free(d);
+}
+
+static int delay_hook(struct incron_path* path, const struct inotify_event* event, struct incron_hook* hook, uint32_t cross)
+{
+    const char* name = event->len > 0 ? event->name : "";
+    size_t name_len = strlen(name);
+    size_t key_len = sizeof(hook) + sizeof(path) + name_len;
+    char key[key_len];
+
+    memcpy(key, &hook, sizeof(hook));
+    memcpy(key + sizeof(hook), &path, sizeof(path));
+    memcpy(key + sizeof(hook) + sizeof(path), name, name_len);
+
+    struct delayed_hook_t* d = 0;
+    HASH_FIND(hh, delayed_hooks, key, key_len, d);
+
+    if(d == 0) {
+        d = malloc(sizeof(struct delayed_hook_t) + key_len + 1);
+        if(d == 0)
+            return -1;
+
+        d->path = path;
+        d->hook = hook;
+        d->cross = 0;
+        d->key_len = key_len;
+        memcpy(d->key, key, key_len);
+        d->key[key_len] = '\0';
+        incron_timer_setup(&(d->timer), fire_delayed_hook);
+
+        HASH_ADD(hh, delayed_hooks, key, key_len, d);
+    }
+
+    /** every event rearms the window */
+    d->cross |= cross;
+    d->time = dispatch_time;
+    incron_timer_arm(&(d->timer), hook->delay);
+
+    return 0;
+}
+
+static int dispatch_hook(struct incron_path* path, const struct inotify_event* event, struct incron_hook* hook, uint32_t cross)
+{
+    if(hook->iflags & IN_STREAM)
+        return stream_hook(path, event, hook);
+
+    if((hook->iflags & IN_NO_LOOP) && hook_looping(hook)) {
+        hook->suppressed++;
+        return 0;
+    }
+
+    if(hook->batch_max)
+        return batch_hook(path, event, hook, cross);
+
+    if(hook->delay)
+        return delay_hook(path, event, hook, cross);
+
+    return run_hook(path, event, hook, cross);
+}
+
 int dispatch_hooks(struct incron_path* path, const struct inotify_event* event)
 {
     int errsv = 0;
 
-    if(list_empty(&(path->hook_list)))
+    /** recursive subdirectory watches carry no hooks of their own */
+    struct incron_path* owner = path->root ? path->root : path;
+
+    if(list_empty(&(owner->hook_list)))
         return 0; /** empty list is a good list*/
 
     uint32_t mask = event->mask;
 
     struct incron_hook *hook = 0;
-    struct list_head *pos = 0;
+    struct incron_hook_index* index = pathHookIndex(owner);
 
-    list_for_each(pos, &(path->hook_list)) {
-        hook = list_entry(pos, struct incron_hook, list);
-
-        /** check if event is applicable */
-        uint32_t cross = mask & hook->flags;
-        if(!cross)
-            continue;
+    /** no memory for index, look through all of them */
+    if(index == 0) {
+        list_for_each_entry(hook, &(owner->hook_list), list) {
+            if(path->root && !(hook->iflags & IN_RECURSIVE))
+                continue;
 
-        /** fork here to prevent main program wasting time for preparing launch */
-        pid_t pid = fork();
+            /** check if event is applicable */
+            uint32_t cross = mask & hook->flags;
+            if(!cross)
+                continue;
 
-        switch(pid) {
-            case -1:
+            if(dispatch_hook(path, event, hook, cross) == -1) {
                 errsv = errno;
                 goto fail;
-            case 0:
-                prepare_and_exec(path, event, hook, cross);
-                break;
-            default:
-                break;
+            }
         }
 
-        hook->fired = 1;
+        return 0;
+    }
+
+    /** slot ranges of event bits some hook reacts to */
+    uint32_t head[HOOK_INDEX_BITS], end[HOOK_INDEX_BITS];
+    unsigned bit = 0, cnt = 0, i = 0;
+
+    for_each_set_bit(bit, mask, HOOK_INDEX_BITS) {
+        if(index->bit_off[bit] == index->bit_off[bit + 1])
+            continue;
+
+        head[cnt] = index->bit_off[bit];
+        end[cnt] = index->bit_off[bit + 1];
+        cnt++;
+    }
+
+    /** ranges are ascending, merging them keeps tab order and runs hook matching several bits once */
+    for(;;) {
+        uint32_t slot = UINT32_MAX;
 
-        struct pid_list_t* new_pid = (struct pid_list_t*)malloc(sizeof(struct pid_list_t));
-        new_pid->hook = hook;
-        new_pid->pid = pid;
-        HASH_ADD(hh, pid_list, pid, sizeof(pid_t), new_pid);
+        for(i = 0; i < cnt; i++)
+            if(head[i] < end[i] && index->slots[head[i]] < slot)
+                slot = index->slots[head[i]];
 
-        syslog(LOG_NOTICE, "spawned child %s [%d]", hook->command, new_pid->pid);
+        if(slot == UINT32_MAX)
+            break;
+
+        for(i = 0; i < cnt; i++)
+            if(head[i] < end[i] && index->slots[head[i]] == slot)
+                head[i]++;
+
+        hook = index->hooks[slot];
+
+        if(path->root && !(hook->iflags & IN_RECURSIVE))
+            continue;
+
+        if(dispatch_hook(path, event, hook, mask & hook->flags) == -1) {
+            errsv = errno;
+            goto fail;
+        }
     }
 
     return 0;
@@ -276,11 +1038,138 @@ int dispatch_hooks(struct incron_path* path, const struct inotify_event* event)
     return -1;
 }
 
+void dispatch_path_removed(struct incron_path* path)
+{
+    struct delayed_hook_t *d = 0, *tmp = 0;
+    struct throttled_hook_t *t = 0, *ttmp = 0;
+    struct incron_path* owner = path->root ? path->root : path;
+    struct incron_hook* hook = 0;
+
+    list_for_each_entry(hook, &(owner->hook_list), list) {
+        struct incron_queued_event *q = 0, *qtmp = 0;
+
+        list_for_each_entry_safe(q, qtmp, &(hook->queue), list) {
+            if(q->path != path)
+                continue;
+
+            list_del(&(q->list));
+            free(q);
+            hook->queue_len--;
+        }
+    }
+
+    list_for_each_entry(hook, &(owner->hook_list), list) {
+        /** hook queue entries for other paths may take freed slots */
+        list_for_each_entry_safe(t, ttmp, &(hook->throttled), hook_list) {
+            if(t->path != path)
+                continue;
+
+            throttle_drop(t, incron_timer_now());
+            hook_instance_done(hook);
+        }
+    }
+
+    HASH_ITER(hh, delayed_hooks, d, tmp) {
+        if(d->path != path)
+            continue;
+
+        incron_timer_cancel(&(d->timer));
+        HASH_DEL(delayed_hooks, d);
+        free(d);
+    }
+}
+
+/** hook is freed by tab reload, nothing may refer to it afterwards */
+void dispatch_hook_removed(struct incron_hook* hook)
+{
+    struct delayed_hook_t *d = 0, *tmp = 0;
+    struct throttled_hook_t *t = 0, *ttmp = 0;
+    struct pid_list_t *child = 0, *ctmp = 0;
+
+    /** collected events happened while hook was still in tab */
+    if(hook->batch != 0) {
+        launch_batch(hook->batch, 1);
+        batch_free(hook->batch);
+    }
+
+    if(hook->stream != 0)
+        stream_stop(hook->stream);
+
+    list_for_each_entry_safe(t, ttmp, &(hook->throttled), hook_list)
+        throttle_drop(t, incron_timer_now());
+
+    HASH_ITER(hh, delayed_hooks, d, tmp) {
+        if(d->hook != hook)
+            continue;
+
+        incron_timer_cancel(&(d->timer));
+        HASH_DEL(delayed_hooks, d);
+        free(d);
+    }
+
+    /** running instances are still reaped, they just aren't accounted anymore */
+    HASH_ITER(hh, pid_list, child, ctmp) {
+        if(child->hook == hook)
+            child->hook = 0;
+    }
+
+    list_for_each_entry(child, &spawner_pending, pending) {
+        if(child->hook == hook)
+            child->hook = 0;
+    }
+}
+
+void dispatch_log_stats()
+{
+    struct incron_path *p = 0, *tmp = 0;
+    struct incron_hook* hook = 0;
+
+    ratelimit_log_stats(incron_timer_now());
+
+    if(throttle_coalesced != 0)
+        syslog(LOG_INFO, "spawn rate limit : %lu throttled events coalesced", throttle_coalesced);
+
+    HASH_ITER(hh, incron_paths, p, tmp) {
+        list_for_each_entry(hook, &(p->hook_list), list) {
+            if(hook->queued == 0 && hook->dropped == 0 && hook->suppressed == 0)
+                continue;
+
+            syslog(LOG_INFO, "hook %s on %s : %lu events queued, %lu coalesced, %lu dropped, %lu suppressed",
+                   hook->argv[0], p->path, hook->queued, hook->coalesced, hook->dropped, hook->suppressed);
+        }
+    }
+}
+
 int clear_hooks()
 {
     return 0;
 }
 
+static void child_finished(struct pid_list_t* child, int status)
+{
+    if(WIFEXITED(status))
+        syslog(LOG_INFO, "child [%d] finished with status %d", child->pid, WEXITSTATUS(status));
+    else if(WIFSIGNALED(status))
+        syslog(LOG_INFO, "child [%d] killed by signal %d", child->pid, WTERMSIG(status));
+
+    /** forked but not yet exec'ed siblings may hold pidfd copy,
+     * so closing alone wouldn't remove it from epoll */
+    if(child->w.fd != -1) {
+        epoll_ctl(dispatch_epollfd, EPOLL_CTL_DEL, child->w.fd, 0);
+        close(child->w.fd);
+    }
+    else if(!child->remote)
+        untracked_children--;
+
+    if(child->hook != 0 && child->hook->stream != 0 && child->hook->stream->pid == child->pid)
+        stream_finished(child->hook->stream);
+    else if(child->hook != 0)
+        hook_instance_done(child->hook);
+
+    HASH_DEL(pid_list, child);
+    free(child);
+}
+
 int hook_clear_spawned(pid_t pid)
 {
     struct pid_list_t* pid_ = 0;
@@ -289,38 +1178,256 @@ int hook_clear_spawned(pid_t pid)
     if(pid_ == 0)
         return -1;
 
-    /** find assosiated hook if any */
-    // struct incron_hook* hook = pid_->hook;
+    child_finished(pid_, 0);
 
-    HASH_DEL(pid_list, pid_);
-    free(pid_);
+    return 0;
+}
+
+int hook_reap(struct epoll_wrapper* w)
+{
+    struct pid_list_t* child = container_of(w, struct pid_list_t, w);
+    int status = 0;
+
+    pid_t pid = waitpid(child->pid, &status, WNOHANG);
+
+    /** not exited yet, pidfd is level triggered */
+    if(pid == 0)
+        return 0;
+
+    if(pid == -1)
+        return -1;
+
+    child_finished(child, status);
 
     return 0;
 }
 
-static struct incron_path* find_path(int wfd)
+int hook_reap_untracked()
 {
-    struct incron_path *p = 0;
+    int status = 0;
+    pid_t pid;
 
-    for(p = incron_paths; p != NULL; p = p->hh.next)
-        if(p->wfd == wfd)
-            return p;
+    /** no pidfds at all, every exited child can be reaped at once */
+    if(!pidfd_supported || dispatch_epollfd == -1) {
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            struct pid_list_t* child = 0;
+            HASH_FIND(hh, pid_list, &pid, sizeof(pid_t), child);
+
+            if(child != 0)
+                child_finished(child, status);
+        }
+
+        return 0;
+    }
+
+    /** children tracked by pidfd are reaped from their own events */
+    if(untracked_children == 0)
+        return 0;
+
+    struct pid_list_t *child = 0, *tmp = 0;
+
+    HASH_ITER(hh, pid_list, child, tmp) {
+        if(child->w.fd != -1 || child->remote)
+            continue;
+
+        if(waitpid(child->pid, &status, WNOHANG) == child->pid)
+            child_finished(child, status);
+    }
 
     return 0;
 }
 
-int handle_events(int inotifyfd)
+/** helper is gone, its children can't be accounted anymore */
+static void spawner_lost()
+{
+    struct pid_list_t *child = 0, *tmp = 0;
+
+    if(spawner_fd() != -1 && dispatch_epollfd != -1)
+        epoll_ctl(dispatch_epollfd, EPOLL_CTL_DEL, spawner_fd(), 0);
+
+    spawner_stop();
+
+    /** spawner is stopped, so queued events drained here are spawned by daemon */
+    list_for_each_entry_safe(child, tmp, &spawner_pending, pending) {
+        list_del(&child->pending);
+        hook_instance_done(child->hook);
+        free(child);
+    }
+
+    HASH_ITER(hh, pid_list, child, tmp) {
+        if(!child->remote)
+            continue;
+
+        HASH_DEL(pid_list, child);
+        hook_instance_done(child->hook);
+        free(child);
+    }
+}
+
+int hook_spawner_replies()
+{
+    struct spawner_reply reply;
+    struct pid_list_t* child = 0;
+    int ret;
+
+    while((ret = spawner_recv(&reply)) == 1) {
+        switch(reply.type) {
+            case SPAWNER_SPAWNED:
+                if(list_empty(&spawner_pending))
+                    break;
+
+                child = list_first_entry(&spawner_pending, struct pid_list_t, pending);
+                list_del(&child->pending);
+
+                if(reply.pid == -1) {
+                    syslog(LOG_ERR, "spawning %s failed with %d:%s", child->hook ? child->hook->command : "removed hook",
+                           reply.status, strerror(reply.status));
+                    hook_instance_done(child->hook);
+                    free(child);
+                    break;
+                }
+
+                child->pid = reply.pid;
+                child->w.type = PID_FD;
+                child->w.fd = -1;
+                HASH_ADD(hh, pid_list, pid, sizeof(pid_t), child);
+
+                syslog(LOG_NOTICE, "spawned child %s [%d]", child->hook ? child->hook->command : "of removed hook", child->pid);
+                break;
+            case SPAWNER_EXITED:
+                HASH_FIND(hh, pid_list, &reply.pid, sizeof(pid_t), child);
+
+                if(child != 0)
+                    child_finished(child, reply.status);
+                break;
+            default:
+                break;
+        }
+    }
+
+    if(ret == -1) {
+        syslog(LOG_ERR, "spawn helper failed with %d:%s, spawning hooks from daemon", errno, strerror(errno));
+        spawner_lost();
+        return -1;
+    }
+
+    return 0;
+}
+
+/** reusable read buffer, grown up to inotify_read_max */
+static char* event_buffer = 0;
+static size_t event_buffer_size = 0;
+
+static struct incron_read_stats read_stats;
+
+static char* event_buffer_reserve(size_t size)
+{
+    if(size <= event_buffer_size)
+        return event_buffer;
+
+    char* buffer = realloc(event_buffer, size);
+    if(buffer == 0)
+        return 0;
+
+    event_buffer = buffer;
+    event_buffer_size = size;
+
+    return event_buffer;
+}
+
+void dispatch_stamp()
+{
+    clock_gettime(CLOCK_REALTIME, &dispatch_time);
+}
+
+const struct incron_read_stats* handle_events_stats()
+{
+    return &read_stats;
+}
+
+void handle_event_buffer(int inotifyfd, const char* buffer, size_t len)
 {
-    char buffer[4096]
-    __attribute__ ((aligned(__alignof__(struct inotify_event))));
     const struct inotify_event *event;
+    const char *ptr;
+
+    read_stats.reads++;
+    read_stats.bytes += len;
+
+    for (ptr = buffer; ptr < buffer + len;
+         ptr += sizeof(struct inotify_event) + event->len) {
+
+        event = (const struct inotify_event *) ptr;
+
+        read_stats.events++;
+
+        if(event->wd == -1 && (event->mask & IN_Q_OVERFLOW)) {
+            snapshot_recover();
+            continue;
+        }
+
+        struct incron_path* path = findPathByWatch(inotifyfd, event->wd);
+
+        if(path == 0) {
+            debug_printf_n("watch descriptor %d not found in path array", event->wd);
+            continue;
+        }
+
+        while(path != 0) {
+            struct incron_path* next = path->wfd_next;
 
+            debug_printf_n("firing hooks for %s", path->path);
+            snapshot_update(path, event);
+            dispatch_hooks(path, event);
+
+            /** watch was removed by kernel and wd may be reused */
+            if(event->mask & IN_IGNORED)
+                pathClearWatch(path);
+
+            /** may free path for recursive subdirectory watches */
+            recursive_handle_event(inotifyfd, path, event);
+
+            path = next;
+        }
+    }
+}
+
+int handle_events(int inotifyfd)
+{
     int errsv = 0;
     ssize_t len;
-    char *ptr;
+    char *buffer;
+
+    size_t read_max = inotify_read_max < INOTIFY_READ_MIN ? INOTIFY_READ_MIN : inotify_read_max;
 
     do {
-        len = read(inotifyfd, buffer, sizeof buffer);
+        int pending = 0;
+        size_t size = INOTIFY_READ_MIN;
+
+        /** size the read for the whole queue so it is drained with a single syscall */
+        if(ioctl(inotifyfd, FIONREAD, &pending) == 0) {
+            if(pending == 0)
+                break;
+
+            if((size_t)pending > size)
+                size = (size_t)pending;
+        }
+
+        if(size > read_max)
+            size = read_max;
+
+        buffer = event_buffer_reserve(size);
+        if(buffer == 0) {
+            /** fall back to whatever we already have */
+            buffer = event_buffer;
+            size = event_buffer_size;
+
+            if(buffer == 0) {
+                errsv = ENOMEM;
+                goto fail;
+            }
+        }
+
+        len = read(inotifyfd, buffer, size);
         errsv = errno;
 
         if(len == -1) {
@@ -328,21 +1435,14 @@ int handle_events(int inotifyfd)
             goto fail;
         }
 
-        for (ptr = buffer; ptr < buffer + len;
-             ptr += sizeof(struct inotify_event) + event->len) {
+        dispatch_stamp();
+        handle_event_buffer(inotifyfd, buffer, len);
 
-            event = (const struct inotify_event *) ptr;
+        debug_printf_n("read %zd bytes (%d pending), total %lu reads %lu events", len, pending, read_stats.reads, read_stats.events);
 
-            struct incron_path* path = find_path(event->wd);
-
-            if(path == 0) {
-                debug_printf_n("watch descriptor %d not found in path array", event->wd);
-                continue;
-            }
-
-            debug_printf_n("firing hooks for %s", path->path);
-            dispatch_hooks(path, event);
-        }
+        /** whole queue consumed, anything queued later rearms epoll */
+        if(pending > 0 && (size_t)pending <= size)
+            break;
     } while(1);
 
     return 0;
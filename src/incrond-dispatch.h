@@ -7,14 +7,45 @@
 #include <stdint.h>
 #include <time.h>
 
+#include <sys/inotify.h>
+#include <linux/limits.h>
+
 char* print_text_events(uint32_t events);
 
 struct incron_path;
+struct incron_hook;
 struct inotify_event;
 
 int dispatch_hooks(struct incron_path* /*path*/, const struct inotify_event* /*event*/);
+
+/** wall clock time events being dispatched were read at, expanded as $^ */
+extern struct timespec dispatch_time;
+void dispatch_stamp();
+struct epoll_wrapper;
+
+void dispatch_set_epoll(int /*epollfd*/);
 int hook_clear_spawned(pid_t /*pid*/);
+int hook_reap(struct epoll_wrapper* /*w*/);
+int hook_reap_untracked();
+int hook_spawner_replies();
+void dispatch_path_removed(struct incron_path* /*path*/);
+void dispatch_hook_removed(struct incron_hook* /*hook*/);
+void dispatch_log_stats();
+void dispatch_flush_batches();
+
+/** inotify queue read counters */
+struct incron_read_stats {
+    unsigned long reads;        ///> read() calls returning events
+    unsigned long bytes;        ///> bytes consumed from inotify queue
+    unsigned long events;       ///> events parsed
+};
+
+/** smallest buffer guaranteed to fit at least one event */
+#define INOTIFY_READ_MIN (sizeof(struct inotify_event) + NAME_MAX + 1)
+
+const struct incron_read_stats* handle_events_stats();
 
+void handle_event_buffer(int /*inotifyfd*/, const char* /*buffer*/, size_t /*len*/);
 int handle_events(int inotifyfd);
 
 #endif
@@ -0,0 +1,534 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-fanotify.c
+*
+* @brief fanotify event source
+*
+* @par
+* Paths using fanotify get a single FAN_MARK_FILESYSTEM mark (FAN_MARK_MOUNT
+* with inode events only if filesystem can't be marked) instead of inotify
+* watches, so setup cost doesn't depend on directory count. Events carry
+* the parent directory file handle and entry name (FAN_REPORT_DFID_NAME),
+* handles of watched directories are hashed once so matching is a lookup.
+* For IN_RECURSIVE paths unknown handles are resolved to a path and cached
+* until a directory is moved or deleted. Events are passed to
+* dispatch_hooks() as inotify events, event bits are the same.
+*/
+#include "incrond-fanotify.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+
+#include <linux/fanotify.h>
+#include <linux/limits.h>
+
+#include "incrond.h"
+#include "incrond-config.h"
+#include "incrond-parse-tabs.h"
+#include "incrond-dispatch.h"
+#include "incrond-recursive.h"
+
+#include "uthash.h"
+
+/** resolved directories kept before cache is flushed */
+#define FANOTIFY_CACHE_MAX  4096
+
+/** events that can be set with FAN_MARK_MOUNT */
+#define FANOTIFY_MOUNT_EVENTS (FAN_ACCESS | FAN_MODIFY | FAN_CLOSE | FAN_OPEN)
+
+/** fsid + handle type + handle */
+#define FANOTIFY_KEY_MAX (sizeof(__kernel_fsid_t) + sizeof(int) + MAX_HANDLE_SZ)
+
+struct fanotify_dir {
+    struct incron_path* path;   ///> path events in directory are dispatched to, 0 if none
+    uint8_t pinned;             ///> watched path itself, survives cache flush
+
+    UT_hash_handle hh;
+
+    size_t key_len;
+    unsigned char key[];
+};
+
+struct fanotify_root {
+    struct incron_path* path;
+    __kernel_fsid_t fsid;
+    int mount_fd;               ///> any fd on filesystem for open_by_handle_at
+};
+
+static struct fanotify_dir* fanotify_dirs = 0;
+static unsigned fanotify_cached = 0;
+
+/** kept for paths added by tab reload */
+static int fanotify_fd = -1;
+
+/** IN_RECURSIVE paths, the only ones needing handle resolution */
+static struct fanotify_root* fanotify_roots = 0;
+static size_t fanotify_roots_cnt = 0;
+
+int path_uses_fanotify(const struct incron_path* path)
+{
+    return event_backend == EVENT_BACKEND_FANOTIFY || (path->iflags & IN_FANOTIFY);
+}
+
+static size_t fanotify_key(unsigned char* key, const __kernel_fsid_t* fsid, const struct file_handle* fh)
+{
+    size_t len = 0;
+
+    memcpy(key, fsid, sizeof(*fsid));
+    len += sizeof(*fsid);
+    memcpy(key + len, &fh->handle_type, sizeof(fh->handle_type));
+    len += sizeof(fh->handle_type);
+    memcpy(key + len, fh->f_handle, fh->handle_bytes);
+    len += fh->handle_bytes;
+
+    return len;
+}
+
+static struct fanotify_dir* fanotify_dir_add(const unsigned char* key, size_t key_len, struct incron_path* path, uint8_t pinned)
+{
+    struct fanotify_dir* d = malloc(sizeof(struct fanotify_dir) + key_len);
+    if(d == 0)
+        return 0;
+
+    d->path = path;
+    d->pinned = pinned;
+    d->key_len = key_len;
+    memcpy(d->key, key, key_len);
+
+    HASH_ADD(hh, fanotify_dirs, key, key_len, d);
+
+    if(!pinned)
+        fanotify_cached++;
+
+    return d;
+}
+
+static void fanotify_cache_flush()
+{
+    struct fanotify_dir *d = 0, *tmp = 0;
+
+    HASH_ITER(hh, fanotify_dirs, d, tmp) {
+        if(d->pinned)
+            continue;
+
+        HASH_DEL(fanotify_dirs, d);
+        free(d);
+    }
+
+    fanotify_cached = 0;
+}
+
+static void fanotify_unpin(struct incron_path* path)
+{
+    struct fanotify_dir *d = 0, *tmp = 0;
+
+    HASH_ITER(hh, fanotify_dirs, d, tmp) {
+        if(d->path != path)
+            continue;
+
+        HASH_DEL(fanotify_dirs, d);
+        free(d);
+    }
+
+    for(size_t i = 0; i < fanotify_roots_cnt; i++) {
+        if(fanotify_roots[i].path != path)
+            continue;
+
+        close(fanotify_roots[i].mount_fd);
+        fanotify_roots[i] = fanotify_roots[--fanotify_roots_cnt];
+        break;
+    }
+}
+
+static int fanotify_pin(struct incron_path* path)
+{
+    char buffer[sizeof(struct file_handle) + MAX_HANDLE_SZ]
+    __attribute__ ((aligned(__alignof__(struct file_handle))));
+    struct file_handle* fh = (struct file_handle*)buffer;
+    unsigned char key[FANOTIFY_KEY_MAX];
+    struct statfs st;
+    struct stat sb;
+    int mount_id;
+
+    /** events in directory carry its handle and entry name, file itself can't be matched */
+    if(stat(path->path, &sb) == -1)
+        return -1;
+
+    if(!S_ISDIR(sb.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    fh->handle_bytes = MAX_HANDLE_SZ;
+
+    if(name_to_handle_at(AT_FDCWD, path->path, fh, &mount_id, 0) == -1)
+        return -1;
+
+    if(statfs(path->path, &st) == -1)
+        return -1;
+
+    __kernel_fsid_t fsid;
+    memcpy(&fsid, &st.f_fsid, sizeof(fsid));
+
+    size_t key_len = fanotify_key(key, &fsid, fh);
+
+    struct fanotify_dir* d = 0;
+    HASH_FIND(hh, fanotify_dirs, key, key_len, d);
+
+    if(d != 0) {
+        syslog(LOG_WARNING, "%s is the same directory as %s, ignoring", path->path, d->path->path);
+        errno = EEXIST;
+        return -1;
+    }
+
+    if(fanotify_dir_add(key, key_len, path, 1) == 0)
+        return -1;
+
+    if(!(path->iflags & IN_RECURSIVE))
+        return 0;
+
+    struct fanotify_root* roots = realloc(fanotify_roots, (fanotify_roots_cnt + 1) * sizeof(struct fanotify_root));
+    if(roots == 0)
+        return -1;
+
+    fanotify_roots = roots;
+
+    struct fanotify_root* root = &fanotify_roots[fanotify_roots_cnt];
+    root->path = path;
+    root->fsid = fsid;
+    root->mount_fd = open(path->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if(root->mount_fd == -1)
+        return -1;
+
+    fanotify_roots_cnt++;
+
+    return 0;
+}
+
+static int fanotify_mark_path(int fanotifyfd, struct incron_path* path)
+{
+    uint64_t mask = ((path->flags | snapshot_watch_mask(path)) & FANOTIFY_EVENTS) | FAN_ONDIR;
+
+    /** directory renames and removals invalidate resolved handles */
+    if(path->iflags & IN_RECURSIVE)
+        mask |= FAN_MOVE | FAN_DELETE;
+
+    if(syscall(SYS_fanotify_mark, fanotifyfd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, path->path) == 0)
+        return 0;
+
+    int errsv = errno;
+
+    mask &= FANOTIFY_MOUNT_EVENTS | FAN_ONDIR;
+
+    if(mask != FAN_ONDIR &&
+       syscall(SYS_fanotify_mark, fanotifyfd, FAN_MARK_ADD | FAN_MARK_MOUNT, mask, AT_FDCWD, path->path) == 0) {
+        syslog(LOG_WARNING, "filesystem mark for %s failed with %d:%s, using mount mark without directory events",
+               path->path, errsv, strerror(errsv));
+        return 0;
+    }
+
+    errno = errsv;
+    return -1;
+}
+
+int fanotify_watch_paths()
+{
+    struct incron_path *p = 0;
+    int fanotifyfd = -1;
+    int marked = 0;
+    int errsv = 0;
+
+    for(p = incron_paths; p != NULL; p = p->hh.next) {
+        if(!path_uses_fanotify(p))
+            continue;
+
+        if(fanotifyfd == -1) {
+            fanotifyfd = syscall(SYS_fanotify_init, FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK,
+                                 O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+
+            if(fanotifyfd == -1) {
+                errsv = errno;
+                syslog(LOG_ERR, "fanotify_init failed with %d:%s, falling back to inotify", errsv, strerror(errsv));
+                goto fail;
+            }
+        }
+
+        if(fanotify_pin(p) == -1 || fanotify_mark_path(fanotifyfd, p) == -1) {
+            errsv = errno;
+            fanotify_unpin(p);
+
+            if(errsv == ENOTDIR)
+                syslog(LOG_INFO, "%s isn't a directory, watching it with inotify", p->path);
+            else
+                syslog(LOG_ERR, "fanotify mark for %s failed with %d:%s, falling back to inotify", p->path, errsv, strerror(errsv));
+            continue;
+        }
+
+        p->fanotify = 1;
+        marked++;
+
+        if(snapshot_build(p) == -1) {
+            errsv = errno;
+            syslog(LOG_WARNING, "snapshot of %s failed with %d:%s", p->path, errsv, strerror(errsv));
+        }
+
+        syslog(LOG_INFO, "added fanotify mark for %s", p->path);
+    }
+
+    if(marked == 0) {
+        errsv = 0;
+        goto fail;
+    }
+
+    fanotify_fd = fanotifyfd;
+
+    return fanotifyfd;
+
+    fail:
+    if(fanotifyfd != -1)
+        close(fanotifyfd);
+
+    errno = errsv;
+    return -1;
+}
+
+/** path added by reload can use fanotify only if it was set up at start */
+int fanotify_add_path(struct incron_path* path)
+{
+    if(fanotify_fd == -1) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    if(fanotify_pin(path) == -1 || fanotify_mark_path(fanotify_fd, path) == -1) {
+        int errsv = errno;
+        fanotify_unpin(path);
+        errno = errsv;
+        return -1;
+    }
+
+    path->fanotify = 1;
+
+    return 0;
+}
+
+/** marks only ever get events added, extra ones are filtered by dispatch_hooks() */
+int fanotify_update_path(struct incron_path* path)
+{
+    return fanotify_mark_path(fanotify_fd, path);
+}
+
+/** mark may be shared with other paths on filesystem, events of forgotten path resolve to nothing */
+void fanotify_forget(struct incron_path* path)
+{
+    fanotify_unpin(path);
+    fanotify_cache_flush();
+
+    path->fanotify = 0;
+}
+
+/** map directory not known yet to subdirectory of IN_RECURSIVE path if any */
+static struct incron_path* fanotify_resolve(const __kernel_fsid_t* fsid, struct file_handle* fh)
+{
+    char link[32];
+    char dir[PATH_MAX];
+    ssize_t len = -1;
+
+    for(size_t i = 0; i < fanotify_roots_cnt && len == -1; i++) {
+        if(memcmp(&fanotify_roots[i].fsid, fsid, sizeof(*fsid)) != 0)
+            continue;
+
+        /** another root on the same filesystem may still reach it */
+        int fd = open_by_handle_at(fanotify_roots[i].mount_fd, fh, O_PATH | O_CLOEXEC);
+        if(fd == -1)
+            continue;
+
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        len = readlink(link, dir, sizeof(dir) - 1);
+        close(fd);
+    }
+
+    if(len <= 0)
+        return 0;
+
+    dir[len] = '\0';
+
+    /** the most specific root wins */
+    struct incron_path* root = 0;
+    size_t root_len = 0;
+
+    for(size_t i = 0; i < fanotify_roots_cnt; i++) {
+        const char* path = fanotify_roots[i].path->path;
+        size_t path_len = strlen(path);
+
+        while(path_len > 1 && path[path_len - 1] == '/')
+            path_len--;
+
+        if(path_len <= root_len || strncmp(dir, path, path_len) != 0 || dir[path_len] != '/')
+            continue;
+
+        root = fanotify_roots[i].path;
+        root_len = path_len;
+    }
+
+    if(root == 0)
+        return 0;
+
+    return recursive_child_get(root, dir);
+}
+
+static struct incron_path* fanotify_lookup(const __kernel_fsid_t* fsid, struct file_handle* fh)
+{
+    unsigned char key[FANOTIFY_KEY_MAX];
+
+    if(fh->handle_bytes > MAX_HANDLE_SZ)
+        return 0;
+
+    size_t key_len = fanotify_key(key, fsid, fh);
+
+    struct fanotify_dir* d = 0;
+    HASH_FIND(hh, fanotify_dirs, key, key_len, d);
+
+    if(d != 0)
+        return d->path;
+
+    if(fanotify_roots_cnt == 0)
+        return 0;
+
+    if(fanotify_cached >= FANOTIFY_CACHE_MAX)
+        fanotify_cache_flush();
+
+    /** negative results are cached too, most of filesystem is of no interest */
+    struct incron_path* path = fanotify_resolve(fsid, fh);
+    fanotify_dir_add(key, key_len, path, 0);
+
+    return path;
+}
+
+static void fanotify_dispatch(const struct fanotify_event_metadata* metadata)
+{
+    const struct fanotify_event_info_fid* fid = 0;
+    const char* info = (const char*)metadata + metadata->metadata_len;
+    const char* end = (const char*)metadata + metadata->event_len;
+
+    while(info + sizeof(struct fanotify_event_info_header) <= end) {
+        const struct fanotify_event_info_header* hdr = (const struct fanotify_event_info_header*)info;
+
+        if(hdr->len == 0)
+            break;
+
+        if(hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || hdr->info_type == FAN_EVENT_INFO_TYPE_DFID) {
+            fid = (const struct fanotify_event_info_fid*)info;
+            break;
+        }
+
+        info += hdr->len;
+    }
+
+    if(fid == 0)
+        return;
+
+    struct file_handle* fh = (struct file_handle*)fid->handle;
+    const char* name = "";
+
+    /** name is "." for events on directory itself */
+    if(fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+        name = (const char*)fh->f_handle + fh->handle_bytes;
+        if(strcmp(name, ".") == 0)
+            name = "";
+    }
+
+    struct incron_path* path = fanotify_lookup(&fid->fsid, fh);
+
+    if(path != 0) {
+        char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        struct inotify_event* event = (struct inotify_event*)buffer;
+        size_t name_len = strlen(name);
+
+        event->wd = -1;
+        event->mask = metadata->mask & (FANOTIFY_EVENTS | IN_ISDIR);
+        event->cookie = 0;
+        event->len = name_len ? name_len + 1 : 0;
+        memcpy(event->name, name, name_len + 1);
+
+        debug_printf_n("fanotify event %x for %s/%s", event->mask, path->path, name);
+
+        snapshot_update(path, event);
+        dispatch_hooks(path, event);
+    }
+
+    if(fanotify_roots_cnt && (metadata->mask & FAN_ONDIR) && (metadata->mask & (FAN_MOVE | FAN_DELETE))) {
+        /** subdirectories below are resolved again under their new name if any */
+        if(path != 0 && name[0] != '\0') {
+            char dir[PATH_MAX];
+            struct incron_path* root = path->root ? path->root : path;
+            int path_len = strlen(path->path);
+
+            while(path_len > 1 && path->path[path_len - 1] == '/')
+                path_len--;
+
+            if(snprintf(dir, sizeof(dir), "%.*s/%s", path_len, path->path, name) < (int)sizeof(dir))
+                recursive_remove_subtree(root, dir);
+        }
+
+        fanotify_cache_flush();
+    }
+}
+
+int handle_fanotify_events(int fanotifyfd)
+{
+    char buffer[64 * 1024]
+    __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+    int errsv = 0;
+
+    while(1) {
+        ssize_t len = read(fanotifyfd, buffer, sizeof(buffer));
+
+        if(len == -1) {
+            errsv = errno;
+            if(errsv == EAGAIN)
+                break;
+
+            goto fail;
+        }
+
+        if(len == 0)
+            break;
+
+        dispatch_stamp();
+
+        struct fanotify_event_metadata* metadata = (struct fanotify_event_metadata*)buffer;
+
+        for(; FAN_EVENT_OK(metadata, len); metadata = FAN_EVENT_NEXT(metadata, len)) {
+            if(metadata->vers != FANOTIFY_METADATA_VERSION) {
+                syslog(LOG_CRIT, "fanotify metadata version mismatch");
+                errsv = EPROTO;
+                goto fail;
+            }
+
+            if(metadata->mask & FAN_Q_OVERFLOW) {
+                snapshot_recover();
+                continue;
+            }
+
+            fanotify_dispatch(metadata);
+        }
+    }
+
+    return 0;
+
+    fail:
+    errno = errsv;
+    return -1;
+}
@@ -0,0 +1,22 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_FANOTIFY_H__
+#define __INCROND_FANOTIFY_H__
+
+#include <stdint.h>
+#include <sys/inotify.h>
+
+struct incron_path;
+
+/** fanotify reports the same bits for the events incron is interested in */
+#define FANOTIFY_EVENTS (IN_ACCESS | IN_MODIFY | IN_ATTRIB | IN_CLOSE | IN_OPEN | \
+                         IN_MOVE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+int path_uses_fanotify(const struct incron_path* /*path*/);
+int fanotify_watch_paths();
+int fanotify_add_path(struct incron_path* /*path*/);
+int fanotify_update_path(struct incron_path* /*path*/);
+void fanotify_forget(struct incron_path* /*path*/);
+int handle_fanotify_events(int /*fanotifyfd*/);
+
+#endif
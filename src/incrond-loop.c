@@ -15,8 +15,16 @@
 #include <sys/inotify.h>
 
 #include "incrond.h"
+#include "incrond-config.h"
 #include "incrond-parse-tabs.h"
 #include "incrond-dispatch.h"
+#include "incrond-timer.h"
+#include "incrond-recursive.h"
+#include "incrond-fanotify.h"
+#include "incrond-shards.h"
+#include "incrond-spawner.h"
+#include "incrond-stream.h"
+#include "incrond-reload.h"
 
 static int shutdown_flag = 0;
 static int hup_flag = 0;
@@ -24,6 +32,10 @@ static int hup_flag = 0;
 /** wrappers */
 static struct epoll_wrapper signalfd_w;
 static struct epoll_wrapper inotifyfd_w;
+static struct epoll_wrapper timerfd_w;
+static struct epoll_wrapper fanotifyfd_w;
+static struct epoll_wrapper spawnerfd_w;
+static struct epoll_wrapper reloadfd_w;
 
 /** */
 int system_table_dir_fd;
@@ -33,7 +45,6 @@ int loop(int sigfd)
 {
     int ret = 0;
     int epollfd = 0;
-    int inotifyfd = 0;
     int errsv = 0;
     int events_cnt = 0;
     struct incron_path *p = 0;
@@ -58,23 +69,53 @@ int loop(int sigfd)
 
     events_cnt++;
 
-    inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
-    errsv = errno;
+    dispatch_set_epoll(epollfd);
+
+    /** without helper hooks are spawned by daemon */
+    spawnerfd_w.type = SPAWNER_FD;
+    spawnerfd_w.fd = spawner_fd();
+
+    if(spawnerfd_w.fd != -1) {
+        event = &spawnerfd_w.event;
+
+        event->events = EPOLLIN | EPOLLET;
+        event->data.ptr = &spawnerfd_w;
 
-    if(inotifyfd == -1) {
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, spawnerfd_w.fd, event) == -1) {
+            errsv = errno;
+            syslog(LOG_ERR, "epoll_ctl : adding spawn helper failed with %d:%s", errsv, strerror(errsv));
+            spawner_stop();
+        } else
+            events_cnt++;
+    }
+
+    if(shards_init(inotify_instances) == -1) {
+        errsv = errno;
         syslog(LOG_EMERG, "inotify_init1 failed with %d:%s", errsv, strerror(errsv));
         goto fail_close_epollfd;
     }
 
-    inotifyfd_w.type = INOTIFY_FD;
-    inotifyfd_w.fd = inotifyfd;
+    /** single instance is read by loop itself, several by reader threads queueing batches */
+    if(shards_count() == 1) {
+        inotifyfd_w.type = INOTIFY_FD;
+        inotifyfd_w.fd = shard_fd(0);
+    } else {
+        inotifyfd_w.type = INOTIFY_QUEUE_FD;
+        inotifyfd_w.fd = shards_start();
+        errsv = errno;
+
+        if(inotifyfd_w.fd == -1) {
+            syslog(LOG_EMERG, "starting inotify readers failed with %d:%s", errsv, strerror(errsv));
+            goto fail_close_inotifyfd;
+        }
+    }
 
     event = &inotifyfd_w.event;
 
     event->events = EPOLLIN | EPOLLET;
     event->data.ptr = &inotifyfd_w;
 
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, inotifyfd, event) == -1) {
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, inotifyfd_w.fd, event) == -1) {
         errsv = errno;
         syslog(LOG_CRIT, "epoll_ctl : adding inotifyfd failed with %d:%s", errsv, strerror(errsv));
         goto fail_close_inotifyfd;
@@ -82,9 +123,74 @@ int loop(int sigfd)
 
     events_cnt++;
 
+    /** initialize timer wheel */
+    timerfd_w.type = TIMER_FD;
+    timerfd_w.fd = incron_timer_init();
+    errsv = errno;
+
+    if(timerfd_w.fd == -1) {
+        syslog(LOG_EMERG, "timerfd_create failed with %d:%s", errsv, strerror(errsv));
+        goto fail_close_inotifyfd;
+    }
+
+    event = &timerfd_w.event;
+
+    event->events = EPOLLIN | EPOLLET;
+    event->data.ptr = &timerfd_w;
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, timerfd_w.fd, event) == -1) {
+        errsv = errno;
+        syslog(LOG_CRIT, "epoll_ctl : adding timerfd failed with %d:%s", errsv, strerror(errsv));
+        goto fail_close_timerfd;
+    }
+
+    events_cnt++;
+
+    /** tabs are still reloaded on SIGHUP if directories can't be watched */
+    reloadfd_w.type = RELOAD_FD;
+    reloadfd_w.fd = reload_init();
+
+    if(reloadfd_w.fd != -1) {
+        event = &reloadfd_w.event;
+
+        event->events = EPOLLIN | EPOLLET;
+        event->data.ptr = &reloadfd_w;
+
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, reloadfd_w.fd, event) == -1) {
+            errsv = errno;
+            syslog(LOG_ERR, "epoll_ctl : adding tab directories watch failed with %d:%s", errsv, strerror(errsv));
+            reload_stop();
+        } else
+            events_cnt++;
+    }
+
+    /** paths marked with fanotify are skipped below, anything failed falls back to inotify */
+    fanotifyfd_w.type = FANOTIFY_FD;
+    fanotifyfd_w.fd = fanotify_watch_paths();
+
+    if(fanotifyfd_w.fd != -1) {
+        event = &fanotifyfd_w.event;
+
+        event->events = EPOLLIN | EPOLLET;
+        event->data.ptr = &fanotifyfd_w;
+
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fanotifyfd_w.fd, event) == -1) {
+            errsv = errno;
+            syslog(LOG_CRIT, "epoll_ctl : adding fanotifyfd failed with %d:%s", errsv, strerror(errsv));
+            goto fail_close_fanotifyfd;
+        }
+
+        events_cnt++;
+    }
+
     /** initialize watched paths */
     for(p = incron_paths; p != NULL; p = p->hh.next) {
-        ret = inotify_add_watch(inotifyfd, p->path, p->flags);
+        if(p->fanotify)
+            continue;
+
+        int inotifyfd = shard_for_path(p->path);
+
+        ret = inotify_add_watch(inotifyfd, p->path, p->flags | snapshot_watch_mask(p) | recursive_watch_mask(p));
         debug_printf_n("inotify_add_watch : %d", ret);
         errsv = errno;
 
@@ -94,19 +200,27 @@ int loop(int sigfd)
             continue;
         }
 
-        p->wfd = ret;
+        pathSetWatch(p, inotifyfd, ret);
+
+        if(snapshot_build(p) == -1) {
+            errsv = errno;
+            syslog(LOG_WARNING, "snapshot of %s failed with %d:%s", p->path, errsv, strerror(errsv));
+        }
 
         syslog(LOG_INFO, "added watch for %s", p->path);
     }
 
+    recursive_watch_roots();
+
     while(!shutdown_flag) {
-        struct epoll_event events[events_cnt];
+        /** exited children pidfds come on top of fixed fds */
+        struct epoll_event events[events_cnt + LOOP_CHILD_EVENTS];
 
         struct timeval t1 = {0}; // [sec], [us]
         struct timeval t2 = {0};
 
         gettimeofday(&t1, NULL);
-        int nfds = epoll_wait(epollfd, events, events_cnt, -1); // timeout in milliseconds
+        int nfds = epoll_wait(epollfd, events, events_cnt + LOOP_CHILD_EVENTS, -1); // timeout in milliseconds
         errsv = errno;
 
         if (nfds == 0) {
@@ -122,54 +236,108 @@ int loop(int sigfd)
             switch(w->type) {
                 case INOTIFY_FD:
                     debug_printf_n("INOTIFY_FD event fired");
-                    ret = handle_events(inotifyfd);
+                    ret = handle_events(inotifyfd_w.fd);
+                    break;
+                case INOTIFY_QUEUE_FD:
+                    debug_printf_n("INOTIFY_QUEUE_FD event fired");
+                    ret = handle_shard_batches();
+                    break;
+                case FANOTIFY_FD:
+                    debug_printf_n("FANOTIFY_FD event fired");
+                    ret = handle_fanotify_events(fanotifyfd_w.fd);
+                    break;
+                case TIMER_FD:
+                    debug_printf_n("TIMER_FD event fired");
+                    ret = handle_timers();
                     break;
                 case SIGNAL_FD:
                 {
                     syslog(LOG_DEBUG, "SIGNAL_FD event fired");
                     struct signalfd_siginfo fdsi = {0};
                     ssize_t len;
-                    len = read(sigfd, &fdsi, sizeof(struct signalfd_siginfo));
+                    int sigchld = 0;
+
+                    /** signalfd is edge triggered and signals coalesce - drain all of them */
+                    while((len = read(sigfd, &fdsi, sizeof(struct signalfd_siginfo))) == sizeof(struct signalfd_siginfo)) {
+                        switch(fdsi.ssi_signo)
+                        {
+                            case SIGINT:
+                            case SIGTERM:
+                                syslog(LOG_DEBUG, "SIGTERM or SIGINT signal recieved - shutting down...");
+                                shutdown_flag = 1;
+                                break;
+                            case SIGHUP:
+                                hup_flag = 1;
+                                break;
+                            case SIGCHLD:
+                                sigchld = 1;
+                                break;
+                            default:
+                                break;
+                        }
+                    }
 
-                    if (len != sizeof(struct signalfd_siginfo))
+                    if (len == -1 && errno != EAGAIN)
                         syslog(LOG_CRIT, "reading sigfd failed");
 
-                    switch(fdsi.ssi_signo)
-                    {
-                        case SIGINT:
-                        case SIGTERM:
-                            syslog(LOG_DEBUG, "SIGTERM or SIGINT signal recieved - shutting down...");
-                            shutdown_flag = 1;
-                            break;
-                        case SIGHUP:
-                            hup_flag = 1;
-                            break;
-                        case SIGCHLD:
-                            syslog(LOG_INFO, "SIGCHLD signal recieved - child [%d] finished with status %d...", fdsi.ssi_pid, fdsi.ssi_status);
-                            pid_t pid = waitpid(fdsi.ssi_pid, 0, WNOHANG);
-                            if(pid != -1)
-                                hook_clear_spawned(pid);
-                            break;
-                        default:
-                            break;
+                    /** children with pidfd are reaped by PID_FD events */
+                    if(sigchld)
+                        hook_reap_untracked();
+
+                    if(hup_flag) {
+                        hup_flag = 0;
+                        reload_all();
                     }
                 }
                 break;
+                case PID_FD:
+                    ret = hook_reap(w);
+                    break;
+                case SPAWNER_FD:
+                    debug_printf_n("SPAWNER_FD event fired");
+                    ret = hook_spawner_replies();
+                    break;
+                case RELOAD_FD:
+                    debug_printf_n("RELOAD_FD event fired");
+                    ret = handle_reload_events(reloadfd_w.fd);
+                    break;
                 default:
                     break;
             }
         }
     }
 
-    close(inotifyfd);
+    const struct incron_read_stats* stats = handle_events_stats();
+    syslog(LOG_INFO, "inotify queue drained with %lu reads : %lu bytes, %lu events",
+           stats->reads, stats->bytes, stats->events);
+
+    dispatch_log_stats();
+    dispatch_flush_batches();
+    reload_stop();
+
+    stream_stop_all();
+    dispatch_set_epoll(-1);
+
+    if(fanotifyfd_w.fd != -1)
+        close(fanotifyfd_w.fd);
+    close(timerfd_w.fd);
+    shards_stop();
     close(epollfd);
 
     return 0;
 
+    fail_close_fanotifyfd:
+    close(fanotifyfd_w.fd);
+    reload_stop();
+
+    fail_close_timerfd:
+    close(timerfd_w.fd);
+
     fail_close_inotifyfd:
-    close(inotifyfd);
+    shards_stop();
 
     fail_close_epollfd:
+    dispatch_set_epoll(-1);
     close(epollfd);
 
     return -1;
@@ -5,10 +5,19 @@
 
 #include <sys/epoll.h>
 
+/** pidfd events handled per epoll_wait */
+#define LOOP_CHILD_EVENTS 64
+
 /// loop types used in single epoll loop
 enum loop_type {
     INOTIFY_FD,         ///< event from inotify
     SIGNAL_FD,          ///< signals watch file descriptor
+    TIMER_FD,           ///< timer wheel timerfd
+    FANOTIFY_FD,        ///< event from fanotify
+    INOTIFY_QUEUE_FD,   ///< batches read by inotify reader threads
+    PID_FD,             ///< spawned child pidfd
+    SPAWNER_FD,         ///< replies from spawn helper
+    RELOAD_FD,          ///< tab directories changes
     LOOP_TYPE_MAX
 };
 
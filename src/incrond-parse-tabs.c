@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: GPL-2.0-only
 #include "incrond-parse-tabs.h"
 
+#include <stddef.h>
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
@@ -12,12 +13,16 @@
 #include <stdbool.h>
 #include <pwd.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 
 #include "incrond.h"
 #include "incrond-config.h"
 #include "cmdline.h"
+#include "c_bitops.h"
+#include "incrond-arena.h"
 
 struct incrond_hook_modifier incrond_hook_modifiers[] = {
     { str(IN_ACCESS), IN_ACCESS },
@@ -45,6 +50,9 @@ struct incrond_hook_modifier incrond_hook_modifiers[] = {
     { str(IN_MOVE), IN_MOVE },
     { str(IN_ALL_EVENTS), IN_ALL_EVENTS },
     { str(IN_NO_LOOP), IN_NO_LOOP },
+    { str(IN_RECURSIVE), IN_RECURSIVE },
+    { str(IN_FANOTIFY), IN_FANOTIFY },
+    { str(IN_STREAM), IN_STREAM },
     { 0, 0},
 };
 
@@ -53,6 +61,7 @@ struct incrond_hook_modifier incrond_hook_modifiers[] = {
 //  $# event-related file name
 //  $% event flags (textually)
 //  $& event flags (numerically)
+//  $^ event time (seconds.nanoseconds)
 
 const char* incrond_special_args_array[] = {
     "$$", // dollar sign
@@ -60,6 +69,7 @@ const char* incrond_special_args_array[] = {
     "$#", // event-related file name
     "$%", // event flags (textually)
     "$&", // event flags (numerically)
+    "$^", // event time
     0
 };
 
@@ -96,6 +106,9 @@ static inline enum INCRON_TAB_ARG_ENUM tab_parse_args(uint8_t value)
         case '&':
             arg = TAB_ARG_EVENT_NUM;
             break;
+        case '^':
+            arg = TAB_ARG_EVENT_TIME;
+            break;
         default:
             break;
     }
@@ -103,6 +116,108 @@ static inline enum INCRON_TAB_ARG_ENUM tab_parse_args(uint8_t value)
     return arg;
 }
 
+static int tab_parse_uint(const char* value, size_t length, uint32_t* out)
+{
+    char buffer[16];
+    char* end = 0;
+
+    if(length == 0 || length >= sizeof(buffer))
+        goto fail;
+
+    memcpy(buffer, value, length);
+    buffer[length] = '\0';
+
+    unsigned long v = strtoul(buffer, &end, 10);
+    if(*end != '\0' || v > UINT32_MAX)
+        goto fail;
+
+    *out = v;
+    return 0;
+
+    fail:
+    errno = EINVAL;
+    return -1;
+}
+
+static int hook_set_delay(struct incron_hook* hook, const char* value, size_t length)
+{
+    return tab_parse_uint(value, length, &hook->delay);
+}
+
+static int hook_set_max_spawn(struct incron_hook* hook, const char* value, size_t length)
+{
+    return tab_parse_uint(value, length, &hook->max_spawn);
+}
+
+/** IN_NO_LOOP=<ms> is IN_NO_LOOP with grace period, IN_NO_LOOP=0 is plain IN_NO_LOOP */
+static int hook_set_no_loop(struct incron_hook* hook, const char* value, size_t length)
+{
+    if(tab_parse_uint(value, length, &hook->loop_grace) == -1)
+        return -1;
+
+    hook->iflags |= IN_NO_LOOP;
+    return 0;
+}
+
+static int hook_set_batch(struct incron_hook* hook, const char* value, size_t length)
+{
+    return tab_parse_uint(value, length, &hook->batch_max);
+}
+
+static int hook_set_batch_ms(struct incron_hook* hook, const char* value, size_t length)
+{
+    return tab_parse_uint(value, length, &hook->batch_ms);
+}
+
+static int hook_set_queue(struct incron_hook* hook, const char* value, size_t length)
+{
+    return tab_parse_uint(value, length, &hook->queue_max);
+}
+
+static const char* overflow_names[] = {
+    [OVERFLOW_DROP_OLDEST] = "drop-oldest",
+    [OVERFLOW_DROP_NEWEST] = "drop-newest",
+    [OVERFLOW_COALESCE] = "coalesce",
+};
+
+static int hook_set_overflow(struct incron_hook* hook, const char* value, size_t length)
+{
+    for(size_t i = 0; i < sizeof(overflow_names) / sizeof(overflow_names[0]); i++) {
+        if(strlen(overflow_names[i]) == length && strncmp(value, overflow_names[i], length) == 0) {
+            hook->overflow = i;
+            return 0;
+        }
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+struct incrond_hook_option incrond_hook_options[] = {
+    { "IN_DELAY", hook_set_delay },
+    { "IN_NO_LOOP", hook_set_no_loop },
+    { "IN_MAX_SPAWN", hook_set_max_spawn },
+    { "IN_QUEUE", hook_set_queue },
+    { "IN_OVERFLOW", hook_set_overflow },
+    { "IN_BATCH", hook_set_batch },
+    { "IN_BATCH_MS", hook_set_batch_ms },
+    { 0, 0 },
+};
+
+static int tab_parse_option(struct incron_hook* hook, const char* name, size_t name_length, const char* value, size_t length)
+{
+    int i = 0;
+
+    for(i = 0; incrond_hook_options[i].name != 0; i++) {
+        if(strlen(incrond_hook_options[i].name) == name_length &&
+           strncmp(name, incrond_hook_options[i].name, name_length) == 0)
+            return incrond_hook_options[i].set_value(hook, value, length);
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
 struct incron_path* findPath(const char* buffer, size_t len)
 {
     struct incron_path* s = 0;
@@ -115,37 +230,398 @@ struct incron_path* findPath(const char* buffer, size_t len)
 
     s->path = strndup(buffer, len);
     s->flags = 0;
+    s->iflags = 0;
+    s->ifd = -1;
+    s->wfd = -1;
+    s->wfd_next = 0;
+    s->fanotify = 0;
+    s->snapshot = 0;
+    s->snapshot_gen = 0;
+    s->root = 0;
+    s->children = 0;
+    s->index = 0;
 
     INIT_LIST_HEAD(&(s->list));
     INIT_LIST_HEAD(&(s->hook_list));
+    INIT_LIST_HEAD(&(s->rescan));
+    INIT_LIST_HEAD(&(s->settle));
 
     HASH_ADD_KEYPTR( hh, incron_paths, s->path, len, s );
 
     return s;
 }
 
+/** (inotify instance, watch fd) -> path index, paths sharing a watch fd are chained via wfd_next */
+static struct incron_path* incron_wfds = 0;
+
+/** ifd and wfd are hashed as a single key */
+#define WATCH_KEY_LEN (2 * sizeof(int))
+_Static_assert(offsetof(struct incron_path, wfd) == offsetof(struct incron_path, ifd) + sizeof(int),
+               "ifd and wfd must be adjacent");
+
+struct incron_path* findPathByWatch(int ifd, int wfd)
+{
+    struct incron_path* s = 0;
+    int key[2] = { ifd, wfd };
+
+    HASH_FIND(hh_wfd, incron_wfds, key, WATCH_KEY_LEN, s);
+
+    return s;
+}
+
+void pathSetWatch(struct incron_path* path, int ifd, int wfd)
+{
+    if(path->ifd == ifd && path->wfd == wfd)
+        return;
+
+    pathClearWatch(path);
+
+    path->ifd = ifd;
+    path->wfd = wfd;
+    path->wfd_next = 0;
+
+    struct incron_path* head = findPathByWatch(ifd, wfd);
+
+    if(head == 0) {
+        HASH_ADD(hh_wfd, incron_wfds, ifd, WATCH_KEY_LEN, path);
+        return;
+    }
+
+    /** inotify returns the same wd for the same inode watched under different names */
+    path->wfd_next = head->wfd_next;
+    head->wfd_next = path;
+}
+
+void pathClearWatch(struct incron_path* path)
+{
+    if(path->wfd == -1)
+        return;
+
+    struct incron_path* head = findPathByWatch(path->ifd, path->wfd);
+
+    if(head == path) {
+        HASH_DELETE(hh_wfd, incron_wfds, path);
+
+        if(path->wfd_next != 0)
+            HASH_ADD(hh_wfd, incron_wfds, ifd, WATCH_KEY_LEN, path->wfd_next);
+    } else if(head != 0) {
+        struct incron_path* p = head;
+
+        while(p->wfd_next != 0 && p->wfd_next != path)
+            p = p->wfd_next;
+
+        if(p->wfd_next == path)
+            p->wfd_next = path->wfd_next;
+    }
+
+    path->ifd = -1;
+    path->wfd = -1;
+    path->wfd_next = 0;
+}
+
 int pathAddHook(struct incron_path* path, struct incron_hook* hook)
 {
     // list_add_tail(&(arg->list), &(hook->arg_list));
     list_add_tail(&(hook->list), &(path->hook_list));
 
     path->flags |= hook->flags;
+    path->iflags |= hook->iflags;
+
+    hook->path = path;
+    pathIndexReset(path);
+
+    return 0;
+}
+
+/** flags are only ever ORed on load, removed hooks need them rebuilt */
+void pathUpdateFlags(struct incron_path* path)
+{
+    struct incron_hook* hook = 0;
+
+    path->flags = 0;
+    path->iflags = 0;
+
+    list_for_each_entry(hook, &(path->hook_list), list) {
+        path->flags |= hook->flags;
+        path->iflags |= hook->iflags;
+    }
+
+    pathIndexReset(path);
+}
+
+void pathIndexReset(struct incron_path* path)
+{
+    free(path->index);
+    path->index = 0;
+}
+
+/** @return index of path hooks, 0 if it couldn't be built */
+struct incron_hook_index* pathHookIndex(struct incron_path* path)
+{
+    struct incron_hook* hook = 0;
+    uint32_t hook_cnt = 0, slot_cnt = 0;
+    unsigned bit = 0;
+
+    if(path->index != 0)
+        return path->index;
+
+    list_for_each_entry(hook, &(path->hook_list), list) {
+        hook_cnt++;
+        slot_cnt += popcount(hook->flags);
+    }
+
+    size_t hooks_off = sizeof(struct incron_hook_index) + slot_cnt * sizeof(uint32_t);
+    hooks_off = (hooks_off + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    struct incron_hook_index* index = malloc(hooks_off + hook_cnt * sizeof(struct incron_hook*));
+    if(index == 0)
+        return 0;
+
+    index->hook_cnt = hook_cnt;
+    index->hooks = (struct incron_hook**)((char*)index + hooks_off);
+    memset(index->bit_off, 0, sizeof(index->bit_off));
+
+    /** count per bit, then turn counts into offsets */
+    list_for_each_entry(hook, &(path->hook_list), list)
+        for_each_set_bit(bit, hook->flags, HOOK_INDEX_BITS)
+            index->bit_off[bit + 1]++;
+
+    for(bit = 0; bit < HOOK_INDEX_BITS; bit++)
+        index->bit_off[bit + 1] += index->bit_off[bit];
+
+    uint32_t fill[HOOK_INDEX_BITS];
+    uint32_t slot = 0;
+
+    memcpy(fill, index->bit_off, sizeof(fill));
+
+    list_for_each_entry(hook, &(path->hook_list), list) {
+        index->hooks[slot] = hook;
+
+        for_each_set_bit(bit, hook->flags, HOOK_INDEX_BITS)
+            index->slots[fill[bit]++] = slot;
+
+        slot++;
+    }
+
+    path->index = index;
+
+    return index;
+}
+
+/** split command arguments into literals and $ arguments */
+static int hookCompile(struct incron_hook* hook)
+{
+    struct incron_hook_template* tpl = &(hook->tpl);
+    size_t text_len = 0;
+    uint32_t seg_max = 0;
+
+    memset(tpl, 0, sizeof(struct incron_hook_template));
+
+    /** every $ may start a segment, plus one per argument */
+    for(int j = 0; j < hook->argc; j++) {
+        text_len += strlen(hook->argv[j]);
+        seg_max++;
+
+        for(const char* c = hook->argv[j]; *c; c++)
+            if(*c == '$')
+                seg_max++;
+    }
+
+    tpl->text = arena_alloc(hook->arena, text_len + 1);
+    tpl->segs = arena_alloc(hook->arena, seg_max * sizeof(struct incron_hook_seg));
+
+    /** argv for bash -c or direct exec */
+    tpl->argv = arena_alloc(hook->arena, ((hook->argc > 3 ? hook->argc : 3) + 1) * sizeof(char*));
+
+    if(tpl->text == 0 || tpl->segs == 0 || tpl->argv == 0)
+        goto fail;
+
+    for(int j = 0; j < hook->argc; j++) {
+        const char* lit = hook->argv[j];
+        const char* c = lit;
+
+        while(1) {
+            enum INCRON_TAB_ARG_ENUM arg = TAB_ARG_MAX;
+
+            c = strchr(c, '$');
+            if(c != 0)
+                arg = c[1] != '\0' ? tab_parse_args(c[1]) : TAB_ARG_MAX;
+
+            /** shell $ stays literal */
+            if(c != 0 && arg == TAB_ARG_MAX) {
+                c++;
+                continue;
+            }
+
+            struct incron_hook_seg* seg = &(tpl->segs[tpl->seg_cnt++]);
+            size_t len = c ? (size_t)(c - lit) : strlen(lit);
+
+            seg->offset = tpl->literal_len;
+            seg->len = len;
+            seg->arg = arg;
+            seg->last = c == 0;
+
+            memcpy(tpl->text + tpl->literal_len, lit, len);
+            tpl->literal_len += len;
+
+            if(c == 0)
+                break;
+
+            tpl->arg_cnt[arg]++;
+            debug_printf_n("found %.2s in %s at %ld", c, hook->argv[j], (long)(c - hook->argv[j]));
+
+            lit = c = c + 2;
+        }
+    }
+
+    tpl->text[tpl->literal_len] = '\0';
 
     return 0;
+
+    fail:
+    memset(tpl, 0, sizeof(struct incron_hook_template));
+
+    errno = ENOMEM;
+    return -1;
+}
+
+/** shell reserved words and builtins with no executable doing the same */
+static const char* shell_only_commands[] = {
+    "if", "then", "else", "elif", "fi", "case", "esac", "for", "select",
+    "while", "until", "do", "done", "function", "time", "coproc",
+    ".", "source", "exec", "export", "cd", "eval", "set", "unset", "alias",
+    "read", "exit", "return", "trap", "ulimit", "umask", "shopt", "builtin",
+    "command", "local", "declare", "typeset", "readonly", "let", "shift", "wait",
+    "getopts", "hash", "type", "enable", "mapfile", "readarray", "pushd", "popd",
+    "dirs", "jobs", "fg", "bg", "disown",
+    0
+};
+
+/** @return true if command uses anything besides plain words and incron arguments */
+static bool tab_needs_shell(const struct incron_hook* hook)
+{
+    if(hook->argc == 0)
+        return true;
+
+    for(int j = 0; j < hook->argc; j++) {
+        const char* tok = hook->argv[j];
+
+        /** comment or tilde expansion */
+        if(*tok == '#' || *tok == '~')
+            return true;
+
+        for(const char* c = tok; *c; c++) {
+            /** $@, $#, $% and $& are replaced by incrond, rest is up to shell */
+            if(*c == '$') {
+                if(c[1] == '\0' || strchr("@#%&^", c[1]) == 0)
+                    return true;
+
+                /** command itself depends on event */
+                if(j == 0)
+                    return true;
+
+                c++;
+                continue;
+            }
+
+            if(strchr("|&;<>()`\\\"' \t\n*?[]{}!", *c) != 0)
+                return true;
+
+            /** variable assignment before command */
+            if(j == 0 && *c == '=')
+                return true;
+        }
+    }
+
+    for(int i = 0; shell_only_commands[i] != 0; i++)
+        if(strcmp(hook->argv[0], shell_only_commands[i]) == 0)
+            return true;
+
+    return false;
+}
+
+/** @return true if uid and gid certainly may exec file or search directory st is of */
+static bool tab_mode_allows(const struct stat* st, uid_t uid, gid_t gid)
+{
+    if(uid == 0)
+        return st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH);
+
+    if(st->st_uid == uid)
+        return st->st_mode & S_IXUSR;
+
+    if(st->st_gid == gid)
+        return st->st_mode & S_IXGRP;
+
+    /** hook keeps supplementary groups of daemon, one of them may be file group */
+    return (st->st_mode & S_IXOTH) && (st->st_mode & S_IXGRP);
+}
+
+/** @return true if hook running as uid and gid can exec path, (uid_t)-1 stands for daemon itself */
+bool tabCanExec(const char* path, uid_t uid, gid_t gid)
+{
+    struct stat st;
+
+    if(stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+        return false;
+
+    if(uid == (uid_t)-1 || uid == geteuid())
+        return access(path, X_OK) == 0;
+
+    return tab_mode_allows(&st, uid, gid);
 }
 
-int hookAddArg(struct incron_hook* hook, struct incron_hook_arg* arg)
+/** @return executable path looked up in PATH once, 0 if there is none hook user can run */
+static char* tab_resolve_command(struct incron_arena* arena, const char* name, uid_t uid, gid_t gid)
 {
-    hook->arg_list_size++;
+    struct stat st;
+    bool other = uid != (uid_t)-1 && uid != geteuid();
+
+    if(strchr(name, '/') != 0) {
+        /** relative to hook working directory, leave it to shell */
+        if(*name != '/')
+            return 0;
+
+        return arena_strdup(arena, name);
+    }
+
+    const char* path_env = getenv("PATH");
+    if(path_env == 0)
+        return 0;
 
-    list_add_tail(&(arg->list), &(hook->arg_list));
+    size_t name_len = strlen(name);
+
+    while(*path_env) {
+        const char* end = strchrnul(path_env, ':');
+        size_t dir_len = end - path_env;
+
+        /** empty entry means current directory, leave it to shell */
+        if(dir_len > 0 && dir_len + name_len + 2 <= PATH_MAX) {
+            char candidate[PATH_MAX];
+
+            memcpy(candidate, path_env, dir_len);
+            candidate[dir_len] = '\0';
+
+            /** like execvp, entries user can't get to are skipped */
+            bool searchable = !other || (stat(candidate, &st) == 0 && tab_mode_allows(&st, uid, gid));
+
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+            if(searchable && tabCanExec(candidate, uid, gid))
+                return arena_strdup(arena, candidate);
+        }
+
+        path_env = *end ? end + 1 : end;
+    }
 
     return 0;
 }
 
-struct incron_hook* loadTabLine(int line_num, char* line, size_t len)
+/** parse line without touching incron_paths, hook and watched path in path_name come from arena,
+ *  direct commands are resolved for uid and gid hook will run as */
+static struct incron_hook* parseTabLine(struct incron_arena* arena, int line_num, char* line, size_t len, char** path_name,
+                                        uid_t uid, gid_t gid)
 {
-    char* tmp = 0;
     char* tmp1 = 0;
     char* tmp2 = 0;
     int arg_len = 0;
@@ -175,8 +651,32 @@ struct incron_hook* loadTabLine(int line_num, char* line, size_t len)
     // argv[1]  - flags
     // argv[2]+ - path to executable and args (no parsing enviroment currently)
 
-    /** add/find path from argv[0] */
-    struct incron_path* path = findPath(argv[0], strlen(argv[0]));
+    *path_name = arena_strdup(arena, argv[0]);
+    struct incron_hook *hook = arena_alloc(arena, sizeof(struct incron_hook));
+
+    if(*path_name == 0 || hook == 0) {
+        errsv = ENOMEM;
+        goto fail_argv;
+    }
+
+    hook->arena = arena;
+
+    hook->iflags = 0;
+    hook->delay = 0;
+    hook->max_spawn = 0;
+    hook->running = 0;
+    hook->queue_max = HOOK_QUEUE_DEFAULT;
+    hook->queue_len = 0;
+    hook->throttled_len = 0;
+    hook->overflow = OVERFLOW_DROP_OLDEST;
+    hook->batch_max = 0;
+    hook->batch_ms = BATCH_MS_DEFAULT;
+    hook->batch = 0;
+    hook->loop_grace = 0;
+    hook->loop_until = 0;
+    hook->queued = hook->dropped = hook->coalesced = hook->suppressed = 0;
+    INIT_LIST_HEAD(&(hook->queue));
+    INIT_LIST_HEAD(&(hook->throttled));
 
     /** get modifiers from argv[1] */
     char* coma = 0;
@@ -191,6 +691,16 @@ struct incron_hook* loadTabLine(int line_num, char* line, size_t len)
 
         arg_len = tmp2 - tmp1;
 
+        /** valued modifiers i.e. IN_DELAY=500 */
+        char* eq = memchr((void*)tmp1, '=', arg_len);
+        if(eq != 0) {
+            ret = tab_parse_option(hook, tmp1, eq - tmp1, eq + 1, tmp2 - eq - 1);
+            if(ret == -1)
+                syslog(LOG_ERR, "line %d : bad option %.*s", line_num, arg_len, tmp1);
+
+            goto next_arg;
+        }
+
         enum INCROD_TAB_ENUM mod = tab_parse_mod(tmp1, arg_len);
 
         if(mod == INCROD_TAB_ENUM_MAX)
@@ -216,53 +726,27 @@ struct incron_hook* loadTabLine(int line_num, char* line, size_t len)
         tmp2 = pe;
     } while(coma != 0);
 
-    /** */
-    struct incron_hook *hook = malloc(sizeof(struct incron_hook));
-
     hook->flags = flags | IN_IGNORED; // i am really not sure if IN_IGNORED should be added explicitly follow old incrond case
-    hook->iflags = iflags;
+    hook->iflags |= iflags;
     hook->fired = 0;
-
-    hook->arg_list_size = 0;
-    INIT_LIST_HEAD(&(hook->arg_list));
-
-    pathAddHook(path, hook);
+    hook->path = 0;
 
     /** get all args from argv[2]+ */
-    hook->argv = (char**)malloc((argc - 2 + 1/*NULL*/)*sizeof(char*));
+    hook->argv = arena_alloc(arena, (argc - 2 + 1/*NULL*/)*sizeof(char*));
+    if(hook->argv == 0) {
+        errsv = ENOMEM;
+        goto fail_argv;
+    }
 
     int i = 2, j = -1;
     while(argv[i] != NULL) {
         j++;
-        arg_len = strlen(argv[i]) + 1;
-        debug_printf_n("%s : %d", argv[i], arg_len);
-        hook->argv[j] = strndup(argv[i], arg_len);
-        char* pe = hook->argv[j] + arg_len;
-
-        tmp = memchr((void*)hook->argv[j], '$', arg_len);
-
-        while(tmp != 0 && *(tmp + 1) != '\0')
-        {
-            enum INCRON_TAB_ARG_ENUM arg = TAB_ARG_MAX;
-
-            arg = tab_parse_args(*(tmp + 1));
-
-            if(arg != TAB_ARG_MAX)
-            {
-                struct incron_hook_arg* i_arg = malloc(sizeof(struct incron_hook_arg));
+        debug_printf_n("%s : %ld", argv[i], (long)strlen(argv[i]) + 1);
+        hook->argv[j] = arena_strdup(arena, argv[i]);
 
-                i_arg->index = j;
-                i_arg->arg = arg;
-                i_arg->pos = tmp - hook->argv[j];
-
-                list_add_tail(&(i_arg->list), &(hook->arg_list));
-
-                debug_printf_n("found %.2s in %s at %u", tmp, hook->argv[j], i_arg->pos);
-            }
-
-
-            arg_len = pe - tmp;
-            tmp = memchr((void*)(tmp + 1), '$', arg_len - 1);
+        if(hook->argv[j] == 0) {
+            errsv = ENOMEM;
+            goto fail_argv;
         }
 
         i++;
@@ -270,35 +754,254 @@ struct incron_hook* loadTabLine(int line_num, char* line, size_t len)
 
     hook->argv[j + 1] = 0;
     hook->argc = j + 1;
+
+    if(hookCompile(hook) == -1) {
+        errsv = errno;
+        syslog(LOG_ERR, "line %d : compiling command failed", line_num);
+    }
+
     hook->command = "/bin/bash";
+    hook->direct = 0;
+
+    /** plain commands are exec'ed with expanded argv, without shell in between */
+    if(!(iflags & IN_STREAM) && !tab_needs_shell(hook)) {
+        char* command = tab_resolve_command(arena, hook->argv[0], uid, gid);
+
+        if(command != 0) {
+            hook->command = command;
+            hook->direct = 1;
+        }
+    }
 
     hook->pw_uid = -1;
     hook->pw_gid = -1;
+    hook->pw_dir = 0;
+    hook->tab = 0;
+    hook->tab_type = TAB_SYSTEM;
+    hook->stream = 0;
+    INIT_LIST_HEAD(&(hook->tab_list));
 
     /* free argv */
     for(int i = 0; i < argc; i++)
         free(argv[i]);
     free(argv);
 
+    /** arena is released with the last hook using it */
+    arena_get(arena);
+
     return hook;
 
+    fail_argv:
+    for(int i = 0; i < argc; i++)
+        free(argv[i]);
+    free(argv);
+
     fail:
     errno = errsv;
     return 0;
 }
 
-int loadTab(int dirfd, const char* fileName, uid_t uid, gid_t gid)
+struct incron_hook* loadTabLine(int line_num, char* line, size_t len)
+{
+    char* path_name = 0;
+
+    struct incron_arena* arena = arena_new();
+    if(arena == 0)
+        return 0;
+
+    struct incron_hook* hook = parseTabLine(arena, line_num, line, len, &path_name, -1, -1);
+
+    /** add/find path from argv[0] */
+    if(hook != 0)
+        pathAddHook(findPath(path_name, strlen(path_name)), hook);
+
+    arena_put(arena);
+
+    return hook;
+}
+
+/** hooks unchanged by reload keep their state, so everything affecting spawning is compared */
+bool hookEqual(const struct incron_hook* a, const struct incron_hook* b)
+{
+    if(a->path != b->path || a->flags != b->flags || a->iflags != b->iflags)
+        return false;
+
+    if(a->delay != b->delay || a->max_spawn != b->max_spawn || a->queue_max != b->queue_max ||
+       a->overflow != b->overflow || a->loop_grace != b->loop_grace ||
+       a->batch_max != b->batch_max || a->batch_ms != b->batch_ms)
+        return false;
+
+    if(a->pw_uid != b->pw_uid || a->pw_gid != b->pw_gid)
+        return false;
+
+    if((a->pw_dir == 0) != (b->pw_dir == 0) || (a->pw_dir != 0 && strcmp(a->pw_dir, b->pw_dir) != 0))
+        return false;
+
+    if(a->argc != b->argc)
+        return false;
+
+    for(int i = 0; i < a->argc; i++) {
+        if(strcmp(a->argv[i], b->argv[i]) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+/** copy of hook that never fired, with its argv, template and strings moved to arena,
+ *  copy isn't on any list yet */
+struct incron_hook* hookCopy(struct incron_arena* arena, const struct incron_hook* hook)
+{
+    struct incron_hook* copy = arena_alloc(arena, sizeof(struct incron_hook));
+    if(copy == 0)
+        return 0;
+
+    *copy = *hook;
+
+    copy->argv = arena_alloc(arena, (hook->argc + 1) * sizeof(char*));
+    if(copy->argv == 0)
+        return 0;
+
+    for(int i = 0; i < hook->argc; i++) {
+        copy->argv[i] = arena_strdup(arena, hook->argv[i]);
+        if(copy->argv[i] == 0)
+            return 0;
+    }
+
+    if(hook->direct && (copy->command = arena_strdup(arena, hook->command)) == 0)
+        return 0;
+
+    if(hook->pw_dir != 0 && (copy->pw_dir = arena_strdup(arena, hook->pw_dir)) == 0)
+        return 0;
+
+    if(hook->tab != 0 && (copy->tab = arena_strdup(arena, hook->tab)) == 0)
+        return 0;
+
+    if(hook->tpl.text != 0) {
+        copy->tpl.text = arena_alloc(arena, hook->tpl.literal_len + 1);
+        copy->tpl.segs = arena_alloc(arena, hook->tpl.seg_cnt * sizeof(struct incron_hook_seg));
+
+        if(copy->tpl.text == 0 || (hook->tpl.seg_cnt != 0 && copy->tpl.segs == 0))
+            return 0;
+
+        memcpy(copy->tpl.text, hook->tpl.text, hook->tpl.literal_len);
+        memcpy(copy->tpl.segs, hook->tpl.segs, hook->tpl.seg_cnt * sizeof(struct incron_hook_seg));
+    }
+
+    if(hook->tpl.argv != 0) {
+        copy->tpl.argv = arena_alloc(arena, ((hook->argc > 3 ? hook->argc : 3) + 1) * sizeof(char*));
+        if(copy->tpl.argv == 0)
+            return 0;
+    }
+
+    INIT_LIST_HEAD(&(copy->list));
+    INIT_LIST_HEAD(&(copy->tab_list));
+    INIT_LIST_HEAD(&(copy->queue));
+    INIT_LIST_HEAD(&(copy->throttled));
+
+    copy->arena = arena;
+    arena_get(arena);
+
+    return copy;
+}
+
+struct incron_tab* findTab(enum incron_tab_type type, const char* name)
+{
+    struct incron_tab* tab = 0;
+
+    HASH_FIND_STR(incron_tabs[type], name, tab);
+
+    if(tab != 0)
+        return tab;
+
+    tab = malloc(sizeof(struct incron_tab));
+    if(tab == 0)
+        return 0;
+
+    tab->name = strdup(name);
+    if(tab->name == 0) {
+        free(tab);
+        return 0;
+    }
+
+    INIT_LIST_HEAD(&(tab->hooks));
+
+    HASH_ADD_KEYPTR(hh, incron_tabs[type], tab->name, strlen(tab->name), tab);
+
+    return tab;
+}
+
+/** hooks are owned by their paths, tab only has to be empty */
+void freeTab(enum incron_tab_type type, struct incron_tab* tab)
+{
+    struct incron_hook *hook = 0, *tmp = 0;
+
+    list_for_each_entry_safe(hook, tmp, &(tab->hooks), tab_list)
+        list_del_init(&(hook->tab_list));
+
+    HASH_DEL(incron_tabs[type], tab);
+    free(tab->name);
+    free(tab);
+}
+
+/** parsed hook waiting to be attached to its path */
+struct tab_parsed {
+    struct incron_hook* hook;
+    const char* path;           ///> watched path hook goes to, in tab arena
+};
+
+/** tab file parsed by loader thread, committed by caller */
+struct tab_job {
+    const char* name;           ///> tab file name
+    enum incron_tab_type type;
+    uid_t uid;                  ///> user hooks run as
+    gid_t gid;
+    char* dir;                  ///> user home directory, 0 for system tabs
+    int ret;                    ///> -1 if tab isn't loaded
+    struct incron_arena* arena; ///> hooks of this tab generation
+    struct tab_parsed* hooks;
+    size_t hook_cnt;
+    size_t hook_max;
+};
+
+/** hook keeping tab_list empty can be freed before it is attached */
+static void freeParsed(struct tab_job* job)
+{
+    for(size_t i = 0; i < job->hook_cnt; i++)
+        freeHook(job->hooks[i].hook);
+
+    free(job->hooks);
+    free(job->dir);
+    arena_put(job->arena);
+
+    job->hooks = 0;
+    job->hook_cnt = job->hook_max = 0;
+    job->dir = 0;
+    job->arena = 0;
+}
+
+/** read and parse tab file, safe to run in parallel as nothing shared is touched */
+static int parseTab(int dirfd, struct tab_job* job)
 {
     int errsv = 0;
 
-    int fd = openat(dirfd, fileName, O_RDONLY);
+    job->arena = arena_new();
+    if(job->arena == 0)
+        return -1;
+
+    int fd = openat(dirfd, job->name, O_RDONLY | O_CLOEXEC);
     errsv = errno;
     if(fd == -1) {
-        syslog(LOG_ERR, "Couldn't open file: %s for reading", fileName);
+        syslog(LOG_ERR, "Couldn't open file: %s for reading", job->name);
         goto fail;
     }
 
     FILE* file = fdopen(fd, "r");
+    if(file == 0) {
+        errsv = errno;
+        close(fd);
+        goto fail;
+    }
 
     char* line = NULL;
     size_t len = 0;
@@ -306,19 +1009,37 @@ int loadTab(int dirfd, const char* fileName, uid_t uid, gid_t gid)
     ssize_t nread;
 
     while ((nread = getline(&line, &len, file)) != -1) {
+        char* path_name = 0;
+
         line[nread - 1] = '\0';
         debug_printf_n("parsing line [%ld] : %s", nread, line);
-        struct incron_hook* hook = loadTabLine(++line_num, line, nread);
+        struct incron_hook* hook = parseTabLine(job->arena, ++line_num, line, nread, &path_name, job->uid, job->gid);
 
         if(!hook) {
-            syslog(LOG_ERR, "Failed loading line at %d in %s", line_num, fileName);
+            syslog(LOG_ERR, "Failed loading line at %d in %s", line_num, job->name);
             continue;
         }
 
-        hook->pw_uid = uid;
-        hook->pw_gid = gid;
+        if(job->hook_cnt == job->hook_max) {
+            size_t max = job->hook_max ? job->hook_max * 2 : 8;
+            struct tab_parsed* hooks = realloc(job->hooks, max * sizeof(struct tab_parsed));
+
+            if(hooks == 0) {
+                syslog(LOG_ERR, "Failed loading line at %d in %s", line_num, job->name);
+                freeHook(hook);
+                continue;
+            }
+
+            job->hooks = hooks;
+            job->hook_max = max;
+        }
+
+        job->hooks[job->hook_cnt].hook = hook;
+        job->hooks[job->hook_cnt].path = path_name;
+        job->hook_cnt++;
     }
     free(line);
+    fclose(file);
 
     return 0;
 
@@ -327,46 +1048,307 @@ int loadTab(int dirfd, const char* fileName, uid_t uid, gid_t gid)
     return -1;
 }
 
-int loadSystemTabs(int dirfd)
+/** attach parsed hooks to incron_paths, caller thread only */
+static int commitTab(struct tab_job* job)
 {
-    int errsv = 0;
-    struct dirent* dentry = 0;
+    struct incron_tab* tab = findTab(job->type, job->name);
+    if(tab == 0) {
+        int errsv = errno;
+        freeParsed(job);
+        errno = errsv;
+        return -1;
+    }
 
-    DIR* dir = fdopendir(dirfd);
-    errsv = errno;
+    /** one copy shared by all hooks of tab */
+    char* name = arena_strdup(job->arena, job->name);
+    char* dir = job->dir ? arena_strdup(job->arena, job->dir) : 0;
 
-    if (dir == 0)
-        goto fail;
+    for(size_t i = 0; i < job->hook_cnt; i++) {
+        struct incron_hook* hook = job->hooks[i].hook;
+        const char* path_name = job->hooks[i].path;
 
-    while (1) {
-        errno = 0;
-        dentry = readdir(dir);
+        pathAddHook(findPath(path_name, strlen(path_name)), hook);
 
-        if(dentry == 0)
-        {
-            errsv = errno;
-            if(errsv == 0) break;
-            continue;
+        hook->pw_uid = job->uid;
+        hook->pw_gid = job->gid;
+        hook->tab = name;
+        hook->tab_type = job->type;
+        list_add_tail(&(hook->tab_list), &(tab->hooks));
+
+        /** resolved once here, so spawning needs no passwd lookup */
+        hook->pw_dir = dir;
+    }
+
+    /** hooks belong to their paths now */
+    job->hook_cnt = 0;
+    freeParsed(job);
+
+    return 0;
+}
+
+int loadTab(int dirfd, const char* fileName, enum incron_tab_type type, uid_t uid, gid_t gid, const char* dir)
+{
+    struct tab_job job = {
+        .name = fileName,
+        .type = type,
+        .uid = uid,
+        .gid = gid,
+    };
+
+    if(dir != 0 && (job.dir = strdup(dir)) == 0)
+        return -1;
+
+    if(parseTab(dirfd, &job) == -1) {
+        int errsv = errno;
+        freeParsed(&job);
+        errno = errsv;
+        return -1;
+    }
+
+    return commitTab(&job);
+}
+
+/** user is resolved with reentrant lookup, NSS may be slow but is safe to query from many threads */
+static int lookupUser(const char* name, uid_t* uid, gid_t* gid, char** dir)
+{
+    struct passwd pwd;
+    struct passwd* result = 0;
+    long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+    char* buf = 0;
+    int ret = 0;
+
+    if(size <= 0)
+        size = 16384;
+
+    while(1) {
+        char* tmp = realloc(buf, size);
+        if(tmp == 0) {
+            ret = ENOMEM;
+            break;
+        }
+
+        buf = tmp;
+        ret = getpwnam_r(name, &pwd, buf, size, &result);
+
+        if(ret != ERANGE)
+            break;
+
+        size *= 2;
+    }
+
+    if(ret == 0 && result != 0) {
+        *uid = pwd.pw_uid;
+        *gid = pwd.pw_gid;
+        *dir = strdup(pwd.pw_dir);
+
+        if(*dir == 0)
+            ret = ENOMEM;
+    }
+
+    free(buf);
+
+    if(ret == 0 && result == 0)
+        ret = ENOENT;
+
+    errno = ret;
+    return ret ? -1 : 0;
+}
+
+static int resolveUser(struct tab_job* job)
+{
+    return lookupUser(job->name, &job->uid, &job->gid, &job->dir);
+}
+
+/** users handed out one at a time, like tabs */
+struct user_pool {
+    struct tab_user* users;
+    size_t cnt;
+    size_t next;
+};
+
+static void* user_worker(void* arg)
+{
+    struct user_pool* pool = arg;
+
+    while(1) {
+        size_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if(i >= pool->cnt)
+            break;
+
+        struct tab_user* user = &pool->users[i];
+        user->ret = lookupUser(user->name, &user->uid, &user->gid, &user->dir);
+    }
+
+    return 0;
+}
+
+/** jobs handed out one at a time, tabs differ in size and lookup latency */
+struct tab_pool {
+    int dirfd;
+    struct tab_job* jobs;
+    size_t cnt;
+    size_t next;
+};
+
+static void* tab_worker(void* arg)
+{
+    struct tab_pool* pool = arg;
+
+    while(1) {
+        size_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if(i >= pool->cnt)
+            break;
+
+        struct tab_job* job = &pool->jobs[i];
+
+        if(job->type == TAB_USER) {
+            /* check if user is allowed to use incrond  */
+            if(!userAllowed(job->name)) {
+                syslog(LOG_INFO, "not loading %s user doesn't exists or isn't allowed", job->name);
+                continue;
+            }
+
+            if(resolveUser(job) == -1) {
+                syslog(LOG_INFO, "not loading %s user %s doesn't exists", job->name, job->name);
+                continue;
+            }
         }
 
-        loadTab(dirfd, dentry->d_name, getuid(), getgid());
+        job->ret = parseTab(pool->dirfd, job);
     }
 
-    closedir(dir);
+    return 0;
+}
+
+static unsigned load_thread_count(size_t cnt)
+{
+    long threads = load_threads;
+
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(threads <= 0)
+        threads = 1;
+
+    if((size_t)threads > cnt)
+        threads = cnt ? cnt : 1;
+
+    return threads;
+}
+
+/**
+* Tabs are parsed and users resolved by load_threads workers, hooks are
+* attached in names order by caller thread once all of them are done.
+* results[i] is 0 if names[i] was loaded, -1 otherwise.
+*/
+int loadTabFiles(int dirfd, enum incron_tab_type type, char** names, int* results, size_t cnt)
+{
+    struct tab_pool pool = {
+        .dirfd = dirfd,
+        .cnt = cnt,
+    };
+
+    pool.jobs = calloc(cnt ? cnt : 1, sizeof(struct tab_job));
+    if(pool.jobs == 0)
+        return -1;
+
+    for(size_t i = 0; i < cnt; i++) {
+        pool.jobs[i].name = names[i];
+        pool.jobs[i].type = type;
+        pool.jobs[i].uid = getuid();
+        pool.jobs[i].gid = getgid();
+        pool.jobs[i].ret = -1;
+    }
+
+    unsigned threads = load_thread_count(cnt);
+    pthread_t tids[threads];
+    unsigned started = 0;
+
+    for(unsigned i = 1; i < threads; i++) {
+        if(pthread_create(&tids[started], 0, tab_worker, &pool) != 0)
+            break;
+        started++;
+    }
+
+    tab_worker(&pool);
+
+    for(unsigned i = 0; i < started; i++)
+        pthread_join(tids[i], 0);
+
+    debug_printf_n("parsed %zu tabs with %u threads", cnt, started + 1);
+
+    /** single threaded commit */
+    for(size_t i = 0; i < cnt; i++) {
+        struct tab_job* job = &pool.jobs[i];
+
+        if(job->ret == 0)
+            job->ret = commitTab(job);
+        else
+            freeParsed(job);
+
+        if(results != 0)
+            results[i] = job->ret;
+    }
+
+    free(pool.jobs);
 
     return 0;
+}
 
-    fail:
-    errno = errsv;
-    return -1;
+/** users[i].ret is 0 and dir is allocated if users[i].name was found */
+void resolveUsers(struct tab_user* users, size_t cnt)
+{
+    struct user_pool pool = {
+        .users = users,
+        .cnt = cnt,
+    };
+
+    unsigned threads = load_thread_count(cnt);
+    pthread_t tids[threads];
+    unsigned started = 0;
+
+    for(size_t i = 0; i < cnt; i++) {
+        users[i].dir = 0;
+        users[i].ret = -1;
+    }
+
+    for(unsigned i = 1; i < threads; i++) {
+        if(pthread_create(&tids[started], 0, user_worker, &pool) != 0)
+            break;
+        started++;
+    }
+
+    user_worker(&pool);
+
+    for(unsigned i = 0; i < started; i++)
+        pthread_join(tids[i], 0);
 }
 
-int loadUserTabs(int dirfd)
+/** directory is read through its own fd, dirfd stays open for reloading tabs */
+static DIR* openTabDir(int dirfd)
+{
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1)
+        return 0;
+
+    DIR* dir = fdopendir(fd);
+    if(dir == 0) {
+        int errsv = errno;
+        close(fd);
+        errno = errsv;
+    }
+
+    return dir;
+}
+
+static int loadTabDir(int dirfd, enum incron_tab_type type)
 {
     int errsv = 0;
     struct dirent* dentry = 0;
+    char** names = 0;
+    size_t cnt = 0, max = 0;
 
-    DIR* dir = fdopendir(dirfd);
+    DIR* dir = openTabDir(dirfd);
     errsv = errno;
 
     if (dir == 0)
@@ -375,63 +1357,108 @@ int loadUserTabs(int dirfd)
     while (1) {
         errno = 0;
         dentry = readdir(dir);
-        errsv = errno;
 
         if(dentry == 0)
         {
+            errsv = errno;
             if(errsv == 0) break;
             continue;
         }
 
-        /* check if user is allowed to use incrond  */
-        bool allowed = userAllowed(dentry->d_name);
-
-        if(!allowed) {
-            syslog(LOG_INFO, "not loading %s user doesn't exists or isn't allowed", dentry->d_name);
+        /** ., .. and editor leftovers */
+        if(dentry->d_name[0] == '.')
             continue;
+
+        if(cnt == max) {
+            size_t new_max = max ? max * 2 : 64;
+            char** tmp = realloc(names, new_max * sizeof(char*));
+
+            if(tmp == 0) {
+                errsv = errno;
+                goto fail_names;
+            }
+
+            names = tmp;
+            max = new_max;
         }
 
-        struct passwd *pwd = getpwnam(dentry->d_name);
-        if(pwd == 0) {
-            syslog(LOG_INFO, "not loading %s user %s doesn't exists", dentry->d_name, dentry->d_name);
-            continue;
+        names[cnt] = strdup(dentry->d_name);
+        if(names[cnt] == 0) {
+            errsv = errno;
+            goto fail_names;
         }
 
-        loadTab(dirfd, dentry->d_name, pwd->pw_uid, pwd->pw_gid);
+        cnt++;
     }
 
     closedir(dir);
+    dir = 0;
+
+    if(loadTabFiles(dirfd, type, names, 0, cnt) == -1) {
+        errsv = errno;
+        goto fail_names;
+    }
+
+    for(size_t i = 0; i < cnt; i++)
+        free(names[i]);
+    free(names);
 
     return 0;
 
+    fail_names:
+    if(dir != 0)
+        closedir(dir);
+
+    for(size_t i = 0; i < cnt; i++)
+        free(names[i]);
+    free(names);
+
     fail:
     errno = errsv;
     return -1;
 }
 
-static void freeHook(struct incron_hook* hook)
+int loadSystemTabs(int dirfd)
 {
-    struct list_head *tmp = 0;
-    struct list_head *ag = 0;
+    return loadTabDir(dirfd, TAB_SYSTEM);
+}
 
-    list_for_each_safe(ag, tmp, &(hook->arg_list)) {
-        struct incron_hook_arg* arg = list_entry(ag, struct incron_hook_arg, list);
-        list_del(&(arg->list));
-        free(arg);
-    }
+int loadUserTabs(int dirfd)
+{
+    return loadTabDir(dirfd, TAB_USER);
+}
 
-    /* free argv */
-    for(int i = 0; i < hook->argc; i++)
-        free(hook->argv[i]);
+void freeHook(struct incron_hook* hook)
+{
+    struct incron_queued_event *q = 0, *qtmp = 0;
+
+    list_del(&(hook->tab_list));
+
+    /** index would keep pointing to it */
+    if(hook->path != 0)
+        pathIndexReset(hook->path);
+
+    list_for_each_entry_safe(q, qtmp, &(hook->queue), list) {
+        list_del(&(q->list));
+        free(q);
+    }
 
-    free(hook->argv);
-    free(hook);
+    /** hook, its argv and template live in tab arena */
+    arena_put(hook->arena);
 }
 
-static void freePath(struct incron_path* path)
+void freePath(struct incron_path* path)
 {
     struct list_head *tmp = 0;
     struct list_head *hk = 0;
+    struct incron_path *child = 0, *ctmp = 0;
+
+    HASH_ITER(hh, path->children, child, ctmp) {
+        HASH_DEL(path->children, child);
+        pathClearWatch(child);
+        free(child->path);
+        free(child);
+    }
 
     list_for_each_safe(hk, tmp, &(path->hook_list)) {
         struct incron_hook* hook = list_entry(hk, struct incron_hook, list);
@@ -439,6 +1466,13 @@ static void freePath(struct incron_path* path)
         freeHook(hook);
     }
 
+    pathClearWatch(path);
+    /** may still wait for rescan after overflow */
+    list_del_init(&(path->rescan));
+    list_del_init(&(path->settle));
+    snapshot_free(&(path->snapshot));
+    pathIndexReset(path);
+
     free(path->path);
     free(path);
 }
@@ -451,4 +1485,11 @@ void freeTabs()
         HASH_DEL(incron_paths, s);
         freePath(s);
     }
+
+    for(int type = 0; type < TAB_TYPE_MAX; type++) {
+        struct incron_tab *tab, *ttmp;
+
+        HASH_ITER(hh, incron_tabs[type], tab, ttmp)
+            freeTab(type, tab);
+    }
 }
@@ -3,8 +3,10 @@
 #ifndef __INCROND_PARSE_TABS_H__
 #define __INCROND_PARSE_TABS_H__
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/inotify.h>
 
@@ -12,9 +14,13 @@
 
 #include "list.h"
 #include "uthash.h"
+#include "incrond-snapshot.h"
 
 // incrond special modifiers
 #define IN_NO_LOOP (1U << 0)
+#define IN_RECURSIVE (1U << 1)
+#define IN_FANOTIFY (1U << 2)
+#define IN_STREAM (1U << 3)
 
 enum INCROD_TAB_ENUM {
     E_IN_ACCESS,
@@ -41,8 +47,11 @@ enum INCROD_TAB_ENUM {
     E_IN_MOVE,
     E_IN_ALL_EVENTS,
     E_IN_NO_LOOP,
-    INOTIFY_ENUM_MAX = E_IN_NO_LOOP,
-    INCROD_TAB_ENUM_MAX
+    E_IN_RECURSIVE,
+    E_IN_FANOTIFY,
+    E_IN_STREAM,
+    INCROD_TAB_ENUM_MAX,
+    INOTIFY_ENUM_MAX = E_IN_NO_LOOP
 };
 
 #define xstr(s) str(s)
@@ -58,6 +67,19 @@ struct incrond_hook_modifier
 
 extern struct incrond_hook_modifier incrond_hook_modifiers[];
 
+struct incron_hook;
+
+typedef int (*set_hook_option_func)(struct incron_hook*, const char* /*value*/, size_t /*length*/);
+
+/** modifiers with value i.e. IN_DELAY=500 */
+struct incrond_hook_option
+{
+    const char* name;
+    set_hook_option_func set_value;
+};
+
+extern struct incrond_hook_option incrond_hook_options[];
+
 #define MAX_TEXT_ARGS_STRLEN STRLEN(str(IN_ACCESS)) + STRLEN(str(IN_MODIFY)) + STRLEN(str(IN_ATTRIB)) + STRLEN(str(IN_CLOSE_WRITE)) + STRLEN(str(IN_CLOSE_NOWRITE)) + STRLEN(str(IN_CLOSE)) + STRLEN(str(IN_OPEN)) + STRLEN(str(IN_MOVED_FROM)) + STRLEN(str(IN_MOVED_TO)) + STRLEN(str(IN_MOVE)) + STRLEN(str(IN_CREATE)) + STRLEN(str(IN_DELETE)) + STRLEN(str(IN_DELETE_SELF)) + STRLEN(str(IN_MOVE_SELF)) + STRLEN(str(IN_UNMOUNT)) + STRLEN(str(E_IN_Q_OVERFLOW)) + STRLEN(str(E_IN_IGNORED)) + STRLEN(str(E_IN_ONLYDIR)) + STRLEN(str(E_IN_DONT_FOLLOW)) + STRLEN(str(E_IN_EXCL_UNLINK)) + STRLEN(str(E_IN_MASK_CREATE)) + STRLEN(str(E_IN_MASK_ADD)) + STRLEN(str(E_IN_ISDIR)) + STRLEN(str(E_IN_ONESHOT)) + STRLEN(str(E_IN_ALL_EVENTS))
 
 enum INCRON_TAB_ARG_ENUM {
@@ -66,59 +88,187 @@ enum INCRON_TAB_ARG_ENUM {
     TAB_ARG_EVENT_FILENAME,
     TAB_ARG_EVENT_TEXT,
     TAB_ARG_EVENT_NUM,
+    TAB_ARG_EVENT_TIME,
     TAB_ARG_MAX
 };
 
-struct incron_hook_arg {
-    enum INCRON_TAB_ARG_ENUM arg;
-    uint32_t index;
-    uint32_t pos;
-    char* argv;
-    struct list_head list;
+/** literal part of command argument followed by $ argument */
+struct incron_hook_seg {
+    uint32_t offset;            ///> literal start in template text
+    uint32_t len;               ///> literal length
+    uint8_t arg;                ///> INCRON_TAB_ARG_ENUM expanded after literal, TAB_ARG_MAX if none
+    uint8_t last;               ///> segment ends command argument
+};
+
+/** command compiled at load, expanded per event in a single pass */
+struct incron_hook_template {
+    char* text;                 ///> literal parts of all arguments
+    struct incron_hook_seg* segs; ///> segments of all arguments in order
+    uint32_t seg_cnt;           ///> number of segments
+    size_t literal_len;         ///> sum of literal lengths
+    uint32_t arg_cnt[TAB_ARG_MAX]; ///> occurrences of every $ argument
+    char** argv;                ///> exec argv, filled on every spawn
+};
+
+#define HOOK_INDEX_BITS 32
+
+/** hooks of path in hook_list order, with slots of hooks reacting to every event bit */
+struct incron_hook_index {
+    uint32_t hook_cnt;
+    uint32_t bit_off[HOOK_INDEX_BITS + 1]; ///> slots of bit b are slots[bit_off[b]] .. slots[bit_off[b + 1] - 1]
+    struct incron_hook** hooks; ///> hook of every slot, same allocation
+    uint32_t slots[];           ///> ascending slots per bit
 };
 
 struct incron_path {
     char* path;                 ///> path to watch
     uint32_t flags;             ///> current ordered flags (passed with inotify_add_watch)
+    uint32_t iflags;            ///> ORed special incrond flags of hooks
+    int ifd;                    ///> inotify instance watch belongs to, keyed together with wfd
     int wfd;                    ///> inotify watch fd
+    struct incron_path* wfd_next; ///> next path sharing the same watch fd
+    uint8_t fanotify;           ///> path is covered by fanotify mark instead of inotify watch
+
+    struct incron_snapshot_entry* snapshot; ///> directory listing for overflow recovery
+    uint32_t snapshot_gen;      ///> snapshot scan generation, 0 if no snapshot
+    struct list_head rescan;    ///> entry of directories waiting for rescan after overflow
+    struct list_head settle;    ///> entry of directories with recovered writes to settle
+
+    struct incron_path* root;   ///> tab path a recursive subdirectory watch belongs to
+    struct incron_path* children; ///> recursive subdirectory watches hashed by path
+
+    struct incron_hook_index* index; ///> built on first event after hooks changed
 
     UT_hash_handle hh;          ///> makes this structure hashable
+    UT_hash_handle hh_wfd;      ///> makes this structure hashable by watch fd
     struct list_head list;      ///>
     struct list_head hook_list; ///>
 };
 
 struct incron_path *incron_paths;
 
+struct incron_stream;
+struct incron_batch;
+struct incron_arena;
+
+/** what to do with event coming when hook queue is full */
+enum incron_overflow {
+    OVERFLOW_DROP_OLDEST = 0,   ///< oldest queued event is dropped
+    OVERFLOW_DROP_NEWEST,       ///< incoming event is dropped
+    OVERFLOW_COALESCE,          ///< incoming event is merged with queued one for the same file
+};
+
+/** default IN_QUEUE for hooks limited with IN_MAX_SPAWN */
+#define HOOK_QUEUE_DEFAULT 64
+
+/** default IN_BATCH_MS for IN_BATCH hooks */
+#define BATCH_MS_DEFAULT 1000
+
+/** event waiting for running hook instance to finish */
+struct incron_queued_event {
+    struct incron_path* path;   ///> path event happened in
+    uint32_t cross;             ///> ORed event masks
+    struct timespec time;       ///> latest event time
+    struct list_head list;      ///> hook queue
+    size_t name_len;
+    char name[];                ///> event file name
+};
+
 struct incron_hook {
-    char* command;              ///> path to executable with arguments
+    char* command;              ///> executable, /bin/bash unless hook is direct
     uint32_t flags;             ///> reaction flags
     uint32_t iflags;            ///> special incrond flags
     int8_t fired;               ///> hook was fired at least one time
+    uint32_t delay;             ///> quiet window in ms events are coalesced for before firing
 
-    uint8_t arg_list_size;      ///> size of proccessed argument list
     struct list_head list;      ///>
-    struct list_head arg_list;  ///> argument list
+    struct incron_hook_template tpl; ///> compiled command
 
     int argc;                   ///> parsed argument count
     char** argv;                ///> parsed argv list
+    uint8_t direct;             ///> argv is exec'ed as is, command is resolved at load
 
     uid_t pw_uid;               ///> user ID
     gid_t pw_gid;               ///> group ID
+    char* pw_dir;               ///> user home directory hook is started in, 0 for system tabs
+    char* tab;                  ///> name of tab file hook comes from, names its cgroup
+    uint8_t tab_type;           ///> enum incron_tab_type of that tab
+    struct incron_arena* arena; ///> memory of hook, its argv, template and strings
+    struct incron_path* path;   ///> tab path hook is attached to
+    struct list_head tab_list;  ///> hooks of the same tab
+
+    struct incron_stream* stream; ///> IN_STREAM process state, 0 until first event
+
+    uint32_t batch_max;         ///> IN_BATCH events launched at once, 0 - no batching
+    uint32_t batch_ms;          ///> ms batch is launched after its first event at most
+    struct incron_batch* batch; ///> IN_BATCH collected events, 0 until first event
+
+    uint32_t max_spawn;         ///> running instances allowed at once, 0 - unlimited
+    uint32_t running;           ///> instances currently running
+    uint32_t queue_max;         ///> events queued while max_spawn instances are running
+    uint32_t queue_len;         ///> events currently queued
+    uint8_t overflow;           ///> enum incron_overflow
+    struct list_head queue;     ///> struct incron_queued_event FIFO
+    uint32_t throttled_len;     ///> events waiting for spawn rate limit token, at most queue_max + 1
+    struct list_head throttled; ///> throttled events FIFO
+
+    uint32_t loop_grace;        ///> ms IN_NO_LOOP keeps suppressing events after last instance exits
+    uint64_t loop_until;        ///> CLOCK_MONOTONIC ms suppression ends at
+
+    unsigned long queued;       ///> events ever queued
+    unsigned long dropped;      ///> events dropped on overflow
+    unsigned long coalesced;    ///> events merged into queued ones
+    unsigned long suppressed;   ///> events ignored by IN_NO_LOOP
+};
+
+/** owner of user tab as passwd has it now */
+struct tab_user {
+    const char* name;           ///> user and tab file name
+    uid_t uid;
+    gid_t gid;
+    char* dir;                  ///> home directory, allocated by resolveUsers
+    int ret;                    ///> -1 if user wasn't found
 };
 
-struct incron_hook_single {
-    struct incron_hook hook;
-    pid_t spawned;              ///> pid of the spawned proccess hook
+/** tab file directories, tabs are reloaded per file */
+enum incron_tab_type {
+    TAB_SYSTEM = 0,             ///< system_table_dir, hooks run as daemon user
+    TAB_USER,                   ///< user_table_dir, file is named after user
+    TAB_TYPE_MAX
 };
 
-struct incron_hook_loopable {
-    struct incron_hook hook;
-    int8_t max_spawned;         ///> maximum allowed forks per hook
-    pid_t spawned[];            ///> array of pids spawned
+/** hooks loaded from one tab file */
+struct incron_tab {
+    char* name;                 ///> tab file name
+    struct list_head hooks;     ///> struct incron_hook linked by tab_list
+    UT_hash_handle hh;          ///> makes this structure hashable by name
 };
 
-int loadTab(int /*dirfd*/, const char* /*fileName*/, uid_t /*uid*/, gid_t /*gid*/);
+struct incron_tab *incron_tabs[TAB_TYPE_MAX];
+
+struct incron_path* findPath(const char* /*buffer*/, size_t /*len*/);
+struct incron_path* findPathByWatch(int /*ifd*/, int /*wfd*/);
+void pathSetWatch(struct incron_path* /*path*/, int /*ifd*/, int /*wfd*/);
+void pathClearWatch(struct incron_path* /*path*/);
+int pathAddHook(struct incron_path* /*path*/, struct incron_hook* /*hook*/);
+
+void pathUpdateFlags(struct incron_path* /*path*/);
+struct incron_hook_index* pathHookIndex(struct incron_path* /*path*/);
+void pathIndexReset(struct incron_path* /*path*/);
+void freePath(struct incron_path* /*path*/);
+
+bool hookEqual(const struct incron_hook* /*a*/, const struct incron_hook* /*b*/);
+struct incron_hook* hookCopy(struct incron_arena* /*arena*/, const struct incron_hook* /*hook*/);
+bool tabCanExec(const char* /*path*/, uid_t /*uid*/, gid_t /*gid*/);
+void freeHook(struct incron_hook* /*hook*/);
+
+struct incron_tab* findTab(enum incron_tab_type /*type*/, const char* /*name*/);
+void freeTab(enum incron_tab_type /*type*/, struct incron_tab* /*tab*/);
+
+int loadTab(int /*dirfd*/, const char* /*fileName*/, enum incron_tab_type /*type*/, uid_t /*uid*/, gid_t /*gid*/, const char* /*dir*/);
 struct incron_hook* loadTabLine(int /*line_num*/, char* /*line*/, size_t /*len*/);
+int loadTabFiles(int /*dirfd*/, enum incron_tab_type /*type*/, char** /*names*/, int* /*results*/, size_t /*cnt*/);
+void resolveUsers(struct tab_user* /*users*/, size_t /*cnt*/);
 int loadSystemTabs(int /*dirfd*/);
 int loadUserTabs(int /*dirfd*/);
 void freeTabs();
@@ -0,0 +1,218 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-ratelimit.c
+*
+* @brief Spawn rate limiting
+*
+* @par
+* Every spawn takes one token from daemon wide bucket (spawn_rate, spawn_burst)
+* and one from bucket of user hook runs as (user_spawn_rate, user_spawn_burst).
+* Buckets refill continuously at rate tokens per second up to burst. Hook is
+* admitted only if both buckets have a token, otherwise event waits in dispatch
+* throttle queue, time events were waiting is accounted per bucket.
+*/
+#include "incrond-ratelimit.h"
+
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "incrond-config.h"
+
+static struct incron_bucket global_bucket;
+static struct incron_bucket* user_buckets = 0;
+
+void bucket_init(struct incron_bucket* bucket, uint32_t rate, uint32_t burst, uint64_t now)
+{
+    bucket->rate = rate;
+    bucket->burst = burst ? burst : (rate ? rate : 1);
+    bucket->tokens = (uint64_t)bucket->burst * BUCKET_TOKEN;
+    bucket->updated = now;
+}
+
+/** @return 1 if bucket has a token */
+int bucket_ready(struct incron_bucket* bucket, uint64_t now)
+{
+    if(bucket->rate == 0)
+        return 1;
+
+    if(now > bucket->updated) {
+        uint64_t max = (uint64_t)bucket->burst * BUCKET_TOKEN;
+
+        bucket->tokens += (now - bucket->updated) * bucket->rate;
+        if(bucket->tokens > max)
+            bucket->tokens = max;
+
+        bucket->updated = now;
+    }
+
+    return bucket->tokens >= BUCKET_TOKEN;
+}
+
+/** @return 1 if token was taken */
+int bucket_take(struct incron_bucket* bucket, uint64_t now)
+{
+    if(!bucket_ready(bucket, now))
+        return 0;
+
+    if(bucket->rate != 0)
+        bucket->tokens -= BUCKET_TOKEN;
+
+    return 1;
+}
+
+/** @return ms until next token, bucket must be refilled by bucket_ready */
+uint64_t bucket_wait(const struct incron_bucket* bucket)
+{
+    if(bucket->rate == 0 || bucket->tokens >= BUCKET_TOKEN)
+        return 0;
+
+    return (BUCKET_TOKEN - bucket->tokens + bucket->rate - 1) / bucket->rate;
+}
+
+static struct incron_bucket* global(uint64_t now)
+{
+    if(global_bucket.updated == 0)
+        bucket_init(&global_bucket, spawn_rate, spawn_burst, now);
+
+    return &global_bucket;
+}
+
+/** @return user bucket, 0 if users aren't limited or it can't be allocated */
+static struct incron_bucket* user(uid_t uid, uint64_t now)
+{
+    struct incron_bucket* bucket = 0;
+
+    if(user_spawn_rate == 0)
+        return 0;
+
+    HASH_FIND(hh, user_buckets, &uid, sizeof(uid_t), bucket);
+
+    if(bucket == 0) {
+        bucket = calloc(1, sizeof(struct incron_bucket));
+        if(bucket == 0)
+            return 0;
+
+        bucket->uid = uid;
+        bucket_init(bucket, user_spawn_rate, user_spawn_burst, now);
+        HASH_ADD(hh, user_buckets, uid, sizeof(uid_t), bucket);
+    }
+
+    return bucket;
+}
+
+int ratelimit_enabled()
+{
+    return spawn_rate != 0 || user_spawn_rate != 0;
+}
+
+/** takes token from both buckets or from none */
+int ratelimit_admit(uid_t uid, uint64_t now)
+{
+    struct incron_bucket* g = global(now);
+    struct incron_bucket* u = user(uid, now);
+
+    if(!bucket_ready(g, now) || (u != 0 && !bucket_ready(u, now)))
+        return 0;
+
+    bucket_take(g, now);
+
+    if(u != 0)
+        bucket_take(u, now);
+
+    return 1;
+}
+
+uint64_t ratelimit_wait(uid_t uid, uint64_t now)
+{
+    struct incron_bucket* g = global(now);
+    struct incron_bucket* u = user(uid, now);
+
+    bucket_ready(g, now);
+    uint64_t wait = bucket_wait(g);
+
+    if(u != 0) {
+        bucket_ready(u, now);
+
+        if(bucket_wait(u) > wait)
+            wait = bucket_wait(u);
+    }
+
+    return wait;
+}
+
+/** @return 0 if nobody can be admitted at all */
+int ratelimit_global_ready(uint64_t now)
+{
+    return bucket_ready(global(now), now);
+}
+
+static void bucket_throttled(struct incron_bucket* bucket, uint64_t now)
+{
+    if(bucket->waiting++ == 0)
+        bucket->waiting_since = now;
+
+    bucket->throttled++;
+}
+
+static void bucket_released(struct incron_bucket* bucket, uint64_t now)
+{
+    if(bucket->waiting == 0)
+        return;
+
+    if(--bucket->waiting == 0)
+        bucket->throttled_ms += now - bucket->waiting_since;
+}
+
+void ratelimit_throttled(uid_t uid, uint64_t now)
+{
+    struct incron_bucket* u = user(uid, now);
+
+    bucket_throttled(global(now), now);
+
+    if(u != 0)
+        bucket_throttled(u, now);
+}
+
+void ratelimit_released(uid_t uid, uint64_t now)
+{
+    struct incron_bucket* u = user(uid, now);
+
+    bucket_released(global(now), now);
+
+    if(u != 0)
+        bucket_released(u, now);
+}
+
+static uint64_t bucket_throttled_ms(const struct incron_bucket* bucket, uint64_t now)
+{
+    return bucket->throttled_ms + (bucket->waiting ? now - bucket->waiting_since : 0);
+}
+
+void ratelimit_log_stats(uint64_t now)
+{
+    struct incron_bucket *bucket = 0, *tmp = 0;
+
+    if(global_bucket.throttled != 0)
+        syslog(LOG_INFO, "spawn rate limit : %lu events throttled for %lu ms",
+               global_bucket.throttled, (unsigned long)bucket_throttled_ms(&global_bucket, now));
+
+    HASH_ITER(hh, user_buckets, bucket, tmp) {
+        if(bucket->throttled == 0)
+            continue;
+
+        syslog(LOG_INFO, "user %d spawn rate limit : %lu events throttled for %lu ms",
+               bucket->uid, bucket->throttled, (unsigned long)bucket_throttled_ms(bucket, now));
+    }
+}
+
+void ratelimit_free()
+{
+    struct incron_bucket *bucket = 0, *tmp = 0;
+
+    HASH_ITER(hh, user_buckets, bucket, tmp) {
+        HASH_DEL(user_buckets, bucket);
+        free(bucket);
+    }
+
+    global_bucket.updated = 0;
+}
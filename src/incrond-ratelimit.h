@@ -0,0 +1,44 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_RATELIMIT_H__
+#define __INCROND_RATELIMIT_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "uthash.h"
+
+/** tokens are kept in thousandths, so ms * tokens/sec refills exactly */
+#define BUCKET_TOKEN 1000
+
+/** spawn admission token bucket */
+struct incron_bucket {
+    uid_t uid;                  ///> user bucket belongs to, unused for daemon wide one
+    uint32_t rate;              ///> tokens per second, 0 - unlimited
+    uint32_t burst;             ///> bucket capacity in tokens
+    uint64_t tokens;            ///> available tokens in BUCKET_TOKEN units
+    uint64_t updated;           ///> CLOCK_MONOTONIC ms tokens were refilled at, 0 - never
+
+    uint32_t waiting;           ///> throttled events waiting for token
+    uint64_t waiting_since;     ///> ms first of waiting events was throttled at
+    uint64_t throttled_ms;      ///> total ms events were waiting
+    unsigned long throttled;    ///> events ever throttled
+
+    UT_hash_handle hh;          ///> makes this structure hashable by uid
+};
+
+void bucket_init(struct incron_bucket* /*bucket*/, uint32_t /*rate*/, uint32_t /*burst*/, uint64_t /*now*/);
+int bucket_ready(struct incron_bucket* /*bucket*/, uint64_t /*now*/);
+int bucket_take(struct incron_bucket* /*bucket*/, uint64_t /*now*/);
+uint64_t bucket_wait(const struct incron_bucket* /*bucket*/);
+
+int ratelimit_enabled();
+int ratelimit_admit(uid_t /*uid*/, uint64_t /*now*/);
+uint64_t ratelimit_wait(uid_t /*uid*/, uint64_t /*now*/);
+int ratelimit_global_ready(uint64_t /*now*/);
+void ratelimit_throttled(uid_t /*uid*/, uint64_t /*now*/);
+void ratelimit_released(uid_t /*uid*/, uint64_t /*now*/);
+void ratelimit_log_stats(uint64_t /*now*/);
+void ratelimit_free();
+
+#endif
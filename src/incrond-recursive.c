@@ -0,0 +1,750 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-recursive.c
+*
+* @brief Recursive (whole subtree) watches
+*
+* @par
+* Subtrees of IN_RECURSIVE paths are crawled by a pool of workers, each
+* reading directories with large getdents64 batches and opening children
+* relative to the parent fd. Workers add inotify watches themselves, the
+* resulting (path, wd) pairs are merged into the root path by the main
+* thread once crawl is finished. Subdirectory watches dispatch to hooks of
+* their root with $@ expanded to the subdirectory itself.
+*
+* @par
+* Entries created in a new directory before its watch is added produce no
+* events, so directories reported by IN_CREATE are listed right after the
+* watch is in place and IN_CREATE is synthesized for everything found. An
+* entry created after the watch may thus be reported twice, which is
+* preferred over losing it. Regular files may still be written to, they get
+* IN_CLOSE_WRITE only if unchanged RECURSIVE_SETTLE_MS later and no real one
+* was seen meanwhile.
+*/
+#include "incrond-recursive.h"
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "incrond.h"
+#include "incrond-config.h"
+#include "incrond-parse-tabs.h"
+#include "incrond-dispatch.h"
+#include "incrond-timer.h"
+
+/** getdents64 batch */
+#define CRAWL_DENTS_SIZE    (64 * 1024)
+
+/** limit of directory fds held open by queued items */
+#define CRAWL_MAX_OPEN      256
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct crawl_item {
+    struct incron_path* root;
+    int ifd;                    ///> inotify instance of root
+    char* path;
+    int fd;                     ///> already opened directory or -1
+    int watch;                  ///> watch has to be added for directory
+    struct crawl_item* next;
+};
+
+struct crawl_result {
+    struct incron_path* root;
+    int ifd;
+    char* path;
+    int wd;
+    char* entries;              ///> packed type byte + name + '\0' records found right after watch was added
+    size_t entries_len;
+    struct crawl_result* next;
+};
+
+/** regular file found in new directory, waiting to settle */
+struct settle_entry {
+    struct list_head list;      ///> settle_list entry, oldest first
+    struct incron_path* child;  ///> subdirectory file was found in
+    uint64_t expires;           ///> CLOCK_MONOTONIC ms file is checked again at
+    uint64_t ino;               ///> inode number
+    uint64_t mtime;             ///> modification time in ns
+    uint64_t size;              ///> file size
+    char name[];                ///> entry name
+};
+
+static LIST_HEAD(settle_list);
+static struct incron_timer settle_timer;
+
+struct crawl_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    struct crawl_item* queue;   ///> LIFO keeps crawl depth first and queue short
+    struct crawl_result* results;
+    unsigned busy;              ///> workers processing an item
+    unsigned open_fds;          ///> fds held by queued items
+
+    int synthesize;             ///> record entries of new directories to synthesize events for
+    unsigned long dirs;         ///> directories crawled
+    unsigned long failed;       ///> watches failed to add
+};
+
+uint32_t recursive_watch_mask(const struct incron_path* path)
+{
+    if(!(path->iflags & IN_RECURSIVE))
+        return 0;
+
+    return RECURSIVE_WATCH_MASK;
+}
+
+static uint32_t child_watch_mask(const struct incron_path* root)
+{
+    return root->flags | RECURSIVE_WATCH_MASK | IN_ONLYDIR | IN_DONT_FOLLOW;
+}
+
+static struct crawl_item* crawl_item_new(struct incron_path* root, int ifd, char* path, int fd, int watch)
+{
+    struct crawl_item* item = malloc(sizeof(struct crawl_item));
+    if(item == 0)
+        return 0;
+
+    item->root = root;
+    item->ifd = ifd;
+    item->path = path;
+    item->fd = fd;
+    item->watch = watch;
+    item->next = 0;
+
+    return item;
+}
+
+static void crawl_dir(struct crawl_pool* pool, struct crawl_item* item,
+                      struct crawl_item** items, struct crawl_result** results)
+{
+    int fd = item->fd;
+    /** stays valid after ownership is passed to result */
+    const char* dir = item->path;
+    struct crawl_result* r = 0;
+
+    if(item->watch) {
+        /** directory may be a tab path too, its events have to stay */
+        int wd = inotify_add_watch(item->ifd, item->path, child_watch_mask(item->root) | IN_MASK_ADD);
+
+        if(wd == -1) {
+            __atomic_add_fetch(&pool->failed, 1, __ATOMIC_RELAXED);
+            debug_printf_n("adding watch for %s failed with %d:%s", item->path, errno, strerror(errno));
+        } else {
+            r = malloc(sizeof(struct crawl_result));
+
+            if(r != 0) {
+                r->root = item->root;
+                r->ifd = item->ifd;
+                r->path = item->path;
+                r->wd = wd;
+                r->entries = 0;
+                r->entries_len = 0;
+                r->next = *results;
+                *results = r;
+
+                /** path is owned by result now */
+                item->path = 0;
+            }
+        }
+    }
+
+    if(fd == -1)
+        fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if(fd == -1)
+        return;
+
+    size_t dir_len = strlen(dir);
+    char* buffer = malloc(CRAWL_DENTS_SIZE);
+    size_t entries_size = 0;
+
+    /** whatever is listed now may have been created before the watch existed */
+    int record = pool->synthesize && r != 0;
+
+    if(buffer == 0)
+        goto out;
+
+    __atomic_add_fetch(&pool->dirs, 1, __ATOMIC_RELAXED);
+
+    while(1) {
+        long len = syscall(SYS_getdents64, fd, buffer, CRAWL_DENTS_SIZE);
+
+        if(len <= 0)
+            break;
+
+        for(long pos = 0; pos < len;) {
+            struct linux_dirent64* d = (struct linux_dirent64*)(buffer + pos);
+            pos += d->d_reclen;
+
+            if(d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+                continue;
+
+            unsigned char type = d->d_type;
+
+            if(type == DT_UNKNOWN) {
+                struct stat st;
+                if(fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    continue;
+
+                /** same as filesystems with d_type report, symlinks, fifos and sockets aren't written files */
+                type = IFTODT(st.st_mode);
+            }
+
+            size_t name_len = strlen(d->d_name);
+
+            if(record && r->entries_len + name_len + 2 > entries_size) {
+                size_t size = entries_size ? entries_size * 2 : 256;
+
+                while(size < r->entries_len + name_len + 2)
+                    size *= 2;
+
+                char* entries = realloc(r->entries, size);
+                if(entries != 0) {
+                    r->entries = entries;
+                    entries_size = size;
+                }
+            }
+
+            if(record && r->entries_len + name_len + 2 <= entries_size) {
+                r->entries[r->entries_len] = type;
+                memcpy(r->entries + r->entries_len + 1, d->d_name, name_len + 1);
+                r->entries_len += name_len + 2;
+            }
+
+            if(type != DT_DIR)
+                continue;
+            char* path = malloc(dir_len + name_len + 2);
+            if(path == 0)
+                continue;
+
+            memcpy(path, dir, dir_len);
+            path[dir_len] = '/';
+            memcpy(path + dir_len + 1, d->d_name, name_len + 1);
+
+            /** open relative to parent while we have spare fds */
+            int child_fd = -1;
+            if(__atomic_add_fetch(&pool->open_fds, 1, __ATOMIC_RELAXED) <= CRAWL_MAX_OPEN)
+                child_fd = openat(fd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+            if(child_fd == -1)
+                __atomic_sub_fetch(&pool->open_fds, 1, __ATOMIC_RELAXED);
+
+            struct crawl_item* child = crawl_item_new(item->root, item->ifd, path, child_fd, 1);
+            if(child == 0) {
+                if(child_fd != -1) {
+                    close(child_fd);
+                    __atomic_sub_fetch(&pool->open_fds, 1, __ATOMIC_RELAXED);
+                }
+                free(path);
+                continue;
+            }
+
+            child->next = *items;
+            *items = child;
+        }
+    }
+
+    free(buffer);
+
+    out:
+    close(fd);
+}
+
+static void* crawl_worker(void* arg)
+{
+    struct crawl_pool* pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while(1) {
+        while(pool->queue == 0 && pool->busy > 0)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        if(pool->queue == 0)
+            break;
+
+        struct crawl_item* item = pool->queue;
+        pool->queue = item->next;
+        pool->busy++;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        if(item->fd != -1)
+            __atomic_sub_fetch(&pool->open_fds, 1, __ATOMIC_RELAXED);
+
+        struct crawl_item* items = 0;
+        struct crawl_result* results = 0;
+
+        crawl_dir(pool, item, &items, &results);
+
+        free(item->path);
+        free(item);
+
+        pthread_mutex_lock(&pool->lock);
+
+        int wake = items != 0;
+
+        while(items != 0) {
+            struct crawl_item* next = items->next;
+            items->next = pool->queue;
+            pool->queue = items;
+            items = next;
+        }
+
+        while(results != 0) {
+            struct crawl_result* next = results->next;
+            results->next = pool->results;
+            pool->results = results;
+            results = next;
+        }
+
+        pool->busy--;
+
+        if(wake || pool->busy == 0)
+            pthread_cond_broadcast(&pool->cond);
+    }
+
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+static struct incron_path* recursive_child_add(struct incron_path* root, char* path)
+{
+    struct incron_path* child = 0;
+
+    HASH_FIND_STR(root->children, path, child);
+    if(child != 0) {
+        free(path);
+        return child;
+    }
+
+    child = calloc(1, sizeof(struct incron_path));
+    if(child == 0) {
+        free(path);
+        return 0;
+    }
+
+    child->path = path;
+    child->flags = root->flags;
+    child->iflags = root->iflags;
+    child->ifd = -1;
+    child->wfd = -1;
+    child->root = root;
+
+    INIT_LIST_HEAD(&(child->list));
+    INIT_LIST_HEAD(&(child->hook_list));
+
+    HASH_ADD_KEYPTR(hh, root->children, child->path, strlen(child->path), child);
+
+    return child;
+}
+
+struct incron_path* recursive_child_get(struct incron_path* root, const char* path)
+{
+    char* dup = strdup(path);
+    if(dup == 0)
+        return 0;
+
+    return recursive_child_add(root, dup);
+}
+
+static void synthesize_event(struct incron_path* child, const char* name, uint32_t mask)
+{
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event* event = (struct inotify_event*)buffer;
+    size_t len = strlen(name);
+
+    event->wd = child->wfd;
+    event->mask = mask;
+    event->cookie = 0;
+    event->len = len + 1;
+    memcpy(event->name, name, len + 1);
+
+    dispatch_hooks(child, event);
+}
+
+static int settle_stat(struct incron_path* child, const char* name, struct stat* st)
+{
+    char path[PATH_MAX];
+
+    if(snprintf(path, sizeof(path), "%s/%s", child->path, name) >= (int)sizeof(path))
+        return -1;
+
+    return fstatat(AT_FDCWD, path, st, AT_SYMLINK_NOFOLLOW);
+}
+
+/** files left unchanged since they were found are taken as closed */
+static void settle_check(struct incron_timer* timer)
+{
+    uint64_t now = incron_timer_now();
+
+    (void)timer;
+
+    dispatch_stamp();
+
+    while(!list_empty(&settle_list)) {
+        struct settle_entry* e = list_first_entry(&settle_list, struct settle_entry, list);
+        struct stat st;
+
+        if(e->expires > now) {
+            incron_timer_arm_at(&settle_timer, e->expires);
+            break;
+        }
+
+        list_del(&(e->list));
+
+        /** still written to, real IN_CLOSE_WRITE is yet to come */
+        if(settle_stat(e->child, e->name, &st) == 0 && e->ino == st.st_ino &&
+           e->size == (uint64_t)st.st_size &&
+           e->mtime == (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec)
+            synthesize_event(e->child, e->name, IN_CLOSE_WRITE);
+
+        free(e);
+    }
+}
+
+static void settle_add(struct incron_path* child, const char* name)
+{
+    size_t len = strlen(name);
+    struct stat st;
+
+    if(settle_stat(child, name, &st) == -1 || !S_ISREG(st.st_mode))
+        return;
+
+    struct settle_entry* e = malloc(sizeof(struct settle_entry) + len + 1);
+    if(e == 0)
+        return;
+
+    e->child = child;
+    e->expires = incron_timer_now() + RECURSIVE_SETTLE_MS;
+    e->ino = st.st_ino;
+    e->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    e->size = st.st_size;
+    memcpy(e->name, name, len + 1);
+
+    list_add_tail(&(e->list), &settle_list);
+
+    if(settle_timer.func == 0)
+        incron_timer_setup(&settle_timer, settle_check);
+
+    if(!incron_timer_pending(&settle_timer))
+        incron_timer_arm_at(&settle_timer, e->expires);
+}
+
+/** real IN_CLOSE_WRITE seen or subdirectory gone, name 0 drops every file of child */
+static void settle_drop(struct incron_path* child, const char* name)
+{
+    struct list_head *pos, *tmp;
+
+    list_for_each_safe(pos, tmp, &settle_list) {
+        struct settle_entry* e = list_entry(pos, struct settle_entry, list);
+
+        if(e->child != child || (name != 0 && strcmp(e->name, name) != 0))
+            continue;
+
+        list_del(&(e->list));
+        free(e);
+    }
+}
+
+/** fire IN_CREATE for entries found in new directory, files get IN_CLOSE_WRITE once settled */
+static void synthesize_events(struct incron_path* child, const char* entries, size_t len)
+{
+    dispatch_stamp();
+
+    for(size_t pos = 0; pos < len;) {
+        unsigned char type = entries[pos];
+        const char* name = entries + pos + 1;
+
+        pos += strlen(name) + 2;
+
+        synthesize_event(child, name, IN_CREATE | (type == DT_DIR ? IN_ISDIR : 0));
+
+        if(type == DT_REG && (child->flags & IN_CLOSE_WRITE))
+            settle_add(child, name);
+    }
+}
+
+/** crawl queued items with given number of threads, 1 means caller thread */
+static unsigned long crawl(struct crawl_item* queue, unsigned threads, int synthesize)
+{
+    struct crawl_pool pool = {
+        .queue = queue,
+        .synthesize = synthesize,
+    };
+
+    pthread_mutex_init(&pool.lock, 0);
+    pthread_cond_init(&pool.cond, 0);
+
+    pthread_t tids[threads];
+    unsigned started = 0;
+
+    for(unsigned i = 1; i < threads; i++) {
+        if(pthread_create(&tids[started], 0, crawl_worker, &pool) != 0)
+            break;
+        started++;
+    }
+
+    crawl_worker(&pool);
+
+    for(unsigned i = 0; i < started; i++)
+        pthread_join(tids[i], 0);
+
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+
+    /** results are pushed to the front, restore discovery order so parents go first */
+    struct crawl_result* results = 0;
+
+    while(pool.results != 0) {
+        struct crawl_result* r = pool.results;
+        pool.results = r->next;
+        r->next = results;
+        results = r;
+    }
+
+    /** single threaded commit */
+    unsigned long added = 0;
+
+    while(results != 0) {
+        struct crawl_result* r = results;
+        results = r->next;
+
+        struct incron_path* child = recursive_child_add(r->root, r->path);
+        if(child != 0) {
+            pathSetWatch(child, r->ifd, r->wd);
+            added++;
+
+            if(r->entries_len)
+                synthesize_events(child, r->entries, r->entries_len);
+        }
+
+        free(r->entries);
+        free(r);
+    }
+
+    if(pool.failed)
+        syslog(LOG_ERR, "failed adding %lu recursive watches, check fs.inotify.max_user_watches", pool.failed);
+
+    debug_printf_n("crawled %lu directories with %u threads, %lu watches added", pool.dirs, started + 1, added);
+
+    return added;
+}
+
+static unsigned crawl_thread_count()
+{
+    long threads = crawl_threads;
+
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(threads <= 0)
+        threads = 1;
+
+    return threads;
+}
+
+/** root itself is already watched, crawl adds watches below it */
+static struct crawl_item* root_crawl_item(struct incron_path* root)
+{
+    char* path = strdup(root->path);
+    struct crawl_item* item = path ? crawl_item_new(root, root->ifd, path, -1, 0) : 0;
+
+    if(item == 0)
+        free(path);
+
+    return item;
+}
+
+int recursive_watch_roots()
+{
+    struct incron_path *p = 0;
+    struct crawl_item* queue = 0;
+
+    for(p = incron_paths; p != NULL; p = p->hh.next) {
+        if(!(p->iflags & IN_RECURSIVE) || p->wfd == -1)
+            continue;
+
+        struct crawl_item* item = root_crawl_item(p);
+        if(item == 0)
+            continue;
+
+        item->next = queue;
+        queue = item;
+    }
+
+    if(queue == 0)
+        return 0;
+
+    unsigned long added = crawl(queue, crawl_thread_count(), 0);
+
+    syslog(LOG_INFO, "added %lu recursive watches", added);
+
+    return 0;
+}
+
+/** root added or turned recursive by tab reload */
+int recursive_watch_root(struct incron_path* root)
+{
+    if(!(root->iflags & IN_RECURSIVE) || root->wfd == -1)
+        return 0;
+
+    struct crawl_item* item = root_crawl_item(root);
+    if(item == 0)
+        return -1;
+
+    unsigned long added = crawl(item, crawl_thread_count(), 0);
+
+    syslog(LOG_INFO, "added %lu recursive watches under %s", added, root->path);
+
+    return 0;
+}
+
+/** subdirectory may be tab path or child of another root too, its mask covers all of them */
+static uint32_t shared_watch_mask(int ifd, int wfd)
+{
+    uint32_t mask = IN_ONLYDIR | IN_DONT_FOLLOW;
+
+    for(struct incron_path* p = findPathByWatch(ifd, wfd); p != 0; p = p->wfd_next)
+        mask |= p->flags | snapshot_watch_mask(p) | recursive_watch_mask(p);
+
+    return mask;
+}
+
+/** root events changed, subdirectory watches follow */
+void recursive_update_root(struct incron_path* root)
+{
+    struct incron_path *child = 0, *tmp = 0;
+
+    HASH_ITER(hh, root->children, child, tmp) {
+        child->flags = root->flags;
+        child->iflags = root->iflags;
+    }
+
+    /** bits no longer used by anybody sharing the watch are dropped */
+    HASH_ITER(hh, root->children, child, tmp) {
+        if(child->wfd == -1)
+            continue;
+
+        if(inotify_add_watch(child->ifd, child->path, shared_watch_mask(child->ifd, child->wfd)) == -1)
+            syslog(LOG_WARNING, "updating watch for %s failed with %d:%s", child->path, errno, strerror(errno));
+    }
+}
+
+/** kernel still reports IN_IGNORED, it won't find the path anymore */
+static void recursive_unwatch(struct incron_path* child)
+{
+    int ifd = child->ifd;
+    int wfd = child->wfd;
+
+    recursive_forget(child);
+
+    /** shared watch stays for tab path or other subtree, extra events are filtered by their hooks */
+    if(wfd != -1 && findPathByWatch(ifd, wfd) == 0)
+        inotify_rm_watch(ifd, wfd);
+}
+
+/** root removed or no longer recursive */
+void recursive_unwatch_root(struct incron_path* root)
+{
+    struct incron_path *child = 0, *tmp = 0;
+
+    HASH_ITER(hh, root->children, child, tmp)
+        recursive_unwatch(child);
+}
+
+/** forget subdirectory dir of root and everything below it */
+void recursive_remove_subtree(struct incron_path* root, const char* dir)
+{
+    struct incron_path *child = 0, *tmp = 0;
+    size_t len = strlen(dir);
+
+    HASH_ITER(hh, root->children, child, tmp) {
+        if(strncmp(child->path, dir, len) != 0 || (child->path[len] != '\0' && child->path[len] != '/'))
+            continue;
+
+        recursive_unwatch(child);
+    }
+}
+
+void recursive_handle_event(int inotifyfd, struct incron_path* path, const struct inotify_event* event)
+{
+    struct incron_path* root = path->root ? path->root : path;
+
+    if(!(root->iflags & IN_RECURSIVE))
+        return;
+
+    if(path->root && (event->mask & IN_IGNORED)) {
+        recursive_forget(path);
+        return;
+    }
+
+    /** writer closed it on its own */
+    if(path->root && (event->mask & IN_CLOSE_WRITE) && event->len)
+        settle_drop(path, event->name);
+
+    if(!(event->mask & IN_ISDIR) || event->len == 0)
+        return;
+
+    size_t len = strlen(path->path) + strlen(event->name) + 2;
+    char* dir = malloc(len);
+    if(dir == 0)
+        return;
+
+    snprintf(dir, len, "%s/%s", path->path, event->name);
+
+    if(event->mask & IN_MOVED_FROM) {
+        recursive_remove_subtree(root, dir);
+        free(dir);
+        return;
+    }
+
+    if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        struct crawl_item* item = crawl_item_new(root, inotifyfd, dir, -1, 1);
+        if(item == 0) {
+            free(dir);
+            return;
+        }
+
+        /** entries of moved in directory aren't new, only created one may have missed events */
+        crawl(item, 1, !!(event->mask & IN_CREATE));
+        return;
+    }
+
+    free(dir);
+}
+
+void recursive_forget(struct incron_path* child)
+{
+    struct incron_path* root = child->root;
+
+    settle_drop(child, 0);
+    dispatch_path_removed(child);
+    pathClearWatch(child);
+
+    HASH_DEL(root->children, child);
+    free(child->path);
+    free(child);
+}
@@ -0,0 +1,28 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_RECURSIVE_H__
+#define __INCROND_RECURSIVE_H__
+
+#include <stdint.h>
+#include <sys/inotify.h>
+
+/** events needed to follow subtree changes */
+#define RECURSIVE_WATCH_MASK (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/** file found in new directory is taken as closed if still the same that much later */
+#define RECURSIVE_SETTLE_MS 100
+
+struct incron_path;
+struct inotify_event;
+
+uint32_t recursive_watch_mask(const struct incron_path* /*path*/);
+int recursive_watch_roots();
+int recursive_watch_root(struct incron_path* /*root*/);
+void recursive_update_root(struct incron_path* /*root*/);
+void recursive_unwatch_root(struct incron_path* /*root*/);
+void recursive_handle_event(int /*inotifyfd*/, struct incron_path* /*path*/, const struct inotify_event* /*event*/);
+void recursive_forget(struct incron_path* /*child*/);
+void recursive_remove_subtree(struct incron_path* /*root*/, const char* /*dir*/);
+struct incron_path* recursive_child_get(struct incron_path* /*root*/, const char* /*path*/);
+
+#endif
@@ -0,0 +1,596 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-reload.c
+*
+* @brief Reloading changed tabs
+*
+* @par
+* system_table_dir and user_table_dir are watched by daemon itself, tab
+* written, moved in or out or deleted is reparsed alone. Its new hooks are
+* compared with the live ones: hook which didn't change is kept with all of
+* its state (running instances, queue, batch, stream), changed or removed
+* hooks are dropped. Only paths whose hook set changed are touched, they
+* get their watch added, mask updated or watch removed, so reload costs
+* what changed, not what is loaded.
+*
+* @par
+* SIGHUP rereads allowed and denied users files and reloads every tab the
+* same way, which only parses tabs that didn't change.
+*/
+#include "incrond-reload.h"
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "incrond.h"
+#include "incrond-arena.h"
+#include "incrond-config.h"
+#include "incrond-dispatch.h"
+#include "incrond-fanotify.h"
+#include "incrond-recursive.h"
+#include "incrond-shards.h"
+#include "incrond-snapshot.h"
+#include "incrond-timer.h"
+
+/** tab waiting for RELOAD_DELAY_MS to pass */
+struct reload_pending {
+    UT_hash_handle hh;
+
+    size_t key_len;
+    char key[];                 ///> enum incron_tab_type | tab name
+};
+
+/** path touched by reload with its flags before it */
+struct reload_path {
+    struct incron_path* path;
+    uint32_t flags;
+    uint32_t iflags;
+    UT_hash_handle hh;          ///> hashed by path pointer
+};
+
+static int reload_fd = -1;
+static int reload_wd[TAB_TYPE_MAX] = { -1, -1 };
+static struct reload_pending* reload_pending = 0;
+static int reload_overflow = 0;
+static struct incron_timer reload_timer;
+
+static int tab_dirfd(enum incron_tab_type type)
+{
+    return type == TAB_SYSTEM ? system_table_dir_fd : user_table_dir_fd;
+}
+
+static int touch_path(struct reload_path** touched, struct incron_path* path)
+{
+    struct reload_path* rp = 0;
+
+    HASH_FIND_PTR(*touched, &path, rp);
+
+    if(rp != 0)
+        return 0;
+
+    rp = malloc(sizeof(struct reload_path));
+    if(rp == 0)
+        return -1;
+
+    rp->path = path;
+    rp->flags = path->flags;
+    rp->iflags = path->iflags;
+
+    HASH_ADD_PTR(*touched, path, rp);
+
+    return 0;
+}
+
+static uint32_t path_watch_mask(const struct incron_path* path)
+{
+    return path->flags | snapshot_watch_mask(path) | recursive_watch_mask(path);
+}
+
+/** hooks added by reload move to arena of their own, tab arena they were parsed
+ * into would otherwise stay pinned whole by them */
+static void compact_hooks(struct incron_tab* tab, struct incron_arena* parsed)
+{
+    struct incron_hook *hook = 0, *tmp = 0;
+    struct incron_arena* arena = arena_new();
+
+    if(arena == 0)
+        return;
+
+    list_for_each_entry_safe(hook, tmp, &(tab->hooks), tab_list) {
+        if(hook->arena != parsed)
+            continue;
+
+        struct incron_hook* copy = hookCopy(arena, hook);
+        if(copy == 0)
+            break;
+
+        /** copy takes place of hook on its path and in tab */
+        list_add(&(copy->list), &(hook->list));
+        list_del(&(hook->list));
+        list_add(&(copy->tab_list), &(hook->tab_list));
+
+        freeHook(hook);
+    }
+
+    arena_put(arena);
+}
+
+/** paths watching the same inode share watch, its mask covers all of them */
+static void path_rewatch(struct incron_path* path)
+{
+    uint32_t mask = 0;
+
+    for(struct incron_path* p = findPathByWatch(path->ifd, path->wfd); p != 0; p = p->wfd_next)
+        mask |= path_watch_mask(p);
+
+    int wd = inotify_add_watch(path->ifd, path->path, mask);
+
+    if(wd == -1) {
+        int errsv = errno;
+        syslog(LOG_ERR, "updating watch for %s failed with %d:%s", path->path, errsv, strerror(errsv));
+        return;
+    }
+
+    /** path now names another inode */
+    if(wd != path->wfd)
+        pathSetWatch(path, path->ifd, wd);
+}
+
+static void path_watch(struct incron_path* path)
+{
+    int errsv = 0;
+
+    if(path_uses_fanotify(path) && fanotify_add_path(path) == 0) {
+        syslog(LOG_INFO, "added fanotify mark for %s", path->path);
+    } else {
+        int inotifyfd = shard_for_path(path->path);
+        int wd = inotify_add_watch(inotifyfd, path->path, path_watch_mask(path));
+
+        if(wd == -1) {
+            errsv = errno;
+            syslog(LOG_ERR, "adding watch for %s failed with %d:%s", path->path, errsv, strerror(errsv));
+            return;
+        }
+
+        pathSetWatch(path, inotifyfd, wd);
+        syslog(LOG_INFO, "added watch for %s", path->path);
+
+        /** mask was replaced for paths naming the same inode */
+        if(findPathByWatch(inotifyfd, wd) != path || path->wfd_next != 0)
+            path_rewatch(path);
+
+        recursive_watch_root(path);
+    }
+
+    if(snapshot_build(path) == -1) {
+        errsv = errno;
+        syslog(LOG_WARNING, "snapshot of %s failed with %d:%s", path->path, errsv, strerror(errsv));
+    }
+}
+
+static void path_unwatch(struct incron_path* path)
+{
+    int ifd = path->ifd;
+    int wfd = path->wfd;
+
+    recursive_unwatch_root(path);
+    dispatch_path_removed(path);
+
+    if(path->fanotify) {
+        fanotify_forget(path);
+        return;
+    }
+
+    if(wfd == -1)
+        return;
+
+    pathClearWatch(path);
+
+    /** shared watch stays for the rest, extra events are filtered by their hooks */
+    if(findPathByWatch(ifd, wfd) == 0)
+        inotify_rm_watch(ifd, wfd);
+}
+
+static void path_apply(struct reload_path* rp)
+{
+    struct incron_path* path = rp->path;
+
+    pathUpdateFlags(path);
+
+    if(list_empty(&(path->hook_list))) {
+        path_unwatch(path);
+        syslog(LOG_INFO, "removed watch for %s", path->path);
+
+        HASH_DEL(incron_paths, path);
+        freePath(path);
+        return;
+    }
+
+    /** new path, or one which failed to be watched before */
+    if(path->wfd == -1 && !path->fanotify) {
+        path_watch(path);
+        return;
+    }
+
+    if(path->flags == rp->flags && path->iflags == rp->iflags)
+        return;
+
+    /** backend of watched path isn't switched by reload */
+    if(path->fanotify) {
+        if(fanotify_update_path(path) == -1)
+            syslog(LOG_ERR, "updating fanotify mark for %s failed with %d:%s", path->path, errno, strerror(errno));
+    } else
+        path_rewatch(path);
+
+    if((path->iflags & IN_RECURSIVE) && !(rp->iflags & IN_RECURSIVE))
+        recursive_watch_root(path);
+    else if(!(path->iflags & IN_RECURSIVE) && (rp->iflags & IN_RECURSIVE))
+        recursive_unwatch_root(path);
+    else if(path->flags != rp->flags)
+        recursive_update_root(path);
+
+    if(snapshot_watch_mask(path) && path->snapshot_gen == 0 && snapshot_build(path) == -1)
+        syslog(LOG_WARNING, "snapshot of %s failed with %d:%s", path->path, errno, strerror(errno));
+
+    syslog(LOG_INFO, "updated watch for %s", path->path);
+}
+
+static struct incron_hook* take_equal(struct list_head* old, const struct incron_hook* hook)
+{
+    struct incron_hook* o = 0;
+
+    list_for_each_entry(o, old, tab_list) {
+        if(hookEqual(o, hook))
+            return o;
+    }
+
+    return 0;
+}
+
+/** @return 1 if tab file should be loaded, user tab also gets its user */
+static int tab_present(enum incron_tab_type type, const char* name, struct passwd** pwd)
+{
+    struct stat st;
+    int dirfd = tab_dirfd(type);
+
+    *pwd = 0;
+
+    if(dirfd == -1 || name[0] == '.')
+        return 0;
+
+    if(fstatat(dirfd, name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+        return 0;
+
+    if(type == TAB_SYSTEM)
+        return 1;
+
+    if(!userAllowed(name)) {
+        syslog(LOG_INFO, "not loading %s user doesn't exists or isn't allowed", name);
+        return 0;
+    }
+
+    *pwd = getpwnam(name);
+
+    return *pwd != 0;
+}
+
+int reload_tab(enum incron_tab_type type, const char* tab_name)
+{
+    /** name may belong to tab freed below */
+    char name[strlen(tab_name) + 1];
+    struct incron_tab* tab = 0;
+    struct incron_hook *hook = 0, *tmp = 0;
+    struct reload_path *touched = 0, *rp = 0, *rtmp = 0;
+    struct passwd* pwd = 0;
+    unsigned kept = 0, added = 0, removed = 0;
+    int errsv = 0;
+    LIST_HEAD(old);
+
+    strcpy(name, tab_name);
+
+    HASH_FIND_STR(incron_tabs[type], name, tab);
+
+    /** old hooks are detached from their paths, tab is loaded anew */
+    if(tab != 0) {
+        list_for_each_entry_safe(hook, tmp, &(tab->hooks), tab_list) {
+            if(touch_path(&touched, hook->path) == -1) {
+                errsv = errno;
+                goto fail;
+            }
+
+            list_del(&(hook->list));
+            list_move_tail(&(hook->tab_list), &old);
+            pathIndexReset(hook->path);
+        }
+    }
+
+    if(tab_present(type, name, &pwd)) {
+        if(type == TAB_SYSTEM)
+            loadTab(tab_dirfd(type), name, type, getuid(), getgid(), 0);
+        else
+            loadTab(tab_dirfd(type), name, type, pwd->pw_uid, pwd->pw_gid, pwd->pw_dir);
+    }
+
+    HASH_FIND_STR(incron_tabs[type], name, tab);
+
+    if(tab != 0) {
+        /** hooks there now all come from one parse */
+        struct incron_arena* parsed = 0;
+
+        list_for_each_entry(hook, &(tab->hooks), tab_list) {
+            list_del(&(hook->list));
+            parsed = hook->arena;
+        }
+
+        /** paths tab didn't use so far had their flags without its new hooks */
+        list_for_each_entry(hook, &(tab->hooks), tab_list) {
+            struct incron_path* path = hook->path;
+
+            HASH_FIND_PTR(touched, &path, rp);
+            if(rp != 0)
+                continue;
+
+            pathUpdateFlags(path);
+
+            if(touch_path(&touched, path) == -1)
+                syslog(LOG_ERR, "reloading %s : watch of %s may be stale", name, path->path);
+        }
+
+        /** unchanged hooks take the place of their new copies */
+        list_for_each_entry_safe(hook, tmp, &(tab->hooks), tab_list) {
+            struct incron_hook* same = take_equal(&old, hook);
+
+            if(same == 0) {
+                list_add_tail(&(hook->list), &(hook->path->hook_list));
+                added++;
+                continue;
+            }
+
+            list_add_tail(&(same->list), &(same->path->hook_list));
+
+            list_move(&(same->tab_list), &(hook->tab_list));
+            list_del_init(&(hook->tab_list));
+
+            freeHook(hook);
+            kept++;
+        }
+
+        if(kept != 0 && added != 0)
+            compact_hooks(tab, parsed);
+
+        if(list_empty(&(tab->hooks)))
+            freeTab(type, tab);
+    }
+
+    /** whatever is left was changed or removed */
+    list_for_each_entry_safe(hook, tmp, &old, tab_list) {
+        dispatch_hook_removed(hook);
+        freeHook(hook);
+        removed++;
+    }
+
+    HASH_ITER(hh, touched, rp, rtmp) {
+        path_apply(rp);
+
+        HASH_DEL(touched, rp);
+        free(rp);
+    }
+
+    if(added != 0 || removed != 0)
+        syslog(LOG_NOTICE, "reloaded tab %s : %u hooks kept, %u added, %u removed", name, kept, added, removed);
+
+    return 0;
+
+    fail:
+    /** nothing is reloaded, old hooks go back */
+    list_for_each_entry_safe(hook, tmp, &old, tab_list) {
+        list_add_tail(&(hook->list), &(hook->path->hook_list));
+        list_move_tail(&(hook->tab_list), &(tab->hooks));
+        pathIndexReset(hook->path);
+    }
+
+    HASH_ITER(hh, touched, rp, rtmp) {
+        HASH_DEL(touched, rp);
+        free(rp);
+    }
+
+    syslog(LOG_ERR, "reloading tab %s failed with %d:%s", name, errsv, strerror(errsv));
+
+    errno = errsv;
+    return -1;
+}
+
+static void reload_dir(enum incron_tab_type type)
+{
+    struct incron_tab *tab = 0, *tmp = 0;
+    struct dirent* dentry = 0;
+    struct stat st;
+    int dirfd = tab_dirfd(type);
+
+    if(dirfd == -1)
+        return;
+
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = fd != -1 ? fdopendir(fd) : 0;
+
+    if(dir == 0) {
+        syslog(LOG_ERR, "reading tab directory failed with %d:%s", errno, strerror(errno));
+
+        if(fd != -1)
+            close(fd);
+        return;
+    }
+
+    while((dentry = readdir(dir)) != 0) {
+        if(dentry->d_name[0] == '.')
+            continue;
+
+        reload_tab(type, dentry->d_name);
+    }
+
+    closedir(dir);
+
+    /** tabs removed meanwhile */
+    HASH_ITER(hh, incron_tabs[type], tab, tmp) {
+        if(fstatat(dirfd, tab->name, &st, 0) == -1 && errno == ENOENT)
+            reload_tab(type, tab->name);
+    }
+}
+
+void reload_all()
+{
+    syslog(LOG_NOTICE, "reloading all tabs");
+
+    freeUsers();
+    loadUsers();
+
+    for(int type = 0; type < TAB_TYPE_MAX; type++)
+        reload_dir(type);
+}
+
+static void fire_reload(struct incron_timer* timer)
+{
+    struct reload_pending *p = 0, *tmp = 0;
+
+    (void)timer;
+
+    HASH_ITER(hh, reload_pending, p, tmp) {
+        HASH_DEL(reload_pending, p);
+
+        if(!reload_overflow)
+            reload_tab(p->key[0], p->key + 1);
+
+        free(p);
+    }
+
+    /** names are lost, everything is compared */
+    if(reload_overflow) {
+        reload_overflow = 0;
+
+        for(int type = 0; type < TAB_TYPE_MAX; type++)
+            reload_dir(type);
+    }
+}
+
+static void reload_queue(enum incron_tab_type type, const char* name)
+{
+    struct reload_pending* p = 0;
+    size_t key_len = strlen(name) + 2;
+    char key[key_len];
+
+    key[0] = type;
+    memcpy(key + 1, name, key_len - 1);
+
+    HASH_FIND(hh, reload_pending, key, key_len, p);
+
+    if(p == 0) {
+        p = malloc(sizeof(struct reload_pending) + key_len);
+        if(p == 0) {
+            reload_overflow = 1;
+            goto arm;
+        }
+
+        p->key_len = key_len;
+        memcpy(p->key, key, key_len);
+
+        HASH_ADD(hh, reload_pending, key, key_len, p);
+    }
+
+    arm:
+    /** rearmed, so tab is read once it is quiet */
+    incron_timer_arm(&reload_timer, RELOAD_DELAY_MS);
+}
+
+int reload_init()
+{
+    const char* dirs[TAB_TYPE_MAX] = { system_table_dir, user_table_dir };
+    int errsv = 0;
+
+    reload_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(reload_fd == -1) {
+        errsv = errno;
+        syslog(LOG_ERR, "inotify_init1 for tab directories failed with %d:%s, tabs aren't reloaded", errsv, strerror(errsv));
+        goto fail;
+    }
+
+    incron_timer_setup(&reload_timer, fire_reload);
+
+    for(int type = 0; type < TAB_TYPE_MAX; type++) {
+        if(dirs[type] == 0 || tab_dirfd(type) == -1)
+            continue;
+
+        reload_wd[type] = inotify_add_watch(reload_fd, dirs[type], RELOAD_WATCH_MASK);
+
+        if(reload_wd[type] == -1)
+            syslog(LOG_ERR, "watching tab directory %s failed with %d:%s, its tabs are reloaded on SIGHUP only",
+                   dirs[type], errno, strerror(errno));
+    }
+
+    return reload_fd;
+
+    fail:
+    errno = errsv;
+    return -1;
+}
+
+int handle_reload_events(int reloadfd)
+{
+    char buffer[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while((len = read(reloadfd, buffer, sizeof(buffer))) > 0) {
+        for(char* ptr = buffer; ptr < buffer + len;) {
+            const struct inotify_event* event = (const struct inotify_event*)ptr;
+
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if(event->mask & IN_Q_OVERFLOW) {
+                reload_overflow = 1;
+                incron_timer_arm(&reload_timer, RELOAD_DELAY_MS);
+                continue;
+            }
+
+            if(event->len == 0 || event->name[0] == '.')
+                continue;
+
+            for(int type = 0; type < TAB_TYPE_MAX; type++) {
+                if(event->wd == reload_wd[type])
+                    reload_queue(type, event->name);
+            }
+        }
+    }
+
+    if(len == -1 && errno != EAGAIN) {
+        syslog(LOG_ERR, "reading tab directory events failed with %d:%s", errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void reload_stop()
+{
+    struct reload_pending *p = 0, *tmp = 0;
+
+    if(reload_fd == -1)
+        return;
+
+    incron_timer_cancel(&reload_timer);
+
+    HASH_ITER(hh, reload_pending, p, tmp) {
+        HASH_DEL(reload_pending, p);
+        free(p);
+    }
+
+    close(reload_fd);
+    reload_fd = -1;
+}
@@ -0,0 +1,22 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_RELOAD_H__
+#define __INCROND_RELOAD_H__
+
+#include <sys/inotify.h>
+
+#include "incrond-parse-tabs.h"
+
+/** tab directory changes a tab is reloaded on */
+#define RELOAD_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR)
+
+/** editors write and rename in several steps, tab is reloaded once they are done */
+#define RELOAD_DELAY_MS 200
+
+int reload_init();
+int handle_reload_events(int /*reloadfd*/);
+int reload_tab(enum incron_tab_type /*type*/, const char* /*name*/);
+void reload_all();
+void reload_stop();
+
+#endif
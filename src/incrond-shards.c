@@ -0,0 +1,313 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-shards.c
+*
+* @brief Multiple inotify instances drained by reader threads
+*
+* @par
+* Paths are partitioned between inotify_instances instances by path hash,
+* recursive subdirectories follow their root. With more than one instance
+* every instance gets a reader thread keeping its kernel queue drained,
+* read batches are passed to the main thread through a queue and an eventfd
+* and dispatched there, so path tables and hook state stay single threaded.
+* With a single instance the fd is handled by main loop directly.
+*/
+#include "incrond-shards.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+
+#include "incrond.h"
+#include "incrond-config.h"
+#include "incrond-dispatch.h"
+
+struct shard_batch {
+    int fd;                     ///> inotify instance batch was read from
+    size_t len;
+    struct timespec time;       ///> wall clock time batch was read at
+    struct shard_batch* next;
+    char data[] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+};
+
+struct shard {
+    int fd;                     ///> inotify instance
+    pthread_t thread;
+    int running;
+};
+
+static struct shard* shards = 0;
+static unsigned shards_cnt = 0;
+
+static int batch_fd = -1;       ///> eventfd signalling queued batches to main loop
+static int stop_fd = -1;        ///> eventfd stopping readers
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct shard_batch* queue_head = 0;
+static struct shard_batch** queue_tail = &queue_head;
+static size_t queue_bytes = 0;
+static int stopping = 0;
+
+int shards_init(unsigned count)
+{
+    int errsv = 0;
+
+    if(count == 0)
+        count = 1;
+
+    shards = calloc(count, sizeof(struct shard));
+    if(shards == 0)
+        return -1;
+
+    for(shards_cnt = 0; shards_cnt < count; shards_cnt++) {
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if(fd == -1) {
+            errsv = errno;
+            goto fail;
+        }
+
+        shards[shards_cnt].fd = fd;
+    }
+
+    return 0;
+
+    fail:
+    while(shards_cnt > 0)
+        close(shards[--shards_cnt].fd);
+
+    free(shards);
+    shards = 0;
+
+    errno = errsv;
+    return -1;
+}
+
+unsigned shards_count()
+{
+    return shards_cnt;
+}
+
+int shard_fd(unsigned shard)
+{
+    return shards[shard].fd;
+}
+
+int shard_for_path(const char* path)
+{
+    /** FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    for(const unsigned char* c = (const unsigned char*)path; *c; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+
+    return shards[hash % shards_cnt].fd;
+}
+
+static void queue_push(struct shard_batch* batch)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&queue_lock);
+
+    while(queue_bytes > SHARDS_QUEUE_MAX && !stopping)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+
+    batch->next = 0;
+    *queue_tail = batch;
+    queue_tail = &batch->next;
+    queue_bytes += batch->len;
+
+    pthread_mutex_unlock(&queue_lock);
+
+    if(write(batch_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        syslog(LOG_ERR, "signalling inotify batch failed with %d:%s", errno, strerror(errno));
+}
+
+static void* shard_reader(void* arg)
+{
+    struct shard* shard = arg;
+    size_t read_max = inotify_read_max < INOTIFY_READ_MIN ? INOTIFY_READ_MIN : inotify_read_max;
+
+    struct pollfd fds[2] = {
+        { .fd = shard->fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+
+    while(1) {
+        if(poll(fds, 2, -1) == -1) {
+            if(errno == EINTR)
+                continue;
+
+            syslog(LOG_CRIT, "inotify reader poll failed with %d:%s", errno, strerror(errno));
+            break;
+        }
+
+        if(fds[1].revents)
+            break;
+
+        while(1) {
+            int pending = 0;
+            size_t size = INOTIFY_READ_MIN;
+
+            if(ioctl(shard->fd, FIONREAD, &pending) == 0 && (size_t)pending > size)
+                size = pending;
+
+            if(size > read_max)
+                size = read_max;
+
+            struct shard_batch* batch = malloc(sizeof(struct shard_batch) + size);
+            if(batch == 0)
+                break;
+
+            ssize_t len = read(shard->fd, batch->data, size);
+
+            if(len <= 0) {
+                free(batch);
+                break;
+            }
+
+            batch->fd = shard->fd;
+            batch->len = len;
+            clock_gettime(CLOCK_REALTIME, &(batch->time));
+
+            queue_push(batch);
+        }
+    }
+
+    return 0;
+}
+
+static void shards_join()
+{
+    uint64_t one = 1;
+
+    if(stop_fd == -1)
+        return;
+
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    if(write(stop_fd, &one, sizeof(one)) == -1)
+        syslog(LOG_ERR, "stopping inotify readers failed with %d:%s", errno, strerror(errno));
+
+    for(unsigned i = 0; i < shards_cnt; i++) {
+        if(shards[i].running)
+            pthread_join(shards[i].thread, 0);
+
+        shards[i].running = 0;
+    }
+
+    while(queue_head != 0) {
+        struct shard_batch* next = queue_head->next;
+        free(queue_head);
+        queue_head = next;
+    }
+
+    queue_tail = &queue_head;
+    queue_bytes = 0;
+
+    close(stop_fd);
+    close(batch_fd);
+    stop_fd = batch_fd = -1;
+}
+
+int shards_start()
+{
+    int errsv = 0;
+
+    if(shards_cnt < 2) {
+        errno = 0;
+        return -1;
+    }
+
+    batch_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(batch_fd == -1)
+        return -1;
+
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(stop_fd == -1) {
+        errsv = errno;
+        goto fail_close_batch_fd;
+    }
+
+    for(unsigned i = 0; i < shards_cnt; i++) {
+        errsv = pthread_create(&shards[i].thread, 0, shard_reader, &shards[i]);
+
+        if(errsv != 0) {
+            shards_join();
+            errno = errsv;
+            return -1;
+        }
+
+        shards[i].running = 1;
+    }
+
+    syslog(LOG_INFO, "started %u inotify reader threads", shards_cnt);
+
+    return batch_fd;
+
+    fail_close_batch_fd:
+    close(batch_fd);
+    batch_fd = -1;
+
+    errno = errsv;
+    return -1;
+}
+
+int handle_shard_batches()
+{
+    uint64_t cnt;
+
+    if(read(batch_fd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN)
+        return -1;
+
+    pthread_mutex_lock(&queue_lock);
+
+    struct shard_batch* batch = queue_head;
+    queue_head = 0;
+    queue_tail = &queue_head;
+    queue_bytes = 0;
+
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    while(batch != 0) {
+        struct shard_batch* next = batch->next;
+
+        dispatch_time = batch->time;
+        handle_event_buffer(batch->fd, batch->data, batch->len);
+        free(batch);
+
+        batch = next;
+    }
+
+    return 0;
+}
+
+void shards_stop()
+{
+    shards_join();
+
+    for(unsigned i = 0; i < shards_cnt; i++)
+        close(shards[i].fd);
+
+    free(shards);
+    shards = 0;
+    shards_cnt = 0;
+}
@@ -0,0 +1,18 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_SHARDS_H__
+#define __INCROND_SHARDS_H__
+
+/** limit of read but not yet dispatched bytes, readers wait above it */
+#define SHARDS_QUEUE_MAX (64 * 1024 * 1024)
+
+int shards_init(unsigned /*count*/);
+unsigned shards_count();
+int shard_fd(unsigned /*shard*/);
+int shard_for_path(const char* /*path*/);
+
+int shards_start();
+int handle_shard_batches();
+void shards_stop();
+
+#endif
@@ -0,0 +1,356 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-snapshot.c
+*
+* @brief Directory snapshots used to recover events lost on IN_Q_OVERFLOW
+*
+* @par
+* Every watched directory with hooks on recoverable events keeps a listing
+* of (name, inode, mtime, size) built when the watch is added and updated
+* from regular events. Once kernel queue overflows all such directories are
+* scanned again, SNAPSHOT_RESCAN_BATCH per timer tick, and the difference is
+* dispatched as synthesized events. Recovered writes are not known to be
+* finished, IN_CLOSE_WRITE follows only if file stays the same for
+* SNAPSHOT_SETTLE_MS after rescan and no real one came meanwhile.
+*/
+#include "incrond-snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <sys/stat.h>
+
+#include <linux/limits.h>
+
+#include "incrond.h"
+#include "incrond-config.h"
+#include "incrond-parse-tabs.h"
+#include "incrond-dispatch.h"
+#include "incrond-timer.h"
+
+/** directories waiting for rescan after overflow */
+static LIST_HEAD(rescan_list);
+static struct incron_timer rescan_timer;
+static int rescan_done;
+
+/** directories with recovered writes waiting to settle */
+static LIST_HEAD(settle_list);
+static struct incron_timer settle_timer;
+
+uint32_t snapshot_watch_mask(const struct incron_path* path)
+{
+    /** recursive subdirectories have no snapshot */
+    if(!overflow_rescan || path->root != 0 || !(path->flags & SNAPSHOT_EVENTS))
+        return 0;
+
+    return SNAPSHOT_WATCH_MASK;
+}
+
+static void snapshot_fill(struct incron_snapshot_entry* e, const struct stat* st)
+{
+    e->ino = st->st_ino;
+    e->mtime = (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+    e->size = st->st_size;
+    e->isdir = S_ISDIR(st->st_mode);
+}
+
+static struct incron_snapshot_entry* snapshot_add(struct incron_path* path, const char* name)
+{
+    size_t len = strlen(name);
+    struct incron_snapshot_entry* e = malloc(sizeof(struct incron_snapshot_entry) + len + 1);
+
+    if(e == 0)
+        return 0;
+
+    memcpy(e->name, name, len + 1);
+    e->settle = 0;
+    HASH_ADD_KEYPTR(hh, path->snapshot, e->name, len, e);
+
+    return e;
+}
+
+static void snapshot_dispatch(struct incron_path* path, const char* name, uint32_t mask)
+{
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event* event = (struct inotify_event*)buffer;
+    size_t len = strlen(name);
+
+    event->wd = path->wfd;
+    event->mask = mask;
+    event->cookie = 0;
+    event->len = len + 1;
+    memcpy(event->name, name, len + 1);
+
+    debug_printf_n("recovered %s for %s/%s", print_text_events(mask), path->path, name);
+
+    dispatch_hooks(path, event);
+}
+
+/** scan directory, with synthesize set differences are dispatched */
+static int snapshot_scan(struct incron_path* path, int synthesize)
+{
+    int errsv = 0;
+    struct dirent* dentry = 0;
+    struct incron_snapshot_entry *e, *tmp;
+
+    DIR* dir = opendir(path->path);
+    if(dir == 0) {
+        errsv = errno;
+        goto fail;
+    }
+
+    /** generation 0 stands for no snapshot */
+    uint32_t gen = ++path->snapshot_gen;
+    if(gen == 0)
+        gen = ++path->snapshot_gen;
+
+    while((dentry = readdir(dir)) != 0) {
+        struct stat st;
+
+        if(strcmp(dentry->d_name, ".") == 0 || strcmp(dentry->d_name, "..") == 0)
+            continue;
+
+        if(fstatat(dirfd(dir), dentry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+
+        uint32_t mask = 0;
+
+        HASH_FIND_STR(path->snapshot, dentry->d_name, e);
+
+        if(e != 0 && e->ino != st.st_ino) {
+            /** replaced while we were not looking */
+            if(synthesize)
+                snapshot_dispatch(path, e->name, IN_DELETE | (e->isdir ? IN_ISDIR : 0));
+
+            e->ino = 0;
+            mask = IN_CREATE;
+        } else if(e != 0) {
+            uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+
+            if(S_ISREG(st.st_mode) && (e->mtime != mtime || e->size != (uint64_t)st.st_size))
+                mask = IN_MODIFY;
+        } else {
+            e = snapshot_add(path, dentry->d_name);
+            if(e == 0)
+                continue;
+
+            mask = IN_CREATE;
+        }
+
+        snapshot_fill(e, &st);
+        e->gen = gen;
+
+        if(!synthesize || mask == 0)
+            continue;
+
+        if(e->isdir) {
+            snapshot_dispatch(path, e->name, mask | IN_ISDIR);
+            continue;
+        }
+
+        if(mask & IN_CREATE)
+            snapshot_dispatch(path, e->name, IN_CREATE);
+
+        /** writer may still have it open, only say content changed */
+        if(S_ISREG(st.st_mode) && (!(mask & IN_CREATE) || st.st_size > 0))
+            snapshot_dispatch(path, e->name, IN_MODIFY);
+
+        /** closed only if it stays as it is now */
+        if(S_ISREG(st.st_mode) && (path->flags & IN_CLOSE_WRITE)) {
+            e->settle = 1;
+            if(list_empty(&(path->settle)))
+                list_add_tail(&(path->settle), &settle_list);
+        }
+    }
+
+    closedir(dir);
+
+    /** whatever wasn't seen is gone */
+    HASH_ITER(hh, path->snapshot, e, tmp) {
+        if(e->gen == gen)
+            continue;
+
+        if(synthesize)
+            snapshot_dispatch(path, e->name, IN_DELETE | (e->isdir ? IN_ISDIR : 0));
+
+        HASH_DEL(path->snapshot, e);
+        free(e);
+    }
+
+    return 0;
+
+    fail:
+    errno = errsv;
+    return -1;
+}
+
+int snapshot_build(struct incron_path* path)
+{
+    if(!snapshot_watch_mask(path))
+        return 0;
+
+    snapshot_free(&(path->snapshot));
+    path->snapshot_gen = 0;
+
+    if(snapshot_scan(path, 0) == -1) {
+        /** not a directory isn't an error here */
+        if(errno == ENOTDIR)
+            return 0;
+
+        return -1;
+    }
+
+    debug_printf_n("snapshot of %s has %u entries", path->path, HASH_COUNT(path->snapshot));
+
+    return 0;
+}
+
+void snapshot_update(struct incron_path* path, const struct inotify_event* event)
+{
+    if(path->snapshot_gen == 0)
+        return;
+
+    if(event->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+        snapshot_free(&(path->snapshot));
+        path->snapshot_gen = 0;
+        return;
+    }
+
+    if(event->len == 0)
+        return;
+
+    struct incron_snapshot_entry* e = 0;
+    HASH_FIND_STR(path->snapshot, event->name, e);
+
+    if(event->mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE)) {
+        char name[PATH_MAX];
+        struct stat st;
+
+        snprintf(name, sizeof(name), "%s/%s", path->path, event->name);
+
+        if(fstatat(AT_FDCWD, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            if(e == 0)
+                e = snapshot_add(path, event->name);
+
+            if(e != 0) {
+                snapshot_fill(e, &st);
+                e->gen = path->snapshot_gen;
+                /** real events take over, writer closes it on its own */
+                e->settle = 0;
+            }
+
+            return;
+        }
+    }
+
+    if(e != 0 && (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE))) {
+        HASH_DEL(path->snapshot, e);
+        free(e);
+    }
+}
+
+static void rescan_batch(struct incron_timer* timer)
+{
+    struct incron_path* p = 0;
+    int budget = SNAPSHOT_RESCAN_BATCH;
+
+    (void)timer;
+
+    dispatch_stamp();
+
+    while(!list_empty(&rescan_list) && budget-- > 0) {
+        p = list_first_entry(&rescan_list, struct incron_path, rescan);
+        list_del_init(&(p->rescan));
+
+        /** watch went away meanwhile */
+        if(p->snapshot_gen == 0)
+            continue;
+
+        if(snapshot_scan(p, 1) == -1) {
+            syslog(LOG_ERR, "rescanning %s failed with %d:%s", p->path, errno, strerror(errno));
+            continue;
+        }
+
+        rescan_done++;
+    }
+
+    if(!list_empty(&rescan_list)) {
+        incron_timer_arm(&rescan_timer, 1);
+        return;
+    }
+
+    syslog(LOG_WARNING, "inotify queue overflow, rescanned %d directories", rescan_done);
+    rescan_done = 0;
+
+    if(!list_empty(&settle_list))
+        incron_timer_arm(&settle_timer, SNAPSHOT_SETTLE_MS);
+}
+
+/** recovered writes left unchanged since rescan are taken as closed */
+static void settle_check(struct incron_timer* timer)
+{
+    struct incron_path* p = 0;
+    struct incron_snapshot_entry *e, *tmp;
+
+    (void)timer;
+
+    /** another overflow, rearmed once rescan is done */
+    if(!list_empty(&rescan_list))
+        return;
+
+    dispatch_stamp();
+
+    while(!list_empty(&settle_list)) {
+        p = list_first_entry(&settle_list, struct incron_path, settle);
+        list_del_init(&(p->settle));
+
+        HASH_ITER(hh, p->snapshot, e, tmp) {
+            char name[PATH_MAX];
+            struct stat st;
+
+            if(!e->settle)
+                continue;
+
+            e->settle = 0;
+
+            snprintf(name, sizeof(name), "%s/%s", p->path, e->name);
+
+            /** still written to, real IN_CLOSE_WRITE is yet to come */
+            if(fstatat(AT_FDCWD, name, &st, AT_SYMLINK_NOFOLLOW) == -1 || e->ino != st.st_ino ||
+               e->size != (uint64_t)st.st_size ||
+               e->mtime != (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec)
+                continue;
+
+            snapshot_dispatch(p, e->name, IN_CLOSE_WRITE);
+        }
+    }
+}
+
+/** queue every snapshotted directory, ones still waiting from previous overflow keep their place */
+int snapshot_recover()
+{
+    struct incron_path *p = 0;
+
+    if(rescan_timer.func == 0)
+        incron_timer_setup(&rescan_timer, rescan_batch);
+
+    if(settle_timer.func == 0)
+        incron_timer_setup(&settle_timer, settle_check);
+
+    for(p = incron_paths; p != NULL; p = p->hh.next) {
+        if(p->snapshot_gen == 0 || !list_empty(&(p->rescan)))
+            continue;
+
+        list_add_tail(&(p->rescan), &rescan_list);
+    }
+
+    if(!incron_timer_pending(&rescan_timer))
+        rescan_batch(&rescan_timer);
+
+    return 0;
+}
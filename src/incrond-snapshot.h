@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_SNAPSHOT_H__
+#define __INCROND_SNAPSHOT_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+
+#include "uthash.h"
+
+/** events that can be recovered after IN_Q_OVERFLOW, file still open for writing
+ * looks just like a written one, so IN_CLOSE_WRITE waits for file to settle */
+#define SNAPSHOT_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE)
+
+/** recovered write is taken as closed if file is still the same that much later */
+#define SNAPSHOT_SETTLE_MS 100
+
+/** directories rescanned at once, the rest waits for next timer tick */
+#define SNAPSHOT_RESCAN_BATCH 64
+
+/** events needed to keep snapshot up to date */
+#define SNAPSHOT_WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct incron_path;
+struct inotify_event;
+
+/** directory entry as seen last time */
+struct incron_snapshot_entry {
+    uint64_t ino;               ///> inode number
+    uint64_t mtime;             ///> modification time in ns
+    uint64_t size;              ///> file size
+    uint32_t gen;               ///> scan generation entry was seen at
+    uint8_t isdir;              ///> entry is a directory
+    uint8_t settle;             ///> recovered write waits for IN_CLOSE_WRITE
+
+    UT_hash_handle hh;          ///> hashed by name
+    char name[];                ///> entry name
+};
+
+static inline void snapshot_free(struct incron_snapshot_entry** snapshot)
+{
+    struct incron_snapshot_entry *e, *tmp;
+
+    HASH_ITER(hh, *snapshot, e, tmp) {
+        HASH_DEL(*snapshot, e);
+        free(e);
+    }
+}
+
+uint32_t snapshot_watch_mask(const struct incron_path* /*path*/);
+int snapshot_build(struct incron_path* /*path*/);
+void snapshot_update(struct incron_path* /*path*/, const struct inotify_event* /*event*/);
+int snapshot_recover();
+
+#endif
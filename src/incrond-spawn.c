@@ -0,0 +1,219 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-spawn.c
+*
+* @brief Hook process launch
+*
+* @par
+* Parent prepares argv, environment and user attributes, so the child only
+* does setsid, chdir, setgid/setuid and exec. With SPAWN_CLONE the child runs
+* on a separate stack in daemon address space and parent is suspended until
+* exec, so launch cost doesn't grow with daemon RSS and page tables. Such
+* child must not allocate or take locks, errors are passed back through
+* shared memory and logged by parent.
+*
+* Hook with cgroup is created right in it with clone3(CLONE_INTO_CGROUP) for
+* SPAWN_FORK where kernel supports it. SPAWN_CLONE child runs on a stack clone3
+* can't return on from C, so it writes itself into cgroup.procs before exec.
+*/
+#include "incrond-spawn.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <sys/syscall.h>
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+/** struct clone_args of linux/sched.h, which clashes with sched.h */
+struct spawn_clone_args {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+
+#ifdef GCOV
+void __gcov_flush(void);
+#endif
+
+/** child stack for SPAWN_CLONE, parent is suspended while child uses it */
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+struct spawn_ctx {
+    const char* file;
+    char* const* argv;
+    char* const* envp;
+    const struct spawn_attr* attr;
+
+    int shared;                 ///> child shares memory with parent
+    int in_cgroup;              ///> child was created in attr->cgroup_fd already
+    int raw;                    ///> created by raw clone3, libc state isn't reset, no syslog
+    int err;                    ///> errno of failed step, set by child
+    const char* failed;         ///> failed step, set by child
+};
+
+static int spawn_child(void* arg)
+{
+    struct spawn_ctx* ctx = arg;
+    const struct spawn_attr* attr = ctx->attr;
+    sigset_t mask;
+
+    /** failure isn't fatal, hook just stays in daemon session */
+    setsid();
+
+    /** while still root, user can't move itself out of daemon cgroup */
+    if(attr->cgroup_fd != -1 && !ctx->in_cgroup) {
+        int fd = openat(attr->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+
+        if(fd == -1 || write(fd, "0", 1) != 1) {
+            ctx->failed = "joining cgroup";
+            goto fail;
+        }
+
+        close(fd);
+    }
+
+    if(attr->dir != 0 && chdir(attr->dir) == -1) {
+        ctx->failed = "chdir";
+        goto fail;
+    }
+
+    /** set gid first since once we set uid, we've lost root privileges,
+     * raw syscalls as libc wrappers would change credentials of all daemon threads */
+    if(attr->set_user && (syscall(SYS_setgid, attr->gid) == -1 || syscall(SYS_setuid, attr->uid) == -1)) {
+        ctx->failed = "setting gid/uid";
+        goto fail;
+    }
+
+    if(attr->stdin_fd == -1)
+        close(STDIN_FILENO);
+    else if(attr->stdin_fd != STDIN_FILENO && dup2(attr->stdin_fd, STDIN_FILENO) == -1) {
+        ctx->failed = "dup2";
+        goto fail;
+    }
+
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+
+    /** restore original mask */
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, 0);
+
+#ifdef GCOV
+    if(!ctx->shared)
+        __gcov_flush();
+#endif
+
+    execve(ctx->file, ctx->argv, ctx->envp);
+
+    ctx->failed = "exec";
+
+    fail:
+    ctx->err = errno;
+
+    /** parent logs for shared child, syslog isn't safe here */
+    if(!ctx->shared && !ctx->raw)
+        syslog(LOG_CRIT, "failed %s with %d : %s", ctx->failed, ctx->err, strerror(ctx->err));
+
+    _exit(EXIT_FAILURE);
+}
+
+/** @return pid, 0 in child, -1 with errno if clone3 or cgroups aren't supported */
+static pid_t fork_into_cgroup(int cgroup_fd)
+{
+#ifdef SYS_clone3
+    static int supported = 1;
+
+    struct spawn_clone_args args = {
+        .flags = CLONE_INTO_CGROUP,
+        .exit_signal = SIGCHLD,
+        .cgroup = cgroup_fd,
+    };
+
+    if(!supported) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+
+    /** older kernel, other errors like EBUSY are left to child to report */
+    if(pid == -1 && (errno == ENOSYS || errno == E2BIG))
+        supported = 0;
+
+    return pid;
+#else
+    (void)cgroup_fd;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+pid_t spawn_process(enum spawn_method method, const char* file,
+                    char* const argv[], char* const envp[],
+                    const struct spawn_attr* attr)
+{
+    static char* stack = 0;
+
+    struct spawn_ctx ctx = {
+        .file = file,
+        .argv = argv,
+        .envp = envp,
+        .attr = attr,
+        .shared = method == SPAWN_CLONE,
+    };
+
+    pid_t pid = -1;
+
+    if(method == SPAWN_CLONE && stack == 0) {
+        stack = malloc(SPAWN_STACK_SIZE);
+
+        if(stack == 0)
+            method = SPAWN_FORK;
+    }
+
+    switch(method) {
+        case SPAWN_CLONE:
+            /** stack grows down */
+            pid = clone(spawn_child, stack + SPAWN_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, &ctx);
+            break;
+        case SPAWN_FORK:
+        default:
+            ctx.shared = 0;
+
+            if(attr->cgroup_fd != -1 && (pid = fork_into_cgroup(attr->cgroup_fd)) != -1) {
+                ctx.in_cgroup = 1;
+                ctx.raw = 1;
+            }
+            else
+                pid = fork();
+
+            if(pid == 0)
+                spawn_child(&ctx);
+            break;
+    }
+
+    /** child already exited, it still has to be reaped by caller */
+    if(pid > 0 && ctx.err != 0)
+        syslog(LOG_CRIT, "failed %s with %d : %s", ctx.failed, ctx.err, strerror(ctx.err));
+
+    return pid;
+}
@@ -0,0 +1,27 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_SPAWN_H__
+#define __INCROND_SPAWN_H__
+
+#include <sys/types.h>
+
+enum spawn_method {
+    SPAWN_FORK,                 ///< fork() copying daemon page tables
+    SPAWN_CLONE,                ///< clone(CLONE_VM | CLONE_VFORK) sharing daemon memory until exec
+};
+
+/** everything child has to do before exec, prepared by parent */
+struct spawn_attr {
+    uid_t uid;                  ///> user to switch to
+    gid_t gid;                  ///> group to switch to
+    const char* dir;            ///> working directory, 0 to keep current
+    int set_user;               ///> switch uid/gid
+    int stdin_fd;               ///> fd passed as stdin, -1 to close stdin
+    int cgroup_fd;              ///> cgroup v2 directory child is started in, -1 to stay in daemon cgroup
+};
+
+pid_t spawn_process(enum spawn_method /*method*/, const char* /*file*/,
+                    char* const /*argv*/[], char* const /*envp*/[],
+                    const struct spawn_attr* /*attr*/);
+
+#endif
@@ -0,0 +1,396 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-spawner.c
+*
+* @brief Spawn helper process
+*
+* @par
+* Helper is forked at daemon start before tabs are loaded, so it stays small
+* and its forks stay cheap. Daemon sends prepared argv, environment and user
+* attributes over SOCK_SEQPACKET socket and doesn't wait for process creation,
+* helper spawns hooks, replies with pid in request order and reports every
+* reaped child back, so daemon keeps its own child accounting. Hook cgroup
+* directory and stdin come along with request as SCM_RIGHTS fds.
+*/
+#include "incrond-spawner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "incrond-config.h"
+
+struct spawner_request {
+    uid_t uid;
+    gid_t gid;
+    int set_user;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t has_dir;
+    uint32_t has_cgroup;        ///> cgroup directory fd is passed with request
+    uint32_t has_stdin;         ///> stdin fd is passed with request, after cgroup one
+    char data[];                ///> file, dir if has_dir, argv and envp strings
+};
+
+static int spawner_sock = -1;   ///> daemon end of socket
+static pid_t spawner_pid = -1;
+
+/** @return 0 on success, -1 if daemon is gone */
+static int spawner_reply(int sock, int type, pid_t pid, int status)
+{
+    struct spawner_reply reply = {
+        .type = type,
+        .pid = pid,
+        .status = status,
+    };
+
+    if(send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply))
+        return -1;
+
+    return 0;
+}
+
+/** @return next string or 0 if there is none before end */
+static char* next_string(char** pos, const char* end)
+{
+    char* s = *pos;
+
+    if(s >= end)
+        return 0;
+
+    char* nul = memchr(s, '\0', end - s);
+
+    if(nul == 0)
+        return 0;
+
+    *pos = nul + 1;
+    return s;
+}
+
+static int spawner_handle_request(int sock, char* buf, size_t len, const int* fds, int nfds)
+{
+    struct spawner_request* req = (struct spawner_request*)buf;
+    char* pos = req->data;
+    const char* end = buf + len;
+    char* file = 0;
+    char** argv = 0;
+    int errsv = EINVAL;
+    pid_t pid = -1;
+
+    if(len < sizeof(struct spawner_request) || req->argc == 0 ||
+       (size_t)req->argc + req->envc > len || (int)(req->has_cgroup + req->has_stdin) != nfds)
+        goto reply;
+
+    struct spawn_attr attr = {
+        .uid = req->uid,
+        .gid = req->gid,
+        .dir = 0,
+        .set_user = req->set_user,
+        .stdin_fd = req->has_stdin ? fds[nfds - 1] : -1,
+        .cgroup_fd = req->has_cgroup ? fds[0] : -1,
+    };
+
+    /** argv and envp share one array */
+    argv = calloc(req->argc + req->envc + 2, sizeof(char*));
+    if(argv == 0) {
+        errsv = ENOMEM;
+        goto reply;
+    }
+
+    char** envp = argv + req->argc + 1;
+
+    if((file = next_string(&pos, end)) == 0)
+        goto reply;
+
+    if(req->has_dir && (attr.dir = next_string(&pos, end)) == 0)
+        goto reply;
+
+    for(uint32_t i = 0; i < req->argc; i++)
+        if((argv[i] = next_string(&pos, end)) == 0)
+            goto reply;
+
+    for(uint32_t i = 0; i < req->envc; i++)
+        if((envp[i] = next_string(&pos, end)) == 0)
+            goto reply;
+
+    pid = spawn_process(spawn_method, file, argv, envp, &attr);
+    errsv = errno;
+
+    reply:
+    free(argv);
+
+    return spawner_reply(sock, SPAWNER_SPAWNED, pid, pid == -1 ? errsv : 0);
+}
+
+static int spawner_reap(int sock)
+{
+    int status = 0;
+    pid_t pid;
+
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        if(spawner_reply(sock, SPAWNER_EXITED, pid, status) == -1)
+            return -1;
+
+    return 0;
+}
+
+static void spawner_main(int sock)
+{
+    static char buf[SPAWNER_MSG_MAX];
+    sigset_t mask;
+
+    prctl(PR_SET_NAME, "incrond-spawn");
+
+    /** only SIGCHLD is consumed through signalfd, rest keep their defaults */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_SETMASK, &mask, 0);
+
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if(sigfd == -1) {
+        syslog(LOG_CRIT, "spawn helper signalfd failed with %d:%s", errno, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = sock, .events = POLLIN },
+        { .fd = sigfd, .events = POLLIN },
+    };
+
+    while(1) {
+        if(poll(fds, 2, -1) == -1) {
+            if(errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        if(fds[1].revents) {
+            struct signalfd_siginfo fdsi;
+
+            while(read(sigfd, &fdsi, sizeof(fdsi)) == sizeof(fdsi))
+                ;
+
+            if(spawner_reap(sock) == -1)
+                break;
+        }
+
+        if(fds[0].revents) {
+            char control[CMSG_SPACE(sizeof(int) * SPAWNER_MAX_FDS)];
+            struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+            struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control,
+                .msg_controllen = sizeof(control),
+            };
+            int passed[SPAWNER_MAX_FDS];
+            int npassed = 0;
+
+            ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+            /** daemon closed its end */
+            if(len <= 0)
+                break;
+
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+
+            if(cmsg != 0 && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                npassed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(passed, CMSG_DATA(cmsg), npassed * sizeof(int));
+            }
+
+            int ret = spawner_handle_request(sock, buf, len, passed, npassed);
+
+            for(int i = 0; i < npassed; i++)
+                close(passed[i]);
+
+            if(ret == -1)
+                break;
+        }
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+int spawner_start(int sigfd)
+{
+    int sv[2];
+    int errsv = 0;
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        return -1;
+
+    pid_t pid = fork();
+
+    if(pid == -1) {
+        errsv = errno;
+        goto fail_close;
+    }
+
+    if(pid == 0) {
+        close(sv[0]);
+        close(sigfd);
+        spawner_main(sv[1]);
+    }
+
+    close(sv[1]);
+
+    /** helper can be busy, requests are spawned by daemon when queue is full */
+    if(fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1)
+        syslog(LOG_WARNING, "setting spawn helper socket non blocking failed with %d:%s", errno, strerror(errno));
+
+    spawner_sock = sv[0];
+    spawner_pid = pid;
+
+    syslog(LOG_INFO, "started spawn helper [%d]", pid);
+
+    return 0;
+
+    fail_close:
+    close(sv[0]);
+    close(sv[1]);
+
+    errno = errsv;
+    return -1;
+}
+
+int spawner_fd()
+{
+    return spawner_sock;
+}
+
+int spawner_request(const char* file, char* const argv[], char* const envp[],
+                    const struct spawn_attr* attr)
+{
+    size_t len = sizeof(struct spawner_request) + strlen(file) + 1;
+    uint32_t argc = 0, envc = 0;
+
+    if(spawner_sock == -1) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if(attr->dir != 0)
+        len += strlen(attr->dir) + 1;
+
+    for(; argv[argc] != 0; argc++)
+        len += strlen(argv[argc]) + 1;
+
+    for(; envp[envc] != 0; envc++)
+        len += strlen(envp[envc]) + 1;
+
+    if(len > SPAWNER_MSG_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    struct spawner_request* req = malloc(len);
+    if(req == 0)
+        return -1;
+
+    req->uid = attr->uid;
+    req->gid = attr->gid;
+    req->set_user = attr->set_user;
+    req->argc = argc;
+    req->envc = envc;
+    req->has_dir = attr->dir != 0;
+    req->has_cgroup = attr->cgroup_fd != -1;
+    req->has_stdin = attr->stdin_fd != -1;
+
+    char* pos = req->data;
+
+    pos = stpcpy(pos, file) + 1;
+
+    if(attr->dir != 0)
+        pos = stpcpy(pos, attr->dir) + 1;
+
+    for(uint32_t i = 0; i < argc; i++)
+        pos = stpcpy(pos, argv[i]) + 1;
+
+    for(uint32_t i = 0; i < envc; i++)
+        pos = stpcpy(pos, envp[i]) + 1;
+
+    char control[CMSG_SPACE(sizeof(int) * SPAWNER_MAX_FDS)];
+    struct iovec iov = { .iov_base = req, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    int passed[SPAWNER_MAX_FDS];
+    int npassed = 0;
+
+    if(attr->cgroup_fd != -1)
+        passed[npassed++] = attr->cgroup_fd;
+
+    if(attr->stdin_fd != -1)
+        passed[npassed++] = attr->stdin_fd;
+
+    if(npassed > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * npassed);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * npassed);
+        memcpy(CMSG_DATA(cmsg), passed, sizeof(int) * npassed);
+    }
+
+    ssize_t ret = sendmsg(spawner_sock, &msg, MSG_NOSIGNAL);
+    int errsv = errno;
+
+    free(req);
+
+    if(ret != (ssize_t)len) {
+        errno = ret == -1 ? errsv : EMSGSIZE;
+        return -1;
+    }
+
+    return 0;
+}
+
+int spawner_recv(struct spawner_reply* reply)
+{
+    ssize_t len = recv(spawner_sock, reply, sizeof(struct spawner_reply), 0);
+
+    if(len == sizeof(struct spawner_reply))
+        return 1;
+
+    if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+
+    /** helper exited or sent garbage */
+    if(len != -1)
+        errno = len == 0 ? ECONNRESET : EPROTO;
+
+    return -1;
+}
+
+void spawner_stop()
+{
+    if(spawner_sock == -1)
+        return;
+
+    /** helper exits on EOF, already spawned hooks keep running */
+    close(spawner_sock);
+    spawner_sock = -1;
+
+    if(waitpid(spawner_pid, 0, 0) == -1 && errno != ECHILD)
+        syslog(LOG_WARNING, "waiting spawn helper [%d] failed with %d:%s", spawner_pid, errno, strerror(errno));
+
+    spawner_pid = -1;
+}
@@ -0,0 +1,34 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_SPAWNER_H__
+#define __INCROND_SPAWNER_H__
+
+#include <sys/types.h>
+
+#include "incrond-spawn.h"
+
+/** largest request, bigger ones are spawned by daemon itself */
+#define SPAWNER_MSG_MAX (64 * 1024)
+
+/** cgroup directory and stdin */
+#define SPAWNER_MAX_FDS 2
+
+enum spawner_reply_type {
+    SPAWNER_SPAWNED,            ///< reply to request, in request order
+    SPAWNER_EXITED,             ///< child reaped by helper
+};
+
+struct spawner_reply {
+    int type;                   ///> enum spawner_reply_type
+    pid_t pid;                  ///> -1 if spawning failed
+    int status;                 ///> errno if spawning failed, wait status if exited
+};
+
+int spawner_start(int /*sigfd*/);
+int spawner_fd();
+int spawner_request(const char* /*file*/, char* const /*argv*/[], char* const /*envp*/[],
+                    const struct spawn_attr* /*attr*/);
+int spawner_recv(struct spawner_reply* /*reply*/);
+void spawner_stop();
+
+#endif
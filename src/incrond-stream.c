@@ -0,0 +1,230 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-stream.c
+*
+* @brief Persistent hook processes fed through stdin
+*
+* @par
+* IN_STREAM hook command is started once and every matching event is written
+* to its stdin as one line:
+*
+*   <seconds.nanoseconds>\t<mask>\t<watched path>\t<file name>\n
+*
+* with '\\', '\\t' and '\\n' in path and name escaped as "\\\\", "\\t" and "\\n".
+* Records are never longer than PIPE_BUF, so each write is atomic. Pipe is non
+* blocking, records not fitting into it are dropped and counted, daemon never
+* waits for slow reader.
+*/
+#include "incrond-stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+
+#include "incrond.h"
+#include "incrond-config.h"
+#include "incrond-parse-tabs.h"
+#include "incrond-dispatch.h"
+
+static LIST_HEAD(streams);
+
+struct incron_stream* stream_new(struct incron_hook* hook, incron_timer_func restart)
+{
+    size_t len = 0;
+
+    for(int i = 0; i < hook->argc; i++)
+        len += strlen(hook->argv[i]) + 1;
+
+    struct incron_stream* stream = calloc(1, sizeof(struct incron_stream) + len + 1);
+    if(stream == 0)
+        return 0;
+
+    /** arguments are passed as is, event data comes through stdin */
+    stream->command = (char*)(stream + 1);
+
+    char* pos = stream->command;
+    for(int i = 0; i < hook->argc; i++) {
+        if(i > 0)
+            *pos++ = ' ';
+        pos = stpcpy(pos, hook->argv[i]);
+    }
+
+    stream->hook = hook;
+    stream->pid = -1;
+    stream->fd = -1;
+    incron_timer_setup(&(stream->restart), restart);
+
+    list_add_tail(&(stream->list), &streams);
+
+    return stream;
+}
+
+pid_t stream_start(struct incron_stream* stream, struct spawn_attr* attr)
+{
+    const char* path_env = getenv("PATH");
+    char pathenv[(path_env ? strlen(path_env) : 0) + sizeof("PATH=")];
+    sprintf(pathenv, "PATH=%s", path_env ? path_env : "");
+    char *envp[] = {pathenv, 0};
+    char *argv[] = {"/bin/bash", "-c", stream->command, 0};
+
+    int fds[2];
+    int errsv = 0;
+
+    if(pipe2(fds, O_CLOEXEC) == -1)
+        return -1;
+
+    /** only daemon end is non blocking, reader sees ordinary pipe */
+    if(fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1) {
+        errsv = errno;
+        goto fail_close;
+    }
+
+    /** failure is fine, default capacity is used */
+    fcntl(fds[1], F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+
+    attr->stdin_fd = fds[0];
+
+    pid_t pid = spawn_process(spawn_method, argv[0], argv, envp, attr);
+    errsv = errno;
+
+    attr->stdin_fd = -1;
+    close(fds[0]);
+
+    if(pid == -1) {
+        close(fds[1]);
+        errno = errsv;
+        return -1;
+    }
+
+    stream->pid = pid;
+    stream->fd = fds[1];
+    stream->started = incron_timer_now();
+
+    syslog(LOG_NOTICE, "started stream %s [%d]", stream->command, pid);
+
+    return pid;
+
+    fail_close:
+    close(fds[0]);
+    close(fds[1]);
+
+    errno = errsv;
+    return -1;
+}
+
+/** @return end of escaped string or 0 if it doesn't fit */
+char* stream_escape(char* pos, const char* end, const char* str)
+{
+    for(; *str; str++) {
+        char c = *str;
+        int escaped = c == '\\' || c == '\t' || c == '\n';
+
+        if(pos + 1 + escaped >= end)
+            return 0;
+
+        if(escaped) {
+            *pos++ = '\\';
+            c = c == '\t' ? 't' : c == '\n' ? 'n' : '\\';
+        }
+
+        *pos++ = c;
+    }
+
+    return pos;
+}
+
+int stream_write(struct incron_stream* stream, const struct incron_path* path, const struct inotify_event* event)
+{
+    char record[PIPE_BUF];
+    const char* end = record + sizeof(record);
+
+    /** exited reader isn't reaped yet */
+    if(stream->fd == -1)
+        goto drop;
+
+    int len = snprintf(record, sizeof(record), "%ld.%09ld\t%u\t",
+                       (long)dispatch_time.tv_sec, dispatch_time.tv_nsec, event->mask);
+    char* pos = record + len;
+
+    if((pos = stream_escape(pos, end, path->path)) == 0 || pos + 1 >= end)
+        goto drop;
+
+    *pos++ = '\t';
+
+    if(event->len > 0 && (pos = stream_escape(pos, end, event->name)) == 0)
+        goto drop;
+
+    if(pos + 1 > end)
+        goto drop;
+
+    *pos++ = '\n';
+
+    if(write(stream->fd, record, pos - record) == -1) {
+        if(errno == EAGAIN)
+            goto drop;
+
+        /** reader is gone, it is restarted once reaped */
+        syslog(LOG_WARNING, "writing stream %s [%d] failed with %d:%s", stream->command, stream->pid, errno, strerror(errno));
+        close(stream->fd);
+        stream->fd = -1;
+
+        return -1;
+    }
+
+    if(stream->dropped) {
+        syslog(LOG_WARNING, "stream %s [%d] dropped %lu events", stream->command, stream->pid, stream->dropped);
+        stream->dropped = 0;
+    }
+
+    return 0;
+
+    drop:
+    if(stream->dropped++ > 0)
+        return 0;
+
+    if(stream->pid == -1)
+        syslog(LOG_WARNING, "stream %s isn't running, dropping events", stream->command);
+    else
+        syslog(LOG_WARNING, "stream %s [%d] isn't keeping up, dropping events", stream->command, stream->pid);
+
+    return 0;
+}
+
+void stream_exited(struct incron_stream* stream)
+{
+    if(stream->fd != -1)
+        close(stream->fd);
+
+    stream->fd = -1;
+    stream->pid = -1;
+}
+
+/** closing stdin lets process finish on EOF */
+void stream_stop(struct incron_stream* stream)
+{
+    incron_timer_cancel(&(stream->restart));
+
+    if(stream->fd != -1)
+        close(stream->fd);
+
+    stream->hook->stream = 0;
+
+    list_del(&(stream->list));
+    free(stream);
+}
+
+void stream_stop_all()
+{
+    struct incron_stream *stream = 0, *tmp = 0;
+
+    list_for_each_entry_safe(stream, tmp, &streams, list)
+        stream_stop(stream);
+}
@@ -0,0 +1,43 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_STREAM_H__
+#define __INCROND_STREAM_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "list.h"
+#include "incrond-spawn.h"
+#include "incrond-timer.h"
+
+/** requested stdin pipe capacity, records are dropped once it is full */
+#define STREAM_PIPE_SIZE (256 * 1024)
+
+/** process living shorter than this is restarted after the rest of it */
+#define STREAM_RESTART_MS 1000
+
+struct incron_hook;
+struct incron_path;
+struct inotify_event;
+
+/** IN_STREAM hook process fed with event records through stdin */
+struct incron_stream {
+    struct incron_hook* hook;   ///> hook stream belongs to
+    char* command;              ///> shell command process is started with
+    pid_t pid;                  ///> running process, -1 if none
+    int fd;                     ///> non blocking write end of process stdin, -1 if none
+    uint64_t started;           ///> CLOCK_MONOTONIC ms process was started at
+    unsigned long dropped;      ///> records dropped since last successful write
+    struct incron_timer restart; ///> delayed restart of quickly exited process
+    struct list_head list;      ///> all streams
+};
+
+struct incron_stream* stream_new(struct incron_hook* /*hook*/, incron_timer_func /*restart*/);
+pid_t stream_start(struct incron_stream* /*stream*/, struct spawn_attr* /*attr*/);
+int stream_write(struct incron_stream* /*stream*/, const struct incron_path* /*path*/, const struct inotify_event* /*event*/);
+char* stream_escape(char* /*pos*/, const char* /*end*/, const char* /*str*/);
+void stream_exited(struct incron_stream* /*stream*/);
+void stream_stop(struct incron_stream* /*stream*/);
+void stream_stop_all();
+
+#endif
@@ -0,0 +1,895 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-tabcache.c
+*
+* @brief Compiled tab snapshot
+*
+* @par
+* With tab_cache set, parsed tabs are written to a single file: paths,
+* masks, options, argv, compiled command templates and resolved direct
+* commands, with every pointer stored as offset from the file start. Next
+* start maps it read only and every tab whose file still has the same
+* inode, size, mtime and ctime gets its hooks pointing straight into the
+* mapping, without parsing or PATH lookups. User tabs are only reused while
+* passwd, allowed and denied users files are unchanged and their owner,
+* looked up in parallel as users may come from NSS, still has the same uid,
+* gid and home directory, direct commands while PATH is the same and hook
+* user can still exec them.
+*
+* @par
+* Anything else is parsed as usual and snapshot is rewritten afterwards.
+* Snapshot failing any check is ignored as a whole, it is never trusted
+* partially.
+*/
+#include "incrond-tabcache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "incrond-arena.h"
+#include "incrond-config.h"
+
+#define FNV_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/** tab loaded this start, goes to rewritten snapshot */
+struct tabcache_entry {
+    enum incron_tab_type type;
+    char* name;
+    struct tabcache_stamp stamp;
+};
+
+/** snapshot section being built */
+struct tabcache_buf {
+    char* data;
+    size_t len;
+    size_t size;
+};
+
+/** mapping stays for process lifetime once any hook points into it */
+static const char* cache_map = 0;
+static size_t cache_size = 0;
+static const struct tabcache_header* cache = 0;
+static const char* cache_blob = 0;
+
+static struct tabcache_stamp users_stamp[3];
+static bool users_valid = false;
+
+static struct tabcache_entry* entries = 0;
+static size_t entry_cnt = 0;
+static size_t entry_max = 0;
+
+static uint32_t reused = 0;
+static bool dirty = false;
+
+static uint64_t tabcache_hash(uint64_t hash, const void* data, size_t len)
+{
+    const unsigned char* c = data;
+
+    for(size_t i = 0; i < len; i++) {
+        hash ^= c[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static uint64_t tabcache_env()
+{
+    const char* path_env = getenv("PATH");
+    uint64_t hash = FNV_BASIS;
+
+    if(path_env == 0)
+        path_env = "";
+
+    hash = tabcache_hash(hash, path_env, strlen(path_env) + 1);
+    hash = tabcache_hash(hash, system_table_dir, strlen(system_table_dir) + 1);
+    hash = tabcache_hash(hash, user_table_dir, strlen(user_table_dir) + 1);
+
+    return hash;
+}
+
+static void tabcache_stamp(const struct stat* st, struct tabcache_stamp* stamp)
+{
+    stamp->ino = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    stamp->ctime = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+static void tabcache_stamp_file(const char* file, struct tabcache_stamp* stamp)
+{
+    struct stat st;
+
+    memset(stamp, 0, sizeof(struct tabcache_stamp));
+
+    if(stat(file, &st) == 0)
+        tabcache_stamp(&st, stamp);
+}
+
+static bool tabcache_valid(const struct tabcache_header* hdr, size_t size)
+{
+    if(memcmp(hdr->magic, TABCACHE_MAGIC, sizeof(TABCACHE_MAGIC)) != 0 || hdr->version != TABCACHE_VERSION ||
+       hdr->hook_size != sizeof(struct tabcache_hook) || hdr->size != size)
+        return false;
+
+    if(hdr->tab_off < sizeof(struct tabcache_header) || hdr->tab_off % 8 != 0 || hdr->hook_off % 8 != 0 ||
+       hdr->blob_off % 8 != 0)
+        return false;
+
+    if((uint64_t)hdr->tab_off + (uint64_t)hdr->tab_cnt * sizeof(struct tabcache_tab) > size ||
+       (uint64_t)hdr->hook_off + (uint64_t)hdr->hook_cnt * sizeof(struct tabcache_hook) > size ||
+       (uint64_t)hdr->blob_off + hdr->blob_len > size)
+        return false;
+
+    /** every string ends inside blob */
+    if(hdr->blob_len == 0 || ((const char*)hdr)[hdr->blob_off + hdr->blob_len - 1] != '\0')
+        return false;
+
+    uint64_t sum = tabcache_hash(FNV_BASIS, (const char*)hdr + sizeof(struct tabcache_header),
+                                 size - sizeof(struct tabcache_header));
+    if(sum != hdr->sum)
+        return false;
+
+    const struct tabcache_tab* tabs = (const void*)((const char*)hdr + hdr->tab_off);
+
+    for(uint32_t i = 0; i < hdr->tab_cnt; i++) {
+        if(tabs[i].name == 0 || tabs[i].name >= hdr->blob_len || tabs[i].type >= TAB_TYPE_MAX ||
+           (uint64_t)tabs[i].hook_first + tabs[i].hook_cnt > hdr->hook_cnt)
+            return false;
+    }
+
+    return true;
+}
+
+static void tabcache_unmap()
+{
+    if(cache_map != 0)
+        munmap((void*)cache_map, cache_size);
+
+    cache_map = 0;
+    cache = 0;
+    cache_blob = 0;
+}
+
+static void tabcache_map()
+{
+    struct stat st;
+    void* map = MAP_FAILED;
+
+    int fd = open(tab_cache, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        if(errno != ENOENT)
+            syslog(LOG_WARNING, "opening tab cache %s failed with %d:%s", tab_cache, errno, strerror(errno));
+
+        return;
+    }
+
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct tabcache_header))
+        map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        syslog(LOG_WARNING, "tab cache %s is unreadable, tabs are parsed", tab_cache);
+        return;
+    }
+
+    cache_map = map;
+    cache_size = st.st_size;
+
+    if(!tabcache_valid(map, cache_size)) {
+        syslog(LOG_WARNING, "tab cache %s is invalid, tabs are parsed", tab_cache);
+        tabcache_unmap();
+        return;
+    }
+
+    cache = map;
+
+    if(cache->env != tabcache_env()) {
+        syslog(LOG_INFO, "PATH or tab directories changed, tab cache %s is not used", tab_cache);
+        tabcache_unmap();
+        return;
+    }
+
+    cache_blob = cache_map + cache->blob_off;
+    users_valid = memcmp(cache->users, users_stamp, sizeof(users_stamp)) == 0;
+}
+
+static int tabcache_cmp(enum incron_tab_type type_a, const char* name_a, enum incron_tab_type type_b, const char* name_b)
+{
+    if(type_a != type_b)
+        return type_a < type_b ? -1 : 1;
+
+    return strcmp(name_a, name_b);
+}
+
+struct tabcache_key {
+    enum incron_tab_type type;
+    const char* name;
+};
+
+static int tabcache_find_cmp(const void* key, const void* elem)
+{
+    const struct tabcache_key* k = key;
+    const struct tabcache_tab* tab = elem;
+
+    return tabcache_cmp(k->type, k->name, tab->type, cache_blob + tab->name);
+}
+
+static const struct tabcache_tab* tabcache_find(enum incron_tab_type type, const char* name)
+{
+    struct tabcache_key key = { type, name };
+
+    return bsearch(&key, cache_map + cache->tab_off, cache->tab_cnt, sizeof(struct tabcache_tab), tabcache_find_cmp);
+}
+
+static bool tabcache_hook_valid(const struct tabcache_hook* rec)
+{
+    uint32_t len = cache->blob_len;
+
+    if(rec->path == 0 || rec->path >= len || rec->command >= len || rec->pw_dir >= len)
+        return false;
+
+    if(rec->direct && rec->command == 0)
+        return false;
+
+    if(rec->argv % 4 != 0 || rec->argv > len || (uint64_t)rec->argc * 4 > len - rec->argv)
+        return false;
+
+    const uint32_t* argv = (const void*)(cache_blob + rec->argv);
+
+    for(uint32_t i = 0; i < rec->argc; i++)
+        if(argv[i] == 0 || argv[i] >= len)
+            return false;
+
+    if(rec->text == 0)
+        return true;
+
+    if(rec->text >= len || strlen(cache_blob + rec->text) < rec->literal_len)
+        return false;
+
+    if(rec->segs % 4 != 0 || rec->segs > len || (uint64_t)rec->seg_cnt * sizeof(struct incron_hook_seg) > len - rec->segs)
+        return false;
+
+    const struct incron_hook_seg* segs = (const void*)(cache_blob + rec->segs);
+
+    for(uint32_t i = 0; i < rec->seg_cnt; i++)
+        if((uint64_t)segs[i].offset + segs[i].len > rec->literal_len || segs[i].arg > TAB_ARG_MAX)
+            return false;
+
+    return true;
+}
+
+/** only what is written at runtime comes from arena, strings stay in mapping */
+static struct incron_hook* tabcache_hook(struct incron_arena* arena, const struct tabcache_hook* rec,
+                                         enum incron_tab_type type, char* name)
+{
+    const uint32_t* argv = (const void*)(cache_blob + rec->argv);
+
+    struct incron_hook* hook = arena_alloc(arena, sizeof(struct incron_hook));
+    if(hook == 0)
+        return 0;
+
+    hook->argv = arena_alloc(arena, (rec->argc + 1) * sizeof(char*));
+
+    /** argv for bash -c or direct exec, as hookCompile() allocates it */
+    if(rec->text != 0)
+        hook->tpl.argv = arena_alloc(arena, ((rec->argc > 3 ? rec->argc : 3) + 1) * sizeof(char*));
+
+    if(hook->argv == 0 || (rec->text != 0 && hook->tpl.argv == 0))
+        return 0;
+
+    for(uint32_t i = 0; i < rec->argc; i++)
+        hook->argv[i] = (char*)(cache_blob + argv[i]);
+
+    hook->argv[rec->argc] = 0;
+    hook->argc = rec->argc;
+
+    if(rec->text != 0) {
+        hook->tpl.text = (char*)(cache_blob + rec->text);
+        hook->tpl.segs = (struct incron_hook_seg*)(cache_blob + rec->segs);
+        hook->tpl.seg_cnt = rec->seg_cnt;
+        hook->tpl.literal_len = rec->literal_len;
+        memcpy(hook->tpl.arg_cnt, rec->arg_cnt, sizeof(hook->tpl.arg_cnt));
+    }
+
+    hook->command = rec->direct ? (char*)(cache_blob + rec->command) : "/bin/bash";
+    hook->direct = rec->direct;
+
+    hook->flags = rec->flags;
+    hook->iflags = rec->iflags;
+    hook->delay = rec->delay;
+    hook->max_spawn = rec->max_spawn;
+    hook->queue_max = rec->queue_max;
+    hook->overflow = rec->overflow;
+    hook->loop_grace = rec->loop_grace;
+    hook->batch_max = rec->batch_max;
+    hook->batch_ms = rec->batch_ms;
+
+    hook->pw_uid = rec->pw_uid;
+    hook->pw_gid = rec->pw_gid;
+    hook->pw_dir = rec->pw_dir ? (char*)(cache_blob + rec->pw_dir) : 0;
+    hook->tab = name;
+    hook->tab_type = type;
+
+    INIT_LIST_HEAD(&(hook->queue));
+    INIT_LIST_HEAD(&(hook->throttled));
+    INIT_LIST_HEAD(&(hook->tab_list));
+
+    hook->arena = arena;
+    arena_get(arena);
+
+    return hook;
+}
+
+/** @return snapshot record of tab if tab file is still the same */
+static const struct tabcache_tab* tabcache_match(enum incron_tab_type type, const char* name,
+                                                 const struct tabcache_stamp* stamp)
+{
+    if(cache == 0 || (type == TAB_USER && !users_valid))
+        return 0;
+
+    const struct tabcache_tab* rec = tabcache_find(type, name);
+    if(rec == 0 || memcmp(&(rec->stamp), stamp, sizeof(struct tabcache_stamp)) != 0)
+        return 0;
+
+    return rec;
+}
+
+/** users may come from NSS, passwd file being the same doesn't mean they are */
+static bool tabcache_owner_valid(const struct tabcache_hook* rec, const struct tab_user* owner)
+{
+    const char* dir = rec->pw_dir ? cache_blob + rec->pw_dir : "";
+
+    return owner != 0 && owner->ret == 0 && rec->pw_uid == owner->uid && rec->pw_gid == owner->gid &&
+           strcmp(dir, owner->dir) == 0;
+}
+
+/**
+ * @param owner user tab owner resolved this start, 0 for system tabs
+ * @return 0 if tab hooks were taken from snapshot, -1 if tab has to be parsed
+ */
+static int tabcache_use(enum incron_tab_type type, const char* name, const struct tabcache_stamp* stamp,
+                        const struct tab_user* owner)
+{
+    const struct tabcache_tab* rec = tabcache_match(type, name, stamp);
+    if(rec == 0)
+        return -1;
+
+    const struct tabcache_hook* hooks = (const void*)(cache_map + cache->hook_off);
+    hooks += rec->hook_first;
+
+    /** whole tab is checked before any hook is attached */
+    for(uint32_t i = 0; i < rec->hook_cnt; i++) {
+        if(!tabcache_hook_valid(&hooks[i]))
+            return -1;
+
+        if(type == TAB_USER && !tabcache_owner_valid(&hooks[i], owner))
+            return -1;
+
+        if(hooks[i].direct && !tabCanExec(cache_blob + hooks[i].command, hooks[i].pw_uid, hooks[i].pw_gid))
+            return -1;
+    }
+
+    struct incron_tab* tab = findTab(type, name);
+    if(tab == 0)
+        return -1;
+
+    struct incron_arena* arena = arena_new();
+    if(arena == 0)
+        return -1;
+
+    for(uint32_t i = 0; i < rec->hook_cnt; i++) {
+        const char* path_name = cache_blob + hooks[i].path;
+        struct incron_path* path = findPath(path_name, strlen(path_name));
+        struct incron_hook* hook = path ? tabcache_hook(arena, &hooks[i], type, (char*)(cache_blob + rec->name)) : 0;
+
+        if(hook == 0) {
+            syslog(LOG_ERR, "Failed loading cached hook %u in %s", i, name);
+            continue;
+        }
+
+        pathAddHook(path, hook);
+        list_add_tail(&(hook->tab_list), &(tab->hooks));
+    }
+
+    arena_put(arena);
+
+    return 0;
+}
+
+static void tabcache_record(enum incron_tab_type type, const char* name, const struct tabcache_stamp* stamp)
+{
+    if(entry_cnt == entry_max) {
+        size_t max = entry_max ? entry_max * 2 : 64;
+        struct tabcache_entry* tmp = realloc(entries, max * sizeof(struct tabcache_entry));
+
+        if(tmp == 0)
+            goto fail;
+
+        entries = tmp;
+        entry_max = max;
+    }
+
+    entries[entry_cnt].name = strdup(name);
+    if(entries[entry_cnt].name == 0)
+        goto fail;
+
+    entries[entry_cnt].type = type;
+    entries[entry_cnt].stamp = *stamp;
+    entry_cnt++;
+
+    return;
+
+    fail:
+    /** tab is just parsed again next start */
+    dirty = true;
+}
+
+/** tab found in directory, parsed after directory is read unless snapshot has it */
+struct tabcache_found {
+    struct tabcache_stamp stamp;
+    bool stamped;
+    bool cached;                ///> snapshot has the same tab file
+};
+
+static int tabcache_dir(int dirfd, enum incron_tab_type type)
+{
+    int errsv = 0;
+    struct dirent* dentry = 0;
+    char** names = 0;
+    struct tabcache_found* found = 0;
+    struct tab_user* owners = 0;
+    int* results = 0;
+    size_t cnt = 0, max = 0, owner_cnt = 0, miss_cnt = 0;
+    int ret = -1;
+
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1)
+        return -1;
+
+    DIR* dir = fdopendir(fd);
+    if(dir == 0) {
+        errsv = errno;
+        close(fd);
+        errno = errsv;
+        return -1;
+    }
+
+    while(1) {
+        struct tabcache_stamp stamp = { 0 };
+        struct stat st;
+
+        errno = 0;
+        dentry = readdir(dir);
+
+        if(dentry == 0) {
+            if(errno == 0) break;
+            continue;
+        }
+
+        /** ., .. and editor leftovers */
+        if(dentry->d_name[0] == '.')
+            continue;
+
+        if(type == TAB_USER && !userAllowed(dentry->d_name)) {
+            syslog(LOG_INFO, "not loading %s user doesn't exists or isn't allowed", dentry->d_name);
+            continue;
+        }
+
+        /** taken before parsing, tab changed meanwhile won't match next start */
+        bool stamped = fstatat(dirfd, dentry->d_name, &st, 0) == 0;
+        if(stamped)
+            tabcache_stamp(&st, &stamp);
+
+        if(cnt == max) {
+            size_t new_max = max ? max * 2 : 64;
+            char** tmp_names = realloc(names, new_max * sizeof(char*));
+            if(tmp_names == 0)
+                goto out;
+            names = tmp_names;
+
+            struct tabcache_found* tmp_found = realloc(found, new_max * sizeof(struct tabcache_found));
+            if(tmp_found == 0)
+                goto out;
+            found = tmp_found;
+
+            max = new_max;
+        }
+
+        names[cnt] = strdup(dentry->d_name);
+        if(names[cnt] == 0)
+            goto out;
+
+        found[cnt].stamp = stamp;
+        found[cnt].stamped = stamped;
+        found[cnt].cached = stamped && tabcache_match(type, names[cnt], &stamp) != 0;
+        owner_cnt += found[cnt].cached && type == TAB_USER;
+        cnt++;
+    }
+
+    /** owners of cached user tabs are looked up by loader threads at once */
+    owners = calloc(owner_cnt ? owner_cnt : 1, sizeof(struct tab_user));
+    if(owners == 0)
+        goto out;
+
+    for(size_t i = 0, j = 0; i < cnt && j < owner_cnt; i++)
+        if(found[i].cached)
+            owners[j++].name = names[i];
+
+    resolveUsers(owners, owner_cnt);
+
+    /** reused tabs are dropped, the rest is moved to the front */
+    for(size_t i = 0, j = 0; i < cnt; i++) {
+        const struct tab_user* owner = type == TAB_USER && found[i].cached ? &owners[j++] : 0;
+
+        if(found[i].cached && tabcache_use(type, names[i], &(found[i].stamp), owner) == 0) {
+            reused++;
+            tabcache_record(type, names[i], &(found[i].stamp));
+            free(names[i]);
+            continue;
+        }
+
+        dirty = true;
+        names[miss_cnt] = names[i];
+        found[miss_cnt] = found[i];
+        miss_cnt++;
+    }
+
+    cnt = miss_cnt;
+
+    /** everything not in snapshot is parsed by loader threads at once */
+    results = calloc(cnt ? cnt : 1, sizeof(int));
+    if(results == 0 || loadTabFiles(dirfd, type, names, results, cnt) == -1)
+        goto out;
+
+    for(size_t i = 0; i < cnt; i++)
+        if(results[i] == 0 && found[i].stamped)
+            tabcache_record(type, names[i], &found[i].stamp);
+
+    ret = 0;
+
+    out:
+    errsv = errno;
+    closedir(dir);
+
+    for(size_t i = 0; i < cnt; i++)
+        free(names[i]);
+
+    for(size_t i = 0; owners != 0 && i < owner_cnt; i++)
+        free(owners[i].dir);
+
+    free(names);
+    free(found);
+    free(owners);
+    free(results);
+
+    errno = errsv;
+    return ret;
+}
+
+static int64_t tabcache_alloc(struct tabcache_buf* buf, size_t len, size_t align)
+{
+    size_t off = (buf->len + align - 1) & ~(align - 1);
+
+    if(off + len > buf->size) {
+        size_t size = buf->size ? buf->size : 4096;
+
+        while(off + len > size)
+            size *= 2;
+
+        char* data = realloc(buf->data, size);
+        if(data == 0)
+            return -1;
+
+        buf->data = data;
+        buf->size = size;
+    }
+
+    /** padding is written too, keep it deterministic */
+    memset(buf->data + buf->len, 0, off + len - buf->len);
+    buf->len = off + len;
+
+    return off;
+}
+
+static int64_t tabcache_str(struct tabcache_buf* blob, const char* str)
+{
+    size_t len = strlen(str) + 1;
+    int64_t off = tabcache_alloc(blob, len, 1);
+
+    if(off != -1)
+        memcpy(blob->data + off, str, len);
+
+    return off;
+}
+
+static int tabcache_add_hook(struct tabcache_buf* hooks, struct tabcache_buf* blob, const struct incron_hook* hook)
+{
+    struct tabcache_hook rec;
+    int64_t off = 0;
+
+    memset(&rec, 0, sizeof(rec));
+
+    if((off = tabcache_str(blob, hook->path->path)) == -1)
+        return -1;
+    rec.path = off;
+
+    if(hook->direct) {
+        if((off = tabcache_str(blob, hook->command)) == -1)
+            return -1;
+        rec.command = off;
+    }
+
+    if(hook->pw_dir != 0) {
+        if((off = tabcache_str(blob, hook->pw_dir)) == -1)
+            return -1;
+        rec.pw_dir = off;
+    }
+
+    /** strings first, blob may move while they are added */
+    uint32_t argv[hook->argc + 1];
+
+    for(int i = 0; i < hook->argc; i++) {
+        if((off = tabcache_str(blob, hook->argv[i])) == -1)
+            return -1;
+        argv[i] = off;
+    }
+
+    if((off = tabcache_alloc(blob, hook->argc * sizeof(uint32_t), 4)) == -1)
+        return -1;
+    memcpy(blob->data + off, argv, hook->argc * sizeof(uint32_t));
+    rec.argv = off;
+    rec.argc = hook->argc;
+
+    if(hook->tpl.text != 0) {
+        if((off = tabcache_str(blob, hook->tpl.text)) == -1)
+            return -1;
+        rec.text = off;
+
+        size_t segs_len = hook->tpl.seg_cnt * sizeof(struct incron_hook_seg);
+        if((off = tabcache_alloc(blob, segs_len, 4)) == -1)
+            return -1;
+        memcpy(blob->data + off, hook->tpl.segs, segs_len);
+        rec.segs = off;
+
+        rec.seg_cnt = hook->tpl.seg_cnt;
+        rec.literal_len = hook->tpl.literal_len;
+        memcpy(rec.arg_cnt, hook->tpl.arg_cnt, sizeof(rec.arg_cnt));
+    }
+
+    rec.flags = hook->flags;
+    rec.iflags = hook->iflags;
+    rec.delay = hook->delay;
+    rec.max_spawn = hook->max_spawn;
+    rec.queue_max = hook->queue_max;
+    rec.loop_grace = hook->loop_grace;
+    rec.batch_max = hook->batch_max;
+    rec.batch_ms = hook->batch_ms;
+    rec.pw_uid = hook->pw_uid;
+    rec.pw_gid = hook->pw_gid;
+    rec.overflow = hook->overflow;
+    rec.direct = hook->direct;
+
+    if((off = tabcache_alloc(hooks, sizeof(rec), 4)) == -1)
+        return -1;
+    memcpy(hooks->data + off, &rec, sizeof(rec));
+
+    return 0;
+}
+
+static int tabcache_entry_cmp(const void* a, const void* b)
+{
+    const struct tabcache_entry* ea = a;
+    const struct tabcache_entry* eb = b;
+
+    return tabcache_cmp(ea->type, ea->name, eb->type, eb->name);
+}
+
+static int tabcache_write_all(int fd, const void* data, size_t len)
+{
+    const char* pos = data;
+
+    while(len > 0) {
+        ssize_t ret = write(fd, pos, len);
+
+        if(ret == -1) {
+            if(errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        pos += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int tabcache_write()
+{
+    struct tabcache_buf tabs = { 0 }, hooks = { 0 }, blob = { 0 };
+    struct tabcache_header hdr;
+    char tmp_name[PATH_MAX];
+    int fd = -1;
+    int errsv = ENOMEM;
+
+    memset(&hdr, 0, sizeof(hdr));
+
+    /** offset 0 stands for no string */
+    if(tabcache_alloc(&blob, 1, 1) == -1)
+        goto fail;
+
+    qsort(entries, entry_cnt, sizeof(struct tabcache_entry), tabcache_entry_cmp);
+
+    for(size_t i = 0; i < entry_cnt; i++) {
+        struct incron_tab* tab = 0;
+        struct incron_hook* hook = 0;
+        struct tabcache_tab rec;
+        int64_t off = 0;
+
+        HASH_FIND_STR(incron_tabs[entries[i].type], entries[i].name, tab);
+        if(tab == 0)
+            continue;
+
+        memset(&rec, 0, sizeof(rec));
+
+        if((off = tabcache_str(&blob, entries[i].name)) == -1)
+            goto fail;
+
+        rec.name = off;
+        rec.type = entries[i].type;
+        rec.stamp = entries[i].stamp;
+        rec.hook_first = hooks.len / sizeof(struct tabcache_hook);
+
+        list_for_each_entry(hook, &(tab->hooks), tab_list) {
+            if(tabcache_add_hook(&hooks, &blob, hook) == -1)
+                goto fail;
+
+            rec.hook_cnt++;
+        }
+
+        if((off = tabcache_alloc(&tabs, sizeof(rec), 8)) == -1)
+            goto fail;
+        memcpy(tabs.data + off, &rec, sizeof(rec));
+    }
+
+    /** blob ends with string terminator, whatever was added last */
+    if(tabcache_alloc(&blob, 1, 1) == -1)
+        goto fail;
+
+    size_t pad_len = (8 - (sizeof(hdr) + tabs.len + hooks.len) % 8) % 8;
+    static const char pad[8] = { 0 };
+
+    if(sizeof(hdr) + tabs.len + hooks.len + pad_len + blob.len > UINT32_MAX) {
+        errsv = EFBIG;
+        goto fail;
+    }
+
+    memcpy(hdr.magic, TABCACHE_MAGIC, sizeof(TABCACHE_MAGIC));
+    hdr.version = TABCACHE_VERSION;
+    hdr.hook_size = sizeof(struct tabcache_hook);
+    hdr.env = tabcache_env();
+    memcpy(hdr.users, users_stamp, sizeof(users_stamp));
+    hdr.tab_off = sizeof(hdr);
+    hdr.tab_cnt = tabs.len / sizeof(struct tabcache_tab);
+    hdr.hook_off = hdr.tab_off + tabs.len;
+    hdr.hook_cnt = hooks.len / sizeof(struct tabcache_hook);
+    hdr.blob_off = hdr.hook_off + hooks.len + pad_len;
+    hdr.blob_len = blob.len;
+    hdr.size = hdr.blob_off + blob.len;
+
+    hdr.sum = tabcache_hash(FNV_BASIS, tabs.data, tabs.len);
+    hdr.sum = tabcache_hash(hdr.sum, hooks.data, hooks.len);
+    hdr.sum = tabcache_hash(hdr.sum, pad, pad_len);
+    hdr.sum = tabcache_hash(hdr.sum, blob.data, blob.len);
+
+    /** readers only ever see complete snapshot */
+    if(snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", tab_cache) >= (int)sizeof(tmp_name)) {
+        errsv = ENAMETOOLONG;
+        goto fail;
+    }
+
+    fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd == -1) {
+        errsv = errno;
+        goto fail;
+    }
+
+    if(tabcache_write_all(fd, &hdr, sizeof(hdr)) == -1 || tabcache_write_all(fd, tabs.data, tabs.len) == -1 ||
+       tabcache_write_all(fd, hooks.data, hooks.len) == -1 || tabcache_write_all(fd, pad, pad_len) == -1 ||
+       tabcache_write_all(fd, blob.data, blob.len) == -1 || fsync(fd) == -1) {
+        errsv = errno;
+        goto fail_unlink;
+    }
+
+    close(fd);
+    fd = -1;
+
+    if(rename(tmp_name, tab_cache) == -1) {
+        errsv = errno;
+        goto fail_unlink;
+    }
+
+    syslog(LOG_INFO, "wrote %u tabs with %u hooks to %s", hdr.tab_cnt, hdr.hook_cnt, tab_cache);
+
+    free(tabs.data);
+    free(hooks.data);
+    free(blob.data);
+
+    return 0;
+
+    fail_unlink:
+    if(fd != -1)
+        close(fd);
+    unlink(tmp_name);
+
+    fail:
+    syslog(LOG_WARNING, "writing tab cache %s failed with %d:%s", tab_cache, errsv, strerror(errsv));
+
+    free(tabs.data);
+    free(hooks.data);
+    free(blob.data);
+
+    errno = errsv;
+    return -1;
+}
+
+int tabcache_load(int system_fd, int user_fd)
+{
+    int errsv = 0;
+    int ret = 0;
+
+    reused = 0;
+    dirty = false;
+
+    tabcache_stamp_file("/etc/passwd", &users_stamp[0]);
+    tabcache_stamp_file(allowed_users_file, &users_stamp[1]);
+    tabcache_stamp_file(denied_users_file, &users_stamp[2]);
+
+    tabcache_map();
+
+    if(tabcache_dir(system_fd, TAB_SYSTEM) == -1) {
+        errsv = errno;
+        ret = -1;
+        goto out;
+    }
+
+    if(user_fd != -1 && tabcache_dir(user_fd, TAB_USER) == -1) {
+        errsv = errno;
+        syslog(LOG_CRIT, "loading users tabs at %s failed with %d:%s", user_table_dir, errsv, strerror(errsv));
+    }
+
+    if(cache != 0)
+        syslog(LOG_INFO, "%u of %zu tabs taken from %s", reused, entry_cnt, tab_cache);
+
+    /** tab removed since last start leaves it stale as well */
+    if(dirty || cache == 0 || reused != cache->tab_cnt)
+        tabcache_write();
+
+    out:
+    if(reused == 0)
+        tabcache_unmap();
+
+    for(size_t i = 0; i < entry_cnt; i++)
+        free(entries[i].name);
+
+    free(entries);
+    entries = 0;
+    entry_cnt = entry_max = 0;
+
+    errno = errsv;
+    return ret;
+}
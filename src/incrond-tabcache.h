@@ -0,0 +1,75 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_TABCACHE_H__
+#define __INCROND_TABCACHE_H__
+
+#include <stdint.h>
+
+#include "incrond-parse-tabs.h"
+
+#define TABCACHE_MAGIC "INCRTAB"
+#define TABCACHE_VERSION 1
+
+/** what tab or users file was when it was parsed, all zero if it is missing */
+struct tabcache_stamp {
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;              ///> ns
+    int64_t ctime;              ///> ns
+};
+
+/** all offsets are from the start of file, so it is used mapped as is */
+struct tabcache_header {
+    char magic[8];              ///> TABCACHE_MAGIC
+    uint32_t version;           ///> TABCACHE_VERSION
+    uint32_t hook_size;         ///> sizeof(struct tabcache_hook), catches layout changes
+    uint64_t size;              ///> whole file size
+    uint64_t sum;               ///> FNV-1a of everything after header
+    uint64_t env;               ///> FNV-1a of PATH and tab directories
+    struct tabcache_stamp users[3]; ///> passwd, allowed and denied users files
+    uint32_t tab_off;           ///> struct tabcache_tab array sorted by type and name
+    uint32_t tab_cnt;
+    uint32_t hook_off;          ///> struct tabcache_hook array, tab hooks are contiguous
+    uint32_t hook_cnt;
+    uint32_t blob_off;          ///> strings and arrays hooks point to
+    uint32_t blob_len;
+};
+
+struct tabcache_tab {
+    uint32_t name;              ///> tab file name
+    uint32_t type;              ///> enum incron_tab_type
+    struct tabcache_stamp stamp; ///> tab file when it was parsed
+    uint32_t hook_first;        ///> index of first hook
+    uint32_t hook_cnt;
+};
+
+/** parsed hook, string offsets are 0 if there is none */
+struct tabcache_hook {
+    uint32_t path;              ///> watched path
+    uint32_t command;           ///> resolved executable of direct hook
+    uint32_t pw_dir;            ///> user home directory
+    uint32_t argv;              ///> uint32_t array of argc argument offsets
+    uint32_t argc;
+    uint32_t text;              ///> template literals, 0 if command failed to compile
+    uint32_t segs;              ///> struct incron_hook_seg array
+    uint32_t seg_cnt;
+    uint32_t literal_len;
+    uint32_t arg_cnt[TAB_ARG_MAX];
+    uint32_t flags;
+    uint32_t iflags;
+    uint32_t delay;
+    uint32_t max_spawn;
+    uint32_t queue_max;
+    uint32_t loop_grace;
+    uint32_t batch_max;
+    uint32_t batch_ms;
+    uint32_t pw_uid;
+    uint32_t pw_gid;
+    uint8_t overflow;
+    uint8_t direct;
+    uint8_t pad[2];
+};
+
+int tabcache_load(int /*system_fd*/, int /*user_fd*/);
+
+#endif
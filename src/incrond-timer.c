@@ -0,0 +1,274 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+/** @file incrond-timer.c
+*
+* @brief Hierarchical timing wheel driven by single timerfd
+*
+* @par
+* Level n slot spans 64^n ms, so 4 levels cover ~4.6 hours, longer timeouts
+* are parked in the last slot of the top level and placed again once reached.
+* Timers of level n > 0 are cascaded to lower levels when the wheel reaches
+* their slot, level 0 timers are fired. Arm, rearm and cancel are O(1), the
+* timerfd is armed for the next slot that has to be processed.
+*/
+#include "incrond-timer.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/timerfd.h>
+
+#include "incrond.h"
+
+struct timer_wheel {
+    uint64_t now;                               ///> last processed ms
+    uint64_t armed;                             ///> ms timerfd is armed for
+    uint64_t occupied[TIMER_WHEEL_LEVELS];      ///> non empty slots bitmap
+    struct list_head slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    int fd;                                     ///> timerfd
+    int initialized;
+};
+
+static struct timer_wheel wheel = {
+    .armed = UINT64_MAX,
+    .fd = -1,
+};
+
+uint64_t incron_timer_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void wheel_setup(uint64_t now)
+{
+    for(int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for(int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+            INIT_LIST_HEAD(&wheel.slots[level][slot]);
+
+    wheel.now = now;
+    wheel.initialized = 1;
+}
+
+int incron_timer_init()
+{
+    if(!wheel.initialized)
+        wheel_setup(incron_timer_now());
+
+    wheel.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    return wheel.fd;
+}
+
+static inline unsigned level_shift(unsigned level)
+{
+    return level * TIMER_WHEEL_BITS;
+}
+
+/** ms at which the wheel has to process something next */
+static uint64_t wheel_next()
+{
+    uint64_t next = UINT64_MAX;
+
+    for(unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t bitmap = wheel.occupied[level];
+
+        if(bitmap == 0)
+            continue;
+
+        unsigned shift = level_shift(level);
+        uint64_t unit = wheel.now >> shift;
+        unsigned cur = unit & TIMER_WHEEL_MASK;
+
+        /** rotate so bit 0 is the current slot */
+        if(cur != 0)
+            bitmap = (bitmap >> cur) | (bitmap << (TIMER_WHEEL_SLOTS - cur));
+
+        uint64_t at = (unit + __builtin_ctzll(bitmap)) << shift;
+        if(at < next)
+            next = at;
+    }
+
+    return next;
+}
+
+static void wheel_rearm()
+{
+    if(wheel.fd == -1)
+        return;
+
+    uint64_t next = wheel_next();
+    if(next == wheel.armed)
+        return;
+
+    struct itimerspec its = {0};
+
+    if(next != UINT64_MAX) {
+        its.it_value.tv_sec = next / 1000;
+        its.it_value.tv_nsec = (next % 1000) * 1000000;
+
+        /** zero it_value disarms timer */
+        if(next == 0)
+            its.it_value.tv_nsec = 1;
+    }
+
+    if(timerfd_settime(wheel.fd, TFD_TIMER_ABSTIME, &its, 0) == 0)
+        wheel.armed = next;
+}
+
+static void wheel_place(struct incron_timer* timer)
+{
+    uint64_t expires = timer->expires < wheel.now ? wheel.now : timer->expires;
+    unsigned level = 0;
+    unsigned shift = 0;
+
+    for(level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        shift = level_shift(level);
+        if((expires >> shift) - (wheel.now >> shift) < TIMER_WHEEL_SLOTS)
+            break;
+    }
+
+    /** beyond wheel range - park in the farthest slot, it is placed again from there */
+    if(level == TIMER_WHEEL_LEVELS) {
+        level = TIMER_WHEEL_LEVELS - 1;
+        shift = level_shift(level);
+        expires = ((wheel.now >> shift) + TIMER_WHEEL_SLOTS - 1) << shift;
+    }
+
+    unsigned slot = (expires >> shift) & TIMER_WHEEL_MASK;
+
+    list_add_tail(&(timer->list), &wheel.slots[level][slot]);
+    wheel.occupied[level] |= 1ULL << slot;
+
+    timer->level = level;
+    timer->slot = slot;
+}
+
+void incron_timer_setup(struct incron_timer* timer, incron_timer_func func)
+{
+    timer->expires = 0;
+    timer->func = func;
+    timer->level = 0;
+    timer->slot = 0;
+    INIT_LIST_HEAD(&(timer->list));
+}
+
+int incron_timer_pending(struct incron_timer* timer)
+{
+    return !list_empty(&(timer->list));
+}
+
+void incron_timer_cancel(struct incron_timer* timer)
+{
+    if(!incron_timer_pending(timer))
+        return;
+
+    list_del_init(&(timer->list));
+
+    /** timerfd is left as is, wakeup for empty wheel is harmless */
+    if(list_empty(&wheel.slots[timer->level][timer->slot]))
+        wheel.occupied[timer->level] &= ~(1ULL << timer->slot);
+}
+
+void incron_timer_arm_at(struct incron_timer* timer, uint64_t expires)
+{
+    if(!wheel.initialized)
+        wheel_setup(incron_timer_now());
+
+    incron_timer_cancel(timer);
+
+    timer->expires = expires;
+    wheel_place(timer);
+
+    wheel_rearm();
+}
+
+void incron_timer_arm(struct incron_timer* timer, uint64_t timeout_ms)
+{
+    incron_timer_arm_at(timer, incron_timer_now() + timeout_ms);
+}
+
+static void wheel_cascade(unsigned level)
+{
+    unsigned shift = level_shift(level);
+
+    if(wheel.now & ((1ULL << shift) - 1))
+        return;
+
+    unsigned slot = (wheel.now >> shift) & TIMER_WHEEL_MASK;
+
+    if(!(wheel.occupied[level] & (1ULL << slot)))
+        return;
+
+    LIST_HEAD(cascade);
+    list_splice_init(&wheel.slots[level][slot], &cascade);
+    wheel.occupied[level] &= ~(1ULL << slot);
+
+    while(!list_empty(&cascade)) {
+        struct incron_timer* timer = list_first_entry(&cascade, struct incron_timer, list);
+        list_del_init(&(timer->list));
+        wheel_place(timer);
+    }
+}
+
+unsigned long incron_timer_expire(uint64_t now)
+{
+    unsigned long fired = 0;
+
+    if(!wheel.initialized)
+        wheel_setup(now);
+
+    while(1) {
+        uint64_t next = wheel_next();
+
+        if(next > now)
+            break;
+
+        if(next > wheel.now)
+            wheel.now = next;
+
+        for(unsigned level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+            wheel_cascade(level);
+
+        unsigned slot = wheel.now & TIMER_WHEEL_MASK;
+
+        if(!(wheel.occupied[0] & (1ULL << slot)))
+            continue;
+
+        LIST_HEAD(expired);
+        list_splice_init(&wheel.slots[0][slot], &expired);
+        wheel.occupied[0] &= ~(1ULL << slot);
+
+        /** callbacks are free to arm or cancel any timer including this one */
+        while(!list_empty(&expired)) {
+            struct incron_timer* timer = list_first_entry(&expired, struct incron_timer, list);
+            list_del_init(&(timer->list));
+            timer->func(timer);
+            fired++;
+        }
+    }
+
+    if(now > wheel.now)
+        wheel.now = now;
+
+    wheel_rearm();
+
+    return fired;
+}
+
+int handle_timers()
+{
+    uint64_t expirations;
+
+    /** drain timerfd, expiration count itself is of no interest */
+    while(read(wheel.fd, &expirations, sizeof(expirations)) > 0);
+
+    /** one shot timer has gone off */
+    wheel.armed = UINT64_MAX;
+
+    if(incron_timer_expire(incron_timer_now()) == 0)
+        debug_printf_n("spurious timer wakeup");
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __INCROND_TIMER_H__
+#define __INCROND_TIMER_H__
+
+#include <stdint.h>
+
+#include "list.h"
+
+/** hierarchical timing wheel with millisecond resolution */
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS  4
+
+struct incron_timer;
+
+typedef void (*incron_timer_func)(struct incron_timer*);
+
+struct incron_timer {
+    uint64_t expires;           ///> CLOCK_MONOTONIC ms
+    incron_timer_func func;     ///> called once timer expires
+    uint8_t level;              ///> wheel level timer is placed at
+    uint8_t slot;               ///> wheel slot timer is placed at
+    struct list_head list;      ///> wheel slot entry, empty if timer is not pending
+};
+
+int incron_timer_init();
+uint64_t incron_timer_now();
+
+void incron_timer_setup(struct incron_timer* /*timer*/, incron_timer_func /*func*/);
+void incron_timer_arm(struct incron_timer* /*timer*/, uint64_t /*timeout_ms*/);
+void incron_timer_arm_at(struct incron_timer* /*timer*/, uint64_t /*expires*/);
+void incron_timer_cancel(struct incron_timer* /*timer*/);
+int incron_timer_pending(struct incron_timer* /*timer*/);
+
+unsigned long incron_timer_expire(uint64_t /*now*/);
+int handle_timers();
+
+#endif
@@ -24,6 +24,9 @@
 #include "incrond-loop.h"
 #include "incrond-config.h"
 #include "incrond-parse-tabs.h"
+#include "incrond-spawner.h"
+#include "incrond-cgroup.h"
+#include "incrond-tabcache.h"
 
 static int verbose_flag = 0;
 static int no_daemon_flag = 0;
@@ -249,34 +252,58 @@ int main(int argc, char ** argv)
     }
 
     /** get sigfd */
-    sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
 
     /** set log level */
     setlogmask(LOG_UPTO(log_level));
 
-    ret = loadSystemTabs(system_table_dir_fd);
-    if(ret == -1) {
+    /** helper is forked before tabs are loaded, so it stays small */
+    if(spawn_helper && spawner_start(sigfd) == -1) {
         errsv = errno;
-        syslog(LOG_CRIT, "loading system tabs failed with %d:%s", errsv, strerror(errsv));
-        goto unlink_pid;
+        syslog(LOG_WARNING, "starting spawn helper failed with %d:%s, hooks are spawned by daemon", errsv, strerror(errsv));
     }
 
+    /** failure only leaves hooks in daemon cgroup */
+    cgroup_init();
+
     loadUsers();
 
     user_table_dir_fd = check_spool_dir(user_table_dir);
     if(user_table_dir_fd == -1) {
         errsv = errno;
         syslog(LOG_CRIT, "loading users tabs at %s failed with %d:%s", user_table_dir, errsv, strerror(errsv));
+    }
+
+    /** tabs unchanged since snapshot was written aren't parsed again */
+    if(tab_cache[0] != '\0') {
+        ret = tabcache_load(system_table_dir_fd, user_table_dir_fd);
+        if(ret == -1) {
+            errsv = errno;
+            syslog(LOG_CRIT, "loading tabs failed with %d:%s", errsv, strerror(errsv));
+            goto unlink_pid;
+        }
     } else {
-        ret = loadUserTabs(user_table_dir_fd);
+        ret = loadSystemTabs(system_table_dir_fd);
         if(ret == -1) {
             errsv = errno;
-            syslog(LOG_CRIT, "loading users tabs at %s failed with %d:%s", user_table_dir, errsv, strerror(errsv));
+            syslog(LOG_CRIT, "loading system tabs failed with %d:%s", errsv, strerror(errsv));
+            goto unlink_pid;
+        }
+
+        if(user_table_dir_fd != -1) {
+            ret = loadUserTabs(user_table_dir_fd);
+            if(ret == -1) {
+                errsv = errno;
+                syslog(LOG_CRIT, "loading users tabs at %s failed with %d:%s", user_table_dir, errsv, strerror(errsv));
+            }
         }
     }
 
     ret = loop(sigfd);
 
+    spawner_stop();
+    cgroup_cleanup();
+
     unlink_pid:
     unlinkat(lockfile_dir_fd, pidFile, 0);
 
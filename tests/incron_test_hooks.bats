@@ -264,3 +264,31 @@ compare_files() {
     compare_files ${TAB_NAME} ${LOG_NAME} 2
     [ $? -eq 0 ]
 }
+
+@test "tab_reload" {
+    TAB_NAME=etc/incron.d/hook_reload
+    LOG_NAME=log/RELOAD.log
+
+    mkdir -p tmp/watch_RELOAD
+    echo "$(pwd)/tmp/watch_RELOAD IN_CREATE echo \$@ \$# \$% >> $(pwd)/${LOG_NAME}" > ${TAB_NAME}
+
+    # tab is reloaded once it is quiet
+    sleep 0.5
+    touch tmp/watch_RELOAD/added
+
+    wait_for_file ${LOG_NAME} 10
+    found=$?
+
+    rm -f ${TAB_NAME}
+    sleep 0.5
+    touch tmp/watch_RELOAD/removed
+    sleep 0.2
+
+    [ $found -eq 0 ]
+
+    fn=$(sed -n 1p ${LOG_NAME} | awk '{ print $2 }')
+    [ "$fn" == "added" ]
+
+    # removed tab doesn't fire anymore
+    [ $(wc -l < ${LOG_NAME}) -eq 1 ]
+}
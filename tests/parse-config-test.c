@@ -4,6 +4,7 @@
 
 #include <syslog.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "../src/incrond-config.c"
 
@@ -15,6 +16,23 @@ static char* test_config[] = {
     "lockfile_dir = var/run\n",
     "lockfile_name = incrond\n",
     "editor = vim\n",
+    "inotify_read_max = 65536\n",
+    "overflow_rescan = 0\n",
+    "crawl_threads = 4\n",
+    "load_threads = 8\n",
+    "event_backend = fanotify\n",
+    "inotify_instances = 2\n",
+    "spawn_method = fork\n",
+    "spawn_helper = 0\n",
+    "spawn_rate = 200\n",
+    "spawn_burst = 50\n",
+    "user_spawn_rate = 20\n",
+    "user_spawn_burst = 10\n",
+    "cgroup_root = /sys/fs/cgroup/incron\n",
+    "cgroup_cpu_max = 50000/100000\n",
+    "cgroup_memory_max = 512M\n",
+    "cgroup_io_weight = 50\n",
+    "tab_cache = /var/lib/incron/tabs.cache\n",
     0
 };
 
@@ -27,6 +45,106 @@ START_TEST (parse_config)
         ck_assert_msg(ret == 0, "parsing %s failed", test_config[0]);
         i++;
     }
+
+    ck_assert_uint_eq(inotify_read_max, 65536);
+    ck_assert_int_eq(overflow_rescan, 0);
+    ck_assert_int_eq(crawl_threads, 4);
+    ck_assert_int_eq(event_backend, EVENT_BACKEND_FANOTIFY);
+    ck_assert_uint_eq(inotify_instances, 2);
+    ck_assert_int_eq(spawn_method, SPAWN_FORK);
+    ck_assert_int_eq(spawn_helper, 0);
+    ck_assert_uint_eq(spawn_rate, 200);
+    ck_assert_uint_eq(spawn_burst, 50);
+    ck_assert_uint_eq(user_spawn_rate, 20);
+    ck_assert_uint_eq(user_spawn_burst, 10);
+    ck_assert_str_eq(cgroup_root, "/sys/fs/cgroup/incron");
+    ck_assert_str_eq(cgroup_cpu_max, "50000 100000");
+    ck_assert_str_eq(cgroup_memory_max, "512M");
+    ck_assert_uint_eq(cgroup_io_weight, 50);
+    ck_assert_str_eq(tab_cache, "/var/lib/incron/tabs.cache");
+    ck_assert_int_eq(load_threads, 8);
+}
+END_TEST
+
+/** rejected value leaves option as it was */
+#define ck_assert_invalid(set, value) do { \
+    errno = 0; \
+    ck_assert_int_eq(set(value, true), -1); \
+    ck_assert_int_eq(errno, EINVAL); \
+} while(0)
+
+START_TEST (parse_config_invalid)
+{
+    ck_assert_int_eq(set_inotify_read_max("4096", true), 0);
+    ck_assert_invalid(set_inotify_read_max, "64k");
+    ck_assert_invalid(set_inotify_read_max, "");
+    ck_assert_invalid(set_inotify_read_max, "-1");
+    ck_assert_invalid(set_inotify_read_max, "99999999999999999999");
+    ck_assert_uint_eq(inotify_read_max, 4096);
+
+    ck_assert_int_eq(set_overflow_rescan("1", true), 0);
+    ck_assert_invalid(set_overflow_rescan, "yes");
+    ck_assert_int_eq(overflow_rescan, 1);
+
+    ck_assert_int_eq(set_crawl_threads("2", true), 0);
+    ck_assert_invalid(set_crawl_threads, "-1");
+    ck_assert_invalid(set_crawl_threads, "257");
+    ck_assert_invalid(set_crawl_threads, "4x");
+    ck_assert_int_eq(crawl_threads, 2);
+
+    ck_assert_int_eq(set_event_backend("inotify", true), 0);
+    ck_assert_invalid(set_event_backend, "dnotify");
+    ck_assert_invalid(set_event_backend, "");
+    ck_assert_int_eq(event_backend, EVENT_BACKEND_INOTIFY);
+
+    ck_assert_int_eq(set_inotify_instances("1", true), 0);
+    ck_assert_invalid(set_inotify_instances, "0");
+    ck_assert_invalid(set_inotify_instances, "65");
+    ck_assert_uint_eq(inotify_instances, 1);
+
+    ck_assert_int_eq(set_spawn_method("clone", true), 0);
+    ck_assert_invalid(set_spawn_method, "vfork");
+    ck_assert_int_eq(spawn_method, SPAWN_CLONE);
+
+    ck_assert_int_eq(set_spawn_helper("1", true), 0);
+    ck_assert_invalid(set_spawn_helper, "off");
+    ck_assert_int_eq(spawn_helper, 1);
+
+    ck_assert_int_eq(set_spawn_rate("100", true), 0);
+    ck_assert_invalid(set_spawn_rate, "-5");
+    ck_assert_invalid(set_spawn_rate, "1000001");
+    ck_assert_invalid(set_spawn_rate, "10/s");
+    ck_assert_uint_eq(spawn_rate, 100);
+    ck_assert_invalid(set_spawn_burst, "-1");
+    ck_assert_invalid(set_user_spawn_rate, "1000001");
+    ck_assert_invalid(set_user_spawn_burst, "x");
+
+    ck_assert_invalid(set_cgroup_root, "sys/fs/cgroup");
+
+    ck_assert_int_eq(set_cgroup_cpu_max("20000", true), 0);
+    ck_assert_str_eq(cgroup_cpu_max, "20000 100000");
+    ck_assert_int_eq(set_cgroup_cpu_max("max", true), 0);
+    ck_assert_invalid(set_cgroup_cpu_max, "50000/");
+    ck_assert_invalid(set_cgroup_cpu_max, "half");
+    ck_assert_invalid(set_cgroup_cpu_max, "-1");
+    ck_assert_invalid(set_cgroup_cpu_max, "50000/-1");
+    ck_assert_str_eq(cgroup_cpu_max, "max");
+
+    ck_assert_invalid(set_cgroup_memory_max, "512T");
+    ck_assert_invalid(set_cgroup_memory_max, "12MB");
+    ck_assert_invalid(set_cgroup_memory_max, "-1");
+    ck_assert_invalid(set_cgroup_memory_max, "-1G");
+    ck_assert_invalid(set_cgroup_io_weight, "10001");
+
+    ck_assert_invalid(set_tab_cache, "tabs.cache");
+    ck_assert_int_eq(set_tab_cache("", true), 0);
+    ck_assert_str_eq(tab_cache, "");
+
+    ck_assert_int_eq(set_load_threads("0", true), 0);
+    ck_assert_invalid(set_load_threads, "300");
+    ck_assert_invalid(set_load_threads, "-1");
+    ck_assert_invalid(set_load_threads, "many");
+    ck_assert_int_eq(load_threads, 0);
 }
 END_TEST
 
@@ -35,6 +153,7 @@ Suite * parse_config_suite(void)
 {
     Suite *s;
     TCase *tc_parse_config;
+    TCase *tc_parse_config_invalid;
 
     s = suite_create("Testing config parsing function");
 
@@ -42,6 +161,10 @@ Suite * parse_config_suite(void)
     tcase_add_test(tc_parse_config, parse_config);
     suite_add_tcase(s, tc_parse_config);
 
+    tc_parse_config_invalid = tcase_create("reject invalid config values");
+    tcase_add_test(tc_parse_config_invalid, parse_config_invalid);
+    suite_add_tcase(s, tc_parse_config_invalid);
+
     return s;
 }
 
@@ -7,7 +7,9 @@
 
 #include "../src/cmdline.c"
 #include "../src/incrond-config.c"
+#include "../src/incrond-arena.c"
 #include "../src/incrond-parse-tabs.c"
+#include "../src/incrond-tabcache.c"
 
 static char* test_string[] = {
     "/tmp\tIN_ALL_EVENTS\tabcd $@/$# $%",
@@ -36,11 +38,582 @@ START_TEST (legacy_tables_parse)
 }
 END_TEST
 
+static char* test_options[] = {
+    "/tmp\tIN_MODIFY,IN_DELAY=250\tabcd $@/$#",
+    "/tmp\tIN_MODIFY,IN_DELAY=abc\tabcd $@/$#",
+    "/tmp\tIN_MODIFY,IN_MAX_SPAWN=2,IN_QUEUE=8,IN_OVERFLOW=coalesce\tabcd $@/$#",
+    "/tmp\tIN_MODIFY,IN_MAX_SPAWN=1,IN_OVERFLOW=abc\tabcd $@/$#",
+    "/tmp\tIN_MODIFY,IN_NO_LOOP=500\tabcd $@/$#",
+    "/tmp\tIN_CLOSE_WRITE,IN_BATCH=100,IN_BATCH_MS=500\tabcd $#",
+    "/tmp\tIN_MODIFY,IN_NO_LOOP=0\tabcd $@/$#",
+    "/tmp\tIN_MODIFY,IN_NO_LOOP=abc\tabcd $@/$#",
+};
+
+START_TEST (tables_parse_options)
+{
+    struct incron_hook* hook = 0;
+
+    hook = loadTabLine(0, test_options[0], strlen(test_options[0]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_options[0]);
+    ck_assert_uint_eq(hook->delay, 250);
+    ck_assert_uint_eq(hook->flags & IN_MODIFY, IN_MODIFY);
+
+    /** malformed value is ignored */
+    hook = loadTabLine(1, test_options[1], strlen(test_options[1]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_options[1]);
+    ck_assert_uint_eq(hook->delay, 0);
+    ck_assert_uint_eq(hook->max_spawn, 0);
+
+    hook = loadTabLine(2, test_options[2], strlen(test_options[2]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_options[2]);
+    ck_assert_uint_eq(hook->max_spawn, 2);
+    ck_assert_uint_eq(hook->queue_max, 8);
+    ck_assert_uint_eq(hook->overflow, OVERFLOW_COALESCE);
+
+    /** unknown policy keeps default */
+    hook = loadTabLine(3, test_options[3], strlen(test_options[3]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_options[3]);
+    ck_assert_uint_eq(hook->max_spawn, 1);
+    ck_assert_uint_eq(hook->queue_max, HOOK_QUEUE_DEFAULT);
+    ck_assert_uint_eq(hook->overflow, OVERFLOW_DROP_OLDEST);
+
+    hook = loadTabLine(4, test_options[4], strlen(test_options[4]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_options[4]);
+    ck_assert_uint_eq(hook->iflags, IN_NO_LOOP);
+    ck_assert_uint_eq(hook->loop_grace, 500);
+
+    hook = loadTabLine(5, test_options[5], strlen(test_options[5]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_options[5]);
+    ck_assert_uint_eq(hook->batch_max, 100);
+    ck_assert_uint_eq(hook->batch_ms, 500);
+    ck_assert_ptr_eq(hook->batch, 0);
+
+    /** zero grace still suppresses events while hook runs */
+    hook = loadTabLine(6, test_options[6], strlen(test_options[6]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_options[6]);
+    ck_assert_uint_eq(hook->iflags, IN_NO_LOOP);
+    ck_assert_uint_eq(hook->loop_grace, 0);
+
+    hook = loadTabLine(7, test_options[7], strlen(test_options[7]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_options[7]);
+    ck_assert_uint_eq(hook->iflags, 0);
+
+    freeTabs();
+}
+END_TEST
+
+static char* test_modifiers[] = {
+    "/tmp\tIN_CLOSE_WRITE,IN_STREAM\tcat",
+    "/tmp\tIN_CREATE,IN_RECURSIVE,IN_NO_LOOP\tabcd $@/$#",
+};
+
+START_TEST (tables_parse_modifiers)
+{
+    struct incron_hook* hook = 0;
+
+    hook = loadTabLine(0, test_modifiers[0], strlen(test_modifiers[0]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_modifiers[0]);
+    ck_assert_uint_eq(hook->iflags, IN_STREAM);
+    ck_assert_uint_eq(hook->flags & IN_ALL_EVENTS, IN_CLOSE_WRITE);
+    ck_assert_ptr_eq(hook->stream, 0);
+
+    hook = loadTabLine(1, test_modifiers[1], strlen(test_modifiers[1]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_modifiers[1]);
+    ck_assert_uint_eq(hook->iflags, IN_RECURSIVE | IN_NO_LOOP);
+    ck_assert_uint_eq(hook->flags & IN_ALL_EVENTS, IN_CREATE);
+
+    freeTabs();
+}
+END_TEST
+
+static char* test_direct[] = {
+    "/tmp\tIN_CREATE\t/bin/sh $@/$#",
+    "/tmp\tIN_CREATE\tsh -c true",
+    "/tmp\tIN_CREATE\t/bin/sh $@/$# | cat",
+    "/tmp\tIN_CREATE\t/bin/sh \"$#\"",
+    "/tmp\tIN_CREATE\tno-such-command-abcd $#",
+    "/tmp\tIN_CREATE\tcd $@",
+    "/tmp\tIN_CREATE\tcommand ls $@",
+};
+
+START_TEST (tables_parse_direct)
+{
+    struct incron_hook* hook = 0;
+
+    hook = loadTabLine(0, test_direct[0], strlen(test_direct[0]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_direct[0]);
+    ck_assert_int_eq(hook->direct, 1);
+    ck_assert_str_eq(hook->command, "/bin/sh");
+
+    /** looked up in PATH */
+    hook = loadTabLine(1, test_direct[1], strlen(test_direct[1]));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_direct[1]);
+    ck_assert_int_eq(hook->direct, 1);
+    ck_assert_msg(hook->command[0] == '/', "%s isn't resolved", hook->command);
+
+    for(int i = 2; i < 7; i++) {
+        hook = loadTabLine(i, test_direct[i], strlen(test_direct[i]));
+        ck_assert_msg(hook != 0, "parsing %s failed", test_direct[i]);
+        ck_assert_msg(hook->direct == 0, "%s isn't run by shell", test_direct[i]);
+        ck_assert_str_eq(hook->command, "/bin/bash");
+    }
+
+    freeTabs();
+}
+END_TEST
+
+START_TEST (tables_resolve_user)
+{
+    char dir[] = "/tmp/incron-path-XXXXXX";
+    char exe[sizeof(dir) + 16];
+    char* path_env = strdup(getenv("PATH"));
+
+    ck_assert_ptr_ne(mkdtemp(dir), 0);
+    snprintf(exe, sizeof(exe), "%s/incron-exec", dir);
+
+    int fd = open(exe, O_WRONLY | O_CREAT, 0700);
+    ck_assert_int_ne(fd, -1);
+    close(fd);
+
+    setenv("PATH", dir, 1);
+
+    struct incron_arena* arena = arena_new();
+
+    /** daemon itself can run it, nobody can't */
+    ck_assert_ptr_ne(tab_resolve_command(arena, "incron-exec", -1, -1), 0);
+    ck_assert_ptr_eq(tab_resolve_command(arena, "incron-exec", 65534, 65534), 0);
+
+    /** directory in PATH has to be searchable too */
+    chmod(exe, 0755);
+    ck_assert_ptr_eq(tab_resolve_command(arena, "incron-exec", 65534, 65534), 0);
+
+    chmod(dir, 0755);
+    ck_assert_str_eq(tab_resolve_command(arena, "incron-exec", 65534, 65534), exe);
+    ck_assert(tabCanExec(exe, 65534, 65534));
+
+    /** group not sure to be the only one, other bits alone aren't trusted */
+    chmod(exe, 0701);
+    ck_assert(!tabCanExec(exe, 65534, 65534));
+
+    arena_put(arena);
+    setenv("PATH", path_env, 1);
+    free(path_env);
+    unlink(exe);
+    rmdir(dir);
+}
+END_TEST
+
+static char* test_template = "/tmp\tIN_CREATE\tabcd $@/$#.bak $^ $x";
+
+START_TEST (tables_parse_template)
+{
+    struct incron_hook* hook = 0;
+
+    hook = loadTabLine(0, test_template, strlen(test_template));
+    ck_assert_msg(hook != 0, "parsing %s failed", test_template);
+
+    struct incron_hook_template* tpl = &(hook->tpl);
+
+    /** literal text of all arguments without $ arguments, unknown $x kept */
+    ck_assert_str_eq(tpl->text, "abcd/.bak$x");
+    ck_assert_uint_eq(tpl->literal_len, strlen("abcd/.bak$x"));
+    ck_assert_uint_eq(tpl->seg_cnt, 7);
+
+    ck_assert_uint_eq(tpl->arg_cnt[TAB_ARG_PATH], 1);
+    ck_assert_uint_eq(tpl->arg_cnt[TAB_ARG_EVENT_FILENAME], 1);
+    ck_assert_uint_eq(tpl->arg_cnt[TAB_ARG_EVENT_TIME], 1);
+    ck_assert_uint_eq(tpl->arg_cnt[TAB_ARG_EVENT_TEXT], 0);
+
+    ck_assert_uint_eq(tpl->segs[2].arg, TAB_ARG_EVENT_FILENAME);
+    ck_assert_uint_eq(tpl->segs[2].len, 1);
+    ck_assert_uint_eq(tpl->segs[3].len, 4);
+    ck_assert_uint_eq(tpl->segs[3].last, 1);
+
+    freeTabs();
+}
+END_TEST
+
+static char* test_reload[] = {
+    "/tmp\tIN_CREATE,IN_MAX_SPAWN=2\tabcd $@/$#",
+    "/tmp\tIN_CREATE,IN_MAX_SPAWN=2\tabcd $@/$#",
+    "/tmp\tIN_CREATE,IN_MAX_SPAWN=3\tabcd $@/$#",
+    "/tmp\tIN_CREATE,IN_MAX_SPAWN=2\tabcd $@",
+    "/var/tmp\tIN_CREATE,IN_MAX_SPAWN=2\tabcd $@/$#",
+};
+
+START_TEST (tables_hook_equal)
+{
+    struct incron_hook* hooks[5] = {0};
+
+    for(int i = 0; i < 5; i++) {
+        hooks[i] = loadTabLine(i, test_reload[i], strlen(test_reload[i]));
+        ck_assert_msg(hooks[i] != 0, "parsing %s failed", test_reload[i]);
+    }
+
+    /** the same line on the same path is kept on reload */
+    ck_assert_ptr_eq(hooks[0]->path, hooks[1]->path);
+    ck_assert(hookEqual(hooks[0], hooks[1]));
+
+    /** option, command or path change replaces hook */
+    ck_assert(!hookEqual(hooks[0], hooks[2]));
+    ck_assert(!hookEqual(hooks[0], hooks[3]));
+    ck_assert(!hookEqual(hooks[0], hooks[4]));
+
+    /** hook added by reload moves out of parsed tab arena */
+    struct incron_arena* arena = arena_new();
+    struct incron_hook* copy = hookCopy(arena, hooks[0]);
+
+    ck_assert_ptr_ne(copy, 0);
+    ck_assert_ptr_eq(copy->arena, arena);
+    ck_assert_uint_eq(arena->refs, 2);
+    ck_assert(hookEqual(hooks[0], copy));
+    ck_assert_ptr_ne(copy->argv[0], hooks[0]->argv[0]);
+    ck_assert_str_eq(copy->tpl.text, hooks[0]->tpl.text);
+    ck_assert_ptr_ne(copy->tpl.text, hooks[0]->tpl.text);
+    ck_assert_uint_eq(copy->tpl.segs[1].arg, TAB_ARG_PATH);
+
+    freeHook(copy);
+    arena_put(arena);
+
+    /** flags are rebuilt once hook is gone */
+    hooks[0]->path->flags |= IN_DELETE;
+    pathUpdateFlags(hooks[0]->path);
+    ck_assert_uint_eq(hooks[0]->path->flags, IN_CREATE | IN_IGNORED);
+
+    freeTabs();
+}
+END_TEST
+
+static char* test_index[] = {
+    "/srv\tIN_CREATE\tabcd $#",
+    "/srv\tIN_CREATE,IN_DELETE\tabcd $@",
+    "/srv\tIN_DELETE\tabcd $%",
+    "/srv\tIN_MODIFY\tabcd $@/$#",
+};
+
+START_TEST (tables_hook_index)
+{
+    struct incron_hook* hooks[4] = {0};
+    unsigned create = __builtin_ctz(IN_CREATE);
+    unsigned delete = __builtin_ctz(IN_DELETE);
+
+    for(int i = 0; i < 4; i++) {
+        hooks[i] = loadTabLine(i, test_index[i], strlen(test_index[i]));
+        ck_assert_msg(hooks[i] != 0, "parsing %s failed", test_index[i]);
+    }
+
+    struct incron_path* path = hooks[0]->path;
+    ck_assert_ptr_eq(path->index, 0);
+
+    struct incron_hook_index* index = pathHookIndex(path);
+    ck_assert_ptr_ne(index, 0);
+    ck_assert_uint_eq(index->hook_cnt, 4);
+
+    /** slots of every bit follow hook_list order */
+    ck_assert_uint_eq(index->bit_off[create + 1] - index->bit_off[create], 2);
+    ck_assert_ptr_eq(index->hooks[index->slots[index->bit_off[create]]], hooks[0]);
+    ck_assert_ptr_eq(index->hooks[index->slots[index->bit_off[create] + 1]], hooks[1]);
+
+    ck_assert_uint_eq(index->bit_off[delete + 1] - index->bit_off[delete], 2);
+    ck_assert_ptr_eq(index->hooks[index->slots[index->bit_off[delete]]], hooks[1]);
+    ck_assert_ptr_eq(index->hooks[index->slots[index->bit_off[delete] + 1]], hooks[2]);
+
+    /** built once, dropped when hooks of path change */
+    ck_assert_ptr_eq(pathHookIndex(path), index);
+
+    list_del(&(hooks[3]->list));
+    pathUpdateFlags(path);
+    ck_assert_ptr_eq(path->index, 0);
+
+    index = pathHookIndex(path);
+    ck_assert_uint_eq(index->hook_cnt, 3);
+
+    pathAddHook(path, hooks[3]);
+    ck_assert_ptr_eq(path->index, 0);
+
+    freeTabs();
+}
+END_TEST
+
+#define TEST_LOAD_TABS 16
+
+START_TEST (tables_load_parallel)
+{
+    char dir[] = "/tmp/incron-load-XXXXXX";
+    char* names[TEST_LOAD_TABS + 1];
+    int results[TEST_LOAD_TABS + 1];
+
+    ck_assert_ptr_ne(mkdtemp(dir), 0);
+
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    ck_assert_int_ne(dirfd, -1);
+
+    for(int i = 0; i < TEST_LOAD_TABS; i++) {
+        ck_assert_int_ne(asprintf(&names[i], "tab%02d", i), -1);
+
+        FILE* f = fdopen(openat(dirfd, names[i], O_WRONLY | O_CREAT, 0644), "w");
+        ck_assert_ptr_ne(f, 0);
+        fprintf(f, "/tmp\tIN_CREATE\tabcd %d $#\n/tmp/%d\tIN_DELETE\tabcd $@\n", i, i);
+        fclose(f);
+    }
+
+    /** missing tab fails alone */
+    names[TEST_LOAD_TABS] = strdup("missing");
+
+    load_threads = 4;
+    ck_assert_int_eq(loadTabFiles(dirfd, TAB_SYSTEM, names, results, TEST_LOAD_TABS + 1), 0);
+
+    for(int i = 0; i < TEST_LOAD_TABS; i++) {
+        struct incron_tab* tab = 0;
+        struct list_head* pos = 0;
+        int hooks = 0;
+
+        ck_assert_int_eq(results[i], 0);
+
+        HASH_FIND_STR(incron_tabs[TAB_SYSTEM], names[i], tab);
+        ck_assert_ptr_ne(tab, 0);
+
+        list_for_each(pos, &(tab->hooks))
+            hooks++;
+
+        ck_assert_int_eq(hooks, 2);
+
+        /** tab hooks share one arena referenced by each of them */
+        struct incron_hook* first = list_first_entry(&(tab->hooks), struct incron_hook, tab_list);
+        struct incron_hook* last = list_entry(tab->hooks.prev, struct incron_hook, tab_list);
+        ck_assert_ptr_eq(first->arena, last->arena);
+        ck_assert_uint_eq(first->arena->refs, 2);
+    }
+
+    ck_assert_int_eq(results[TEST_LOAD_TABS], -1);
+
+    /** hooks are attached in names order whatever thread parsed them */
+    struct incron_path* path = findPath("/tmp", 4);
+    struct incron_hook* hook = 0;
+    int i = 0;
+
+    list_for_each_entry(hook, &(path->hook_list), list) {
+        ck_assert_str_eq(hook->tab, names[i]);
+        ck_assert_uint_eq(hook->pw_uid, getuid());
+        i++;
+    }
+
+    ck_assert_int_eq(i, TEST_LOAD_TABS);
+
+    for(i = 0; i <= TEST_LOAD_TABS; i++) {
+        unlinkat(dirfd, names[i], 0);
+        free(names[i]);
+    }
+
+    close(dirfd);
+    rmdir(dir);
+    freeTabs();
+}
+END_TEST
+
+static char* test_cache[] = {
+    "/tmp\tIN_CREATE,IN_DELAY=250\tabcd $@/$# $%",
+    "/tmp\tIN_DELETE,IN_MAX_SPAWN=2,IN_OVERFLOW=coalesce\tls $@/$#",
+    "/var/tmp\tIN_MODIFY,IN_NO_LOOP=500\techo \"$#\" | cat",
+    "/var/tmp\tIN_CLOSE_WRITE,IN_BATCH=10\tcat",
+};
+
+#define TEST_CACHE_HOOKS (sizeof(test_cache) / sizeof(test_cache[0]))
+
+/** snapshot is bound to tab directories, users files are missing */
+static int cache_setup(char* dir)
+{
+    ck_assert_ptr_ne(mkdtemp(dir), 0);
+
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    ck_assert_int_ne(dirfd, -1);
+
+    system_table_dir = user_table_dir = dir;
+    allowed_users_file = denied_users_file = "/nonexistent";
+
+    /** dot files aren't tabs */
+    snprintf(tab_cache, sizeof(tab_cache), "%s/.tabs.cache", dir);
+
+    return dirfd;
+}
+
+static void cache_cleanup(int dirfd, const char* dir)
+{
+    unlinkat(dirfd, "tab", 0);
+    unlinkat(dirfd, ".tabs.cache", 0);
+    close(dirfd);
+    rmdir(dir);
+
+    system_table_dir = user_table_dir = allowed_users_file = denied_users_file = 0;
+    tab_cache[0] = '\0';
+}
+
+static void write_cache_tab(int dirfd)
+{
+    FILE* f = fdopen(openat(dirfd, "tab", O_WRONLY | O_CREAT | O_TRUNC, 0644), "w");
+    ck_assert_ptr_ne(f, 0);
+
+    for(size_t i = 0; i < TEST_CACHE_HOOKS; i++)
+        fprintf(f, "%s\n", test_cache[i]);
+
+    fclose(f);
+}
+
+static int cache_tab_hooks(struct incron_hook** hooks)
+{
+    struct incron_tab* tab = 0;
+    struct incron_hook* hook = 0;
+    int cnt = 0;
+
+    HASH_FIND_STR(incron_tabs[TAB_SYSTEM], "tab", tab);
+    ck_assert_ptr_ne(tab, 0);
+
+    list_for_each_entry(hook, &(tab->hooks), tab_list) {
+        ck_assert(cnt < (int)TEST_CACHE_HOOKS);
+        hooks[cnt++] = hook;
+    }
+
+    return cnt;
+}
+
+/** cached hook has to expand exactly like freshly parsed one */
+static void ck_assert_hook_same(const struct incron_hook* a, const struct incron_hook* b)
+{
+    ck_assert_uint_eq(a->flags, b->flags);
+    ck_assert_uint_eq(a->iflags, b->iflags);
+    ck_assert_uint_eq(a->delay, b->delay);
+    ck_assert_uint_eq(a->max_spawn, b->max_spawn);
+    ck_assert_uint_eq(a->overflow, b->overflow);
+    ck_assert_uint_eq(a->loop_grace, b->loop_grace);
+    ck_assert_uint_eq(a->batch_max, b->batch_max);
+    ck_assert_uint_eq(a->pw_uid, b->pw_uid);
+    ck_assert_uint_eq(a->pw_gid, b->pw_gid);
+
+    ck_assert_int_eq(a->argc, b->argc);
+    for(int i = 0; i < a->argc; i++)
+        ck_assert_str_eq(a->argv[i], b->argv[i]);
+
+    ck_assert_int_eq(a->direct, b->direct);
+    ck_assert_str_eq(a->command, b->command);
+
+    ck_assert_uint_eq(a->tpl.seg_cnt, b->tpl.seg_cnt);
+    ck_assert_uint_eq(a->tpl.literal_len, b->tpl.literal_len);
+    ck_assert_int_eq(memcmp(a->tpl.arg_cnt, b->tpl.arg_cnt, sizeof(a->tpl.arg_cnt)), 0);
+    ck_assert_int_eq(memcmp(a->tpl.segs, b->tpl.segs, a->tpl.seg_cnt * sizeof(struct incron_hook_seg)), 0);
+    ck_assert_int_eq(memcmp(a->tpl.text, b->tpl.text, a->tpl.literal_len), 0);
+}
+
+START_TEST (tables_cache_reuse)
+{
+    char dir[] = "/tmp/incron-cache-XXXXXX";
+    struct incron_hook* fresh[TEST_CACHE_HOOKS];
+    struct incron_hook* cached[TEST_CACHE_HOOKS];
+
+    int dirfd = cache_setup(dir);
+    write_cache_tab(dirfd);
+
+    /** first start parses and writes snapshot */
+    ck_assert_int_eq(tabcache_load(dirfd, -1), 0);
+    ck_assert_uint_eq(reused, 0);
+    ck_assert_int_eq(cache_tab_hooks(fresh), TEST_CACHE_HOOKS);
+
+    /** direct and shell commands are both covered */
+    ck_assert_int_eq(fresh[1]->direct, 1);
+    ck_assert_int_eq(fresh[2]->direct, 0);
+
+    /** parsed hooks outlive their tab for comparison */
+    arena_get(fresh[0]->arena);
+    freeTabs();
+
+    ck_assert_int_eq(tabcache_load(dirfd, -1), 0);
+    ck_assert_uint_eq(reused, 1);
+    ck_assert_int_eq(cache_tab_hooks(cached), TEST_CACHE_HOOKS);
+
+    for(size_t i = 0; i < TEST_CACHE_HOOKS; i++) {
+        /** taken from mapping, not parsed again */
+        ck_assert(cached[i]->tpl.text >= cache_map && cached[i]->tpl.text < cache_map + cache_size);
+        ck_assert_hook_same(fresh[i], cached[i]);
+    }
+
+    freeTabs();
+    arena_put(fresh[0]->arena);
+
+    cache_cleanup(dirfd, dir);
+}
+END_TEST
+
+/** snapshot has to be ignored, tab is still parsed */
+static void ck_assert_cache_rejected(int dirfd)
+{
+    struct incron_hook* hooks[TEST_CACHE_HOOKS];
+
+    ck_assert_int_eq(tabcache_load(dirfd, -1), 0);
+    ck_assert_uint_eq(reused, 0);
+    ck_assert_int_eq(cache_tab_hooks(hooks), TEST_CACHE_HOOKS);
+    freeTabs();
+}
+
+START_TEST (tables_cache_reject)
+{
+    char dir[] = "/tmp/incron-cache-XXXXXX";
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 1, 0 } };
+    struct stat st;
+
+    int dirfd = cache_setup(dir);
+    write_cache_tab(dirfd);
+
+    ck_assert_int_eq(tabcache_load(dirfd, -1), 0);
+    freeTabs();
+
+    /** same contents, but tab file changed since snapshot */
+    ck_assert_int_eq(utimensat(dirfd, "tab", times, 0), 0);
+    ck_assert_cache_rejected(dirfd);
+
+    /** rewritten snapshot matches again */
+    ck_assert_int_eq(tabcache_load(dirfd, -1), 0);
+    ck_assert_uint_eq(reused, 1);
+    freeTabs();
+
+    /** flipped byte past header fails checksum */
+    ck_assert_int_eq(stat(tab_cache, &st), 0);
+
+    int fd = open(tab_cache, O_RDWR);
+    unsigned char c = 0;
+
+    ck_assert_int_ne(fd, -1);
+    ck_assert_int_eq(pread(fd, &c, 1, sizeof(struct tabcache_header)), 1);
+    c ^= 0xff;
+    ck_assert_int_eq(pwrite(fd, &c, 1, sizeof(struct tabcache_header)), 1);
+    close(fd);
+
+    ck_assert_cache_rejected(dirfd);
+
+    /** snapshot cut short */
+    ck_assert_int_eq(stat(tab_cache, &st), 0);
+    ck_assert_int_eq(truncate(tab_cache, st.st_size - 8), 0);
+    ck_assert_cache_rejected(dirfd);
+
+    ck_assert_int_eq(truncate(tab_cache, sizeof(struct tabcache_header) - 1), 0);
+    ck_assert_cache_rejected(dirfd);
+
+    cache_cleanup(dirfd, dir);
+}
+END_TEST
 
 Suite * parse_tabs_suite(void)
 {
     Suite *s;
     TCase *tc_legacy_tables_parse;
+    TCase *tc_tables_parse_options;
+    TCase *tc_tables_parse_modifiers;
+    TCase *tc_tables_parse_direct;
+    TCase *tc_tables_resolve_user;
+    TCase *tc_tables_parse_template;
+    TCase *tc_tables_hook_equal;
+    TCase *tc_tables_hook_index;
+    TCase *tc_tables_load_parallel;
+    TCase *tc_tables_cache_reuse;
+    TCase *tc_tables_cache_reject;
 
     s = suite_create("Testing tab parsing function");
 
@@ -48,6 +621,46 @@ Suite * parse_tabs_suite(void)
     tcase_add_test(tc_legacy_tables_parse, legacy_tables_parse);
     suite_add_tcase(s, tc_legacy_tables_parse);
 
+    tc_tables_parse_options = tcase_create("parse tables options");
+    tcase_add_test(tc_tables_parse_options, tables_parse_options);
+    suite_add_tcase(s, tc_tables_parse_options);
+
+    tc_tables_parse_modifiers = tcase_create("parse incrond modifiers");
+    tcase_add_test(tc_tables_parse_modifiers, tables_parse_modifiers);
+    suite_add_tcase(s, tc_tables_parse_modifiers);
+
+    tc_tables_parse_direct = tcase_create("parse direct commands");
+    tcase_add_test(tc_tables_parse_direct, tables_parse_direct);
+    suite_add_tcase(s, tc_tables_parse_direct);
+
+    tc_tables_resolve_user = tcase_create("resolve direct commands for hook user");
+    tcase_add_test(tc_tables_resolve_user, tables_resolve_user);
+    suite_add_tcase(s, tc_tables_resolve_user);
+
+    tc_tables_parse_template = tcase_create("parse command templates");
+    tcase_add_test(tc_tables_parse_template, tables_parse_template);
+    suite_add_tcase(s, tc_tables_parse_template);
+
+    tc_tables_hook_equal = tcase_create("compare hooks on reload");
+    tcase_add_test(tc_tables_hook_equal, tables_hook_equal);
+    suite_add_tcase(s, tc_tables_hook_equal);
+
+    tc_tables_hook_index = tcase_create("index hooks by event bit");
+    tcase_add_test(tc_tables_hook_index, tables_hook_index);
+    suite_add_tcase(s, tc_tables_hook_index);
+
+    tc_tables_load_parallel = tcase_create("load tabs in parallel");
+    tcase_add_test(tc_tables_load_parallel, tables_load_parallel);
+    suite_add_tcase(s, tc_tables_load_parallel);
+
+    tc_tables_cache_reuse = tcase_create("reuse tabs from snapshot");
+    tcase_add_test(tc_tables_cache_reuse, tables_cache_reuse);
+    suite_add_tcase(s, tc_tables_cache_reuse);
+
+    tc_tables_cache_reject = tcase_create("reject stale or broken snapshot");
+    tcase_add_test(tc_tables_cache_reject, tables_cache_reject);
+    suite_add_tcase(s, tc_tables_cache_reject);
+
     return s;
 }
 
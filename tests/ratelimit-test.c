@@ -0,0 +1,113 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: CC0-1.0
+#include <check.h>
+
+#include <syslog.h>
+#include <stdlib.h>
+
+#include "../src/incrond-config.c"
+#include "../src/incrond-ratelimit.c"
+
+START_TEST (bucket_rate_burst)
+{
+    struct incron_bucket b = {0};
+    uint64_t now = 1000;
+    unsigned taken = 0;
+
+    bucket_init(&b, 10, 3, now);
+
+    /** full bucket gives burst at once */
+    while(bucket_take(&b, now))
+        taken++;
+
+    ck_assert_uint_eq(taken, 3);
+    ck_assert_uint_eq(bucket_wait(&b), 100);
+
+    /** then exactly rate per second */
+    taken = 0;
+    for(uint64_t end = now + 10000; now <= end; now++)
+        taken += bucket_take(&b, now);
+
+    ck_assert_uint_eq(taken, 100);
+
+    /** idle time refills up to burst only */
+    now += 60000;
+    taken = 0;
+    while(bucket_take(&b, now))
+        taken++;
+
+    ck_assert_uint_eq(taken, 3);
+}
+END_TEST
+
+START_TEST (ratelimit_user_buckets)
+{
+    struct incron_bucket* bucket = 0;
+    uid_t uid = 1000;
+    uint64_t now = 1000;
+
+    spawn_rate = 0;
+    user_spawn_rate = 1;
+    user_spawn_burst = 2;
+
+    ck_assert_int_eq(ratelimit_admit(1000, now), 1);
+    ck_assert_int_eq(ratelimit_admit(1000, now), 1);
+    ck_assert_int_eq(ratelimit_admit(1000, now), 0);
+    ck_assert_uint_eq(ratelimit_wait(1000, now), 1000);
+
+    /** other user has its own bucket */
+    ck_assert_int_eq(ratelimit_admit(1001, now), 1);
+
+    ratelimit_throttled(1000, now);
+    ratelimit_released(1000, now + 1000);
+    ck_assert_int_eq(ratelimit_admit(1000, now + 1000), 1);
+
+    HASH_FIND(hh, user_buckets, &uid, sizeof(uid_t), bucket);
+    ck_assert_ptr_ne(bucket, 0);
+    ck_assert_uint_eq(bucket->throttled, 1);
+    ck_assert_uint_eq(bucket->throttled_ms, 1000);
+
+    ratelimit_free();
+    user_spawn_rate = 0;
+}
+END_TEST
+
+Suite * ratelimit_suite(void)
+{
+    Suite *s;
+    TCase *tc_bucket_rate_burst;
+    TCase *tc_ratelimit_user_buckets;
+
+    s = suite_create("Testing spawn rate limit");
+
+    tc_bucket_rate_burst = tcase_create("bucket keeps rate and burst");
+    tcase_add_test(tc_bucket_rate_burst, bucket_rate_burst);
+    suite_add_tcase(s, tc_bucket_rate_burst);
+
+    tc_ratelimit_user_buckets = tcase_create("users have own buckets");
+    tcase_add_test(tc_ratelimit_user_buckets, ratelimit_user_buckets);
+    suite_add_tcase(s, tc_ratelimit_user_buckets);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    openlog("ratelimit_suite", LOG_PERROR, LOG_DAEMON);
+
+    s = ratelimit_suite();
+    sr = srunner_create(s);
+
+    if(srunner_has_tap(sr))
+        srunner_run_all(sr, CK_SILENT);
+    else
+        srunner_run_all(sr, CK_VERBOSE);
+
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,75 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: CC0-1.0
+/** Compares hook launch rate of SPAWN_FORK and SPAWN_CLONE
+*
+* usage: spawn-bench [rss MiB] [spawns]
+*
+* Touches rss MiB of heap first so fork() has page tables to copy, like
+* a daemon with a large number of watches, then spawns /bin/true
+* sequentially with each method and prints spawns/sec.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../src/incrond-spawn.c"
+
+static double bench(enum spawn_method method, unsigned spawns)
+{
+    char* argv[] = { "/bin/true", 0 };
+    char* envp[] = { "PATH=/usr/local/bin:/usr/bin:/bin", 0 };
+    struct spawn_attr attr = { .dir = 0, .set_user = 0, .stdin_fd = -1, .cgroup_fd = -1 };
+    struct timespec t1, t2;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for(unsigned i = 0; i < spawns; i++) {
+        pid_t pid = spawn_process(method, argv[0], argv, envp, &attr);
+
+        if(pid == -1) {
+            perror("spawn_process");
+            exit(EXIT_FAILURE);
+        }
+
+        waitpid(pid, 0, 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    double elapsed = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+
+    return spawns / elapsed;
+}
+
+int main(int argc, char** argv)
+{
+    size_t rss = argc > 1 ? strtoul(argv[1], 0, 10) : 512;
+    unsigned spawns = argc > 2 ? strtoul(argv[2], 0, 10) : 2000;
+
+    char* ballast = 0;
+
+    if(rss != 0) {
+        ballast = mmap(0, rss << 20, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ballast == MAP_FAILED) {
+            perror("mmap");
+            return EXIT_FAILURE;
+        }
+
+        /** daemon heap is small pages, huge pages would hide page table copy cost */
+        madvise(ballast, rss << 20, MADV_NOHUGEPAGE);
+        memset(ballast, 0x5a, rss << 20);
+    }
+
+    printf("rss %zu MiB, %u spawns of /bin/true\n", rss, spawns);
+    printf("fork  : %10.1f spawns/sec\n", bench(SPAWN_FORK, spawns));
+    printf("clone : %10.1f spawns/sec\n", bench(SPAWN_CLONE, spawns));
+
+    if(ballast != 0)
+        munmap(ballast, rss << 20);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+// SPDX-FileCopyrightText: 2020 Nikita Shubin <me@maquefel.me>
+// SPDX-License-Identifier: CC0-1.0
+#include <check.h>
+
+#include <syslog.h>
+#include <stdlib.h>
+
+#include "../src/incrond-timer.c"
+
+#define TEST_TIMERS 1024
+
+struct test_timer {
+    struct incron_timer timer;
+    uint64_t expires;
+    uint64_t fired_at;
+    int fired;
+};
+
+static struct test_timer timers[TEST_TIMERS];
+static uint64_t test_now;
+
+static void test_timer_func(struct incron_timer* timer)
+{
+    struct test_timer* t = container_of(timer, struct test_timer, timer);
+    t->fired++;
+    t->fired_at = test_now;
+}
+
+static void test_timers_setup(uint64_t range)
+{
+    incron_timer_expire(test_now);
+
+    for(int i = 0; i < TEST_TIMERS; i++) {
+        incron_timer_setup(&timers[i].timer, test_timer_func);
+        timers[i].fired = 0;
+        timers[i].expires = test_now + (uint64_t)random() % range;
+        incron_timer_arm_at(&timers[i].timer, timers[i].expires);
+    }
+}
+
+START_TEST (timer_wheel_exact)
+{
+    test_now = 1000;
+    test_timers_setup(300000);
+
+    /** step one ms at a time, every timer must fire exactly on time */
+    for(uint64_t end = test_now + 300000; test_now <= end; test_now++)
+        incron_timer_expire(test_now);
+
+    for(int i = 0; i < TEST_TIMERS; i++) {
+        ck_assert_int_eq(timers[i].fired, 1);
+        ck_assert_uint_eq(timers[i].fired_at, timers[i].expires);
+    }
+}
+END_TEST
+
+START_TEST (timer_wheel_cancel_rearm)
+{
+    uint64_t range = 24ULL * 3600 * 1000; /** beyond wheel range */
+
+    test_now += 5000;
+    test_timers_setup(range);
+
+    for(int i = 0; i < TEST_TIMERS; i += 3)
+        incron_timer_cancel(&timers[i].timer);
+
+    for(int i = 1; i < TEST_TIMERS; i += 3) {
+        timers[i].expires += 60000;
+        incron_timer_arm_at(&timers[i].timer, timers[i].expires);
+    }
+
+    /** coarse steps, timers may fire late but never early */
+    for(uint64_t end = test_now + range + 60000; test_now <= end; test_now += 1 + random() % 20000)
+        incron_timer_expire(test_now);
+    incron_timer_expire(test_now);
+
+    for(int i = 0; i < TEST_TIMERS; i++) {
+        if(i % 3 == 0) {
+            ck_assert_int_eq(timers[i].fired, 0);
+            ck_assert_int_eq(incron_timer_pending(&timers[i].timer), 0);
+            continue;
+        }
+
+        ck_assert_int_eq(timers[i].fired, 1);
+        ck_assert_msg(timers[i].fired_at >= timers[i].expires, "timer %d fired early", i);
+    }
+}
+END_TEST
+
+Suite * timer_wheel_suite(void)
+{
+    Suite *s;
+    TCase *tc_timer_wheel_exact;
+    TCase *tc_timer_wheel_cancel_rearm;
+
+    s = suite_create("Testing timer wheel");
+
+    tc_timer_wheel_exact = tcase_create("timers fire exactly on time");
+    tcase_add_test(tc_timer_wheel_exact, timer_wheel_exact);
+    suite_add_tcase(s, tc_timer_wheel_exact);
+
+    tc_timer_wheel_cancel_rearm = tcase_create("timers cancel and rearm");
+    tcase_add_test(tc_timer_wheel_cancel_rearm, timer_wheel_cancel_rearm);
+    suite_add_tcase(s, tc_timer_wheel_cancel_rearm);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    openlog("timer_wheel_suite", LOG_PERROR, LOG_DAEMON);
+
+    s = timer_wheel_suite();
+    sr = srunner_create(s);
+
+    if(srunner_has_tap(sr))
+        srunner_run_all(sr, CK_SILENT);
+    else
+        srunner_run_all(sr, CK_VERBOSE);
+
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}